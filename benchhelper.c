@@ -0,0 +1,1203 @@
+/*
+ * benchhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <malloc.h>
+#include <sys/stat.h>
+
+#include "usbhelper.h"
+#include "eventhelper.h"
+#include "ueventhelper.h"
+#include "outputhelper.h"
+#include "formathelper.h"
+#include "ringhelper.h"
+#include "shmhelper.h"
+#include "serverhelper.h"
+#include "filterhelper.h"
+#include "rolluphelper.h"
+#include "capturehelper.h"
+#include "pipehelper.h"
+#include "pushhelper.h"
+#include "sqlitehelper.h"
+#include "sysfshelper.h"
+#include "sensorhelper.h"
+#include "libtemper1.h"
+#include "temper1.h"
+#include "benchhelper.h"
+
+// temper1 bench: times whole sweeps, output included (to /dev/null), of
+// whatever devices the backend has. Built with USB_BACKEND=sim the 
+// devices are described by TEMPER1_SIM; see 'make bench'.
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static long *bench_latency = NULL;
+static int bench_reads = 0, bench_errors = 0, bench_max_reads = 0;
+
+static int bench_temper1(struct usb_dev_handle *handle, char *data, int r)
+{
+	r = use_temper1(handle, data, r);
+	long usec = get_handle_query_usec(handle);
+
+	pthread_mutex_lock(&bench_lock);
+	if (bench_reads < bench_max_reads)
+		bench_latency[bench_reads++] = usec;
+	if (r <= 0)
+		bench_errors++;
+	pthread_mutex_unlock(&bench_lock);
+	return r;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+// Of the sorted latencies
+static long percentile(double p)
+{
+	return bench_reads ? bench_latency[(int)((bench_reads - 1) * p)] : 0;
+}
+
+static double seconds_between(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+// Reads every device through a temper1 process, as a program without
+// libtemper1 has to, returning the number of readings it printed
+static int exec_temper1()
+{
+	int fds[2], lines = 0;
+	char buffer[4096];
+	ssize_t n;
+
+	if (pipe(fds) < 0)
+		return -1;
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl("/proc/self/exe", "temper1", "--config", opts.config_file, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+		while (n-- > 0)
+			lines += (buffer[n] == '\n');
+	}
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	return lines;
+}
+
+// temper1 bench --library: readings a second through libtemper1 against
+// a temper1 process per sweep
+static int bench_library(int sweeps)
+{
+	struct timespec start;
+	int i, j, library_reads = 0, exec_reads = 0;
+
+	temper1_context *ctx = temper1_open(opts.config_file);
+	int devices = ctx ? temper1_devices(ctx, NULL, 0) : 0;
+	temper1_reading *readings = (temper1_reading *)calloc(devices + 1, sizeof(temper1_reading));
+	if (devices == 0 || !readings) {
+		fprintf(stderr, "No devices to benchmark\n");
+		temper1_close(ctx);
+		free(readings);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < sweeps; i++) {
+		int n = temper1_read_all(ctx, readings, devices);
+		for (j = 0; j < n; j++)
+			library_reads += (readings[j].status == 0);
+	}
+	double library = elapsed_usec(&start) / 1e6;
+	temper1_close(ctx);
+	free(readings);
+
+	// The devices have been let go, so that each temper1 can claim them
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < sweeps; i++) {
+		int n = exec_temper1();
+		if (n > 0)
+			exec_reads += n;
+	}
+	double exec = elapsed_usec(&start) / 1e6;
+
+	fprintf(stdout, "{\"devices\":%d,\"sweeps\":%d,\"library_reads\":%d,\"exec_reads\":%d,"
+		"\"library_reads_per_sec\":%.1f,\"exec_reads_per_sec\":%.1f,\"speedup\":%.1f}\n",
+		devices, sweeps, library_reads, exec_reads, library_reads / library, exec_reads / exec,
+		(exec_reads > 0) ? (library_reads / library) / (exec_reads / exec) : 0.0);
+	return 0;
+}
+
+// Forgets every device, freeing its state, as if it had been unplugged
+static struct { u_int8_t bus, dev; } *unplugging = NULL;
+static int unplug_count = 0;
+
+static int note_unplug(struct usb_dev_handle *handle)
+{
+	handle_bus_address(handle, &unplugging[unplug_count].bus, &unplugging[unplug_count].dev);
+	unplug_count++;
+	return 1;
+}
+
+static void unplug_temper1()
+{
+	int i, devices = sweep_usb(count_temper1, 1);
+
+	if (devices == 0 || !(unplugging = calloc(devices, sizeof(*unplugging))))
+		return;
+	unplug_count = 0;
+	sweep_usb(note_unplug, 1);
+	for (i = 0; i < unplug_count; i++)
+		forget_usb_device(unplugging[i].bus, unplugging[i].dev, sensor_release);
+	free(unplugging);
+	unplugging = NULL;
+}
+
+// Lets every device go, then the output
+static void bench_teardown()
+{
+	unplug_temper1();
+	if (output_pipe) {
+		pipeline_stop(output_pipe);
+		output_pipe = NULL;
+	}
+	close_output();
+}
+
+// Opens the output, to output_file, and every device as temper1 does.
+// Returns how many devices there are, having torn down again if none.
+static int bench_setup(const char *output_file)
+{
+	int devices;
+
+	initialise_usb(FALSE);
+	snprintf(opts.output_file, FILENAME_MAX, "%s", output_file);
+	open_output();
+	iterate_usb(sensor_is_temper1, initialise_temper1, NULL, NULL);
+	if ((devices = sweep_usb(count_temper1, 1)) == 0) {
+		fprintf(stderr, "No devices to benchmark\n");
+		bench_teardown();
+	}
+	return devices;
+}
+
+// temper1 bench --uevents: synthetic kernel uevents, as on_hotplug_event
+// receives them, for a TEMPer1 and for an unrelated device plugged in and
+// out, checking which are rescanned and which forgotten. Fails if any
+// check does.
+static int build_uevent(char *buf, int size, const char *action, const char *devtype, 
+	int busnum, int devnum, int vendor, int product)
+{
+	// "action@devpath" then NUL separated KEY=value pairs
+	int len = 0;
+	len += snprintf(buf + len, size - len, "%s@/devices/pci0000:00/usb%d/%d-%d", 
+		action, busnum, busnum, devnum) + 1;
+	len += snprintf(buf + len, size - len, "ACTION=%s", action) + 1;
+	len += snprintf(buf + len, size - len, "DEVPATH=/devices/pci0000:00/usb%d/%d-%d", 
+		busnum, busnum, devnum) + 1;
+	len += snprintf(buf + len, size - len, "SUBSYSTEM=usb") + 1;
+	len += snprintf(buf + len, size - len, "DEVTYPE=%s", devtype) + 1;
+	len += snprintf(buf + len, size - len, "PRODUCT=%x/%x/1", vendor, product) + 1;
+	len += snprintf(buf + len, size - len, "BUSNUM=%03d", busnum) + 1;
+	len += snprintf(buf + len, size - len, "DEVNUM=%03d", devnum) + 1;
+	return len;
+}
+
+static int inject_uevent(const char *action, const char *devtype, 
+	int busnum, int devnum, int vendor, int product)
+{
+	char buf[512];
+	uevent event;
+	int len = build_uevent(buf, sizeof(buf), action, devtype, busnum, devnum, vendor, product);
+
+	rescan_pending = 0;
+	if (uevent_parse(buf, len, &event) <= 0)
+		return 0;
+	apply_uevent(&event);
+	return 1;
+}
+
+static int uevent_checks = 0, uevent_failures = 0;
+
+static void uevent_check(const char *what, int ok)
+{
+	uevent_checks++;
+	if (!ok) {
+		fprintf(stderr, "bench: uevents: %s\n", what);
+		uevent_failures++;
+	}
+}
+
+static u_int8_t first_bus = 0, first_dev = 0;
+
+static int note_first_temper1(struct usb_dev_handle *handle)
+{
+	if (get_handle_data(handle) && first_bus == 0)
+		handle_bus_address(handle, &first_bus, &first_dev);
+	return 0;
+}
+
+static int bench_uevents()
+{
+	const int other_vendor = 0x046d, other_product = 0xc52b;
+	int devices;
+
+	if ((devices = bench_setup("/dev/null")) == 0)
+		return 1;
+	sweep_usb(note_first_temper1, 1);
+
+	uevent_check("TEMPer1 added is not parsed", 
+		inject_uevent("add", "usb_device", first_bus, first_dev, SENSOR_VENDOR_ID, SENSOR_PRODUCT_ID));
+	uevent_check("TEMPer1 added is not rescanned", rescan_pending == RESCAN_ATTEMPTS);
+	uevent_check("other device added is not parsed", 
+		inject_uevent("add", "usb_device", first_bus, 120, other_vendor, other_product));
+	uevent_check("other device added is rescanned", rescan_pending == 0);
+	uevent_check("interface added is parsed", 
+		!inject_uevent("add", "usb_interface", first_bus, first_dev, SENSOR_VENDOR_ID, SENSOR_PRODUCT_ID));
+	uevent_check("interface added is rescanned", rescan_pending == 0);
+
+	inject_uevent("remove", "usb_device", first_bus, 120, other_vendor, other_product);
+	uevent_check("other device removed forgets a TEMPer1", sweep_usb(count_temper1, 1) == devices);
+	inject_uevent("remove", "usb_interface", first_bus, first_dev, SENSOR_VENDOR_ID, SENSOR_PRODUCT_ID);
+	uevent_check("interface removed forgets the TEMPer1", sweep_usb(count_temper1, 1) == devices);
+	inject_uevent("remove", "usb_device", first_bus, first_dev, SENSOR_VENDOR_ID, SENSOR_PRODUCT_ID);
+	uevent_check("TEMPer1 removed is not forgotten", sweep_usb(count_temper1, 1) == devices - 1);
+	inject_uevent("remove", "usb_device", first_bus, first_dev, SENSOR_VENDOR_ID, SENSOR_PRODUCT_ID);
+	uevent_check("TEMPer1 removed twice forgets another", sweep_usb(count_temper1, 1) == devices - 1);
+
+	// Plugged back in, as the next tick after the add would find it
+	inject_uevent("add", "usb_device", first_bus, first_dev, SENSOR_VENDOR_ID, SENSOR_PRODUCT_ID);
+	if (rescan_pending > 0)
+		iterate_usb(sensor_is_temper1, initialise_temper1, NULL, NULL);
+	uevent_check("TEMPer1 added again is not found", sweep_usb(count_temper1, 1) == devices);
+
+	bench_teardown();
+	fprintf(stdout, "{\"devices\":%d,\"checks\":%d,\"failed\":%d}\n", 
+		devices, uevent_checks, uevent_failures);
+	return uevent_failures ? 1 : 0;
+}
+
+// temper1 bench --shm readers: one thread publishing to a slot of the
+// SHM table as fast as it can, against readers each with a mapping of
+// their own. Every field of a reading is derived from its timestamp, so a
+// reader can tell a copy torn between two publishes. Fails if any is.
+// Runs for a while rather than a number of writes, so that a writer on
+// the same CPU as its readers is preempted mid publish now and then.
+#define SHM_BENCH_SECONDS 5
+
+typedef struct shm_bench_reader {
+	pthread_t thread;
+	shm_table *table;
+	unsigned long reads;
+	unsigned long torn;
+} shm_bench_reader;
+
+static int shm_writing = 0;
+
+static void make_reading(shm_reading *reading, int64_t n)
+{
+	snprintf(reading->busport, sizeof(reading->busport), "bench-%lld", (long long)n);
+	reading->timestamp = n;
+	reading->value = (float)(n % 65536);
+	reading->raw = (int16_t)n;
+	reading->status = n % 3;
+}
+
+static void *read_shm(void *arg)
+{
+	shm_bench_reader *reader = (shm_bench_reader *)arg;
+	shm_reading reading, expected;
+
+	while (__atomic_load_n(&shm_writing, __ATOMIC_ACQUIRE)) {
+		if (shm_read_slot(reader->table, 0, &reading) < 0)
+			continue;
+		make_reading(&expected, reading.timestamp);
+		if (strcmp(reading.busport, expected.busport) != 0 || reading.value != expected.value ||
+				reading.raw != expected.raw || reading.status != expected.status)
+			reader->torn++;
+		reader->reads++;
+	}
+	return NULL;
+}
+
+static int bench_shm(int readers)
+{
+	char name[40];
+	shm_table *table;
+	shm_bench_reader *reader;
+	shm_reading reading;
+	struct timespec start;
+	unsigned long reads = 0, torn = 0;
+	double elapsed = 0;
+	int64_t n = 0;
+	int i, started;
+
+	snprintf(name, sizeof(name), "/temper1-bench-%d", (int)getpid());
+	if (!(table = shm_create(name)))
+		return 1;
+	if (shm_slot_for(table, "bench-0") != 0 ||
+			!(reader = (shm_bench_reader *)calloc(readers, sizeof(shm_bench_reader)))) {
+		shm_destroy(table, name);
+		return 1;
+	}
+	make_reading(&reading, 0);
+	shm_publish(table, 0, &reading);
+
+	shm_writing = TRUE;
+	for (started = 0; started < readers; started++) {
+		if (!(reader[started].table = shm_attach(name)))
+			break;
+		if (pthread_create(&reader[started].thread, NULL, read_shm, &reader[started]) != 0) {
+			shm_detach(reader[started].table);
+			break;
+		}
+	}
+	if (started == readers) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 1; n % 65536 || elapsed_usec(&start) < SHM_BENCH_SECONDS * 1000000L; n++) {
+			make_reading(&reading, n);
+			shm_publish(table, 0, &reading);
+		}
+		elapsed = elapsed_usec(&start) / 1e6;
+	}
+	__atomic_store_n(&shm_writing, FALSE, __ATOMIC_RELEASE);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(reader[i].thread, NULL);
+		shm_detach(reader[i].table);
+		reads += reader[i].reads;
+		torn += reader[i].torn;
+	}
+	free(reader);
+	shm_destroy(table, name);
+	if (started < readers)
+		return 1;
+
+	fprintf(stdout, "{\"readers\":%d,\"writes\":%lld,\"reads\":%lu,\"torn\":%lu,"
+		"\"writes_per_sec\":%.1f,\"reads_per_sec\":%.1f}\n",
+		readers, (long long)n, reads, torn, n / elapsed, reads / elapsed);
+	return torn ? 1 : 0;
+}
+
+// temper1 bench --clients count: that many clients asking the SOCKET
+// for readings no more than a second old, round the devices, for a few
+// seconds of the event loop. However many clients there are, each device
+// should be read about once a second; the rest is served from the last
+// reading or shares a read already in flight.
+#define CLIENTS_BENCH_SECONDS 3
+
+typedef struct socket_bench_client {
+	pthread_t thread;
+	int index;
+	unsigned long replies;
+	unsigned long errors;
+} socket_bench_client;
+
+static char (*bench_busports)[BUS_PORT_MAX] = NULL;
+static int bench_busport_count = 0, bench_ticks = 0;
+
+static int note_busport(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev)
+		snprintf(bench_busports[bench_busport_count++], BUS_PORT_MAX, "%s", dev->busport);
+	return 0;
+}
+
+static int count_usb_reads(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	return (dev && dev->stats) ? (int)dev->stats->stages[STATS_READ].count : 0;
+}
+
+static void *ask_socket(void *arg)
+{
+	socket_bench_client *client = (socket_bench_client *)arg;
+	struct sockaddr_un un;
+	char request[BUS_PORT_MAX + 8], reply[SERVER_REPLY_MAX];
+	const char *path = opts.socket_path;
+	int fd, i;
+	ssize_t n;
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	snprintf(un.sun_path, sizeof(un.sun_path), "%.*s", (int)sizeof(un.sun_path) - 1, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || 
+			connect(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+		client->errors++;
+		return NULL;
+	}
+	// Until server_close hangs up
+	for (i = client->index; ; i++) {
+		int length = snprintf(request, sizeof(request), "%s 1\n", 
+			bench_busports[i % bench_busport_count]);
+		if (send(fd, request, length, MSG_NOSIGNAL) != length)
+			break;
+		size_t got = 0;
+		while (got == 0 || reply[got - 1] != '\n') {
+			if ((n = recv(fd, reply + got, sizeof(reply) - got, 0)) <= 0)
+				break;
+			got += n;
+		}
+		if (got == 0 || reply[got - 1] != '\n')
+			break;
+		if (strncmp(reply, "ERROR", 5) == 0)
+			client->errors++;
+		else
+			client->replies++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static int stop_clients_bench(int fd, void *data)
+{
+	if ((bench_ticks += event_timer_expirations(fd)) > CLIENTS_BENCH_SECONDS)
+		event_loop_stop();
+	return 0;
+}
+
+static int bench_clients(int count)
+{
+	socket_bench_client *client = NULL;
+	unsigned long replies = 0, errors = 0;
+	struct timespec start;
+	double elapsed = 0;
+	int devices, server_fd = -1, timer_fd = -1, reads = 0, started = 0, i;
+
+	snprintf(opts.socket_path, FILENAME_MAX, "/tmp/temper1-bench-%d.sock", (int)getpid());
+	if ((devices = bench_setup("/dev/null")) == 0)
+		return 1;
+	if ((bench_busports = calloc(devices, BUS_PORT_MAX)) &&
+			(client = (socket_bench_client *)calloc(count, sizeof(socket_bench_client))) &&
+			(server_fd = server_listen(opts.socket_path, answer_request, refresh_device, release_device)) >= 0 &&
+			(timer_fd = event_timer_create(1)) >= 0) {
+		sweep_usb(note_busport, 1);
+		event_add(timer_fd, stop_clients_bench, NULL);
+		reads = sweep_usb(count_usb_reads, 1);
+		for (started = 0; started < count; started++) {
+			client[started].index = started;
+			if (pthread_create(&client[started].thread, NULL, ask_socket, &client[started]) != 0)
+				break;
+		}
+		if (started == count) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			event_loop_run();
+			elapsed = elapsed_usec(&start) / 1e6;
+			reads = sweep_usb(count_usb_reads, 1) - reads;
+		}
+		event_remove(timer_fd);
+	}
+
+	// Hangs up on the clients, those still waiting on a read included
+	if (server_fd >= 0)
+		server_close(server_fd, opts.socket_path);
+	for (i = 0; i < started; i++) {
+		pthread_join(client[i].thread, NULL);
+		replies += client[i].replies;
+		errors += client[i].errors;
+	}
+	if (timer_fd >= 0)
+		close(timer_fd);
+	free(client);
+	free(bench_busports);
+	bench_busports = NULL;
+	bench_teardown();
+	if (timer_fd < 0 || started < count)
+		return 1;
+
+	fprintf(stdout, "{\"clients\":%d,\"devices\":%d,\"seconds\":%.1f,\"replies\":%lu,\"errors\":%lu,"
+		"\"replies_per_sec\":%.1f,\"usb_reads_per_sec\":%.1f}\n",
+		count, devices, elapsed, replies, errors, replies / elapsed, reads / elapsed);
+	return 0;
+}
+
+// temper1 bench --soak: unplugs and finds again every device cycles times,
+// as a long running daemon sees them come and go, and fails if the
+// registry or the heap has grown since halfway through, by when libc's
+// own first-use allocations (the time zone, stdio buffers) are made
+
+static int bench_soak(int cycles)
+{
+	size_t heap_half = 0, heap_last;
+	int i, devices, open, slots_half = 0, slots;
+
+	if ((devices = bench_setup("/dev/null")) == 0)
+		return 1;
+	for (i = 0; i < cycles; i++) {
+		iterate_usb(sensor_is_temper1, initialise_temper1, NULL, NULL);
+		query_usb(&sensor_query, use_temper1, opts.concurrency);
+		tick_output();
+		devices = sweep_usb(count_temper1, 1);
+		unplug_temper1();
+
+		if (i == cycles / 2 - 1) {
+			heap_half = mallinfo2().uordblks;
+			registry_usage(&open, &slots_half);
+		}
+	}
+	heap_last = mallinfo2().uordblks;
+	registry_usage(&open, &slots);
+	bench_teardown();
+
+	fprintf(stdout, "{\"devices\":%d,\"cycles\":%d,\"open\":%d,\"slots_half\":%d,\"slots\":%d,"
+		"\"heap_half_bytes\":%zu,\"heap_last_bytes\":%zu}\n",
+		devices, cycles, open, slots_half, slots, heap_half, heap_last);
+	return (open > 0 || slots > slots_half || heap_last > heap_half) ? 1 : 0;
+}
+
+// temper1 bench --stall: the output is a pipe whose reader takes stall ms
+// over every 512 bytes, as a stuck awk behind get_temps.sh might. Sweeps
+// are timed with records written inline and then through the PIPELINE.
+static int stall_ms = 0;
+static unsigned long stall_dropped = 0;
+
+static void *slow_reader(void *arg)
+{
+	int fd = *(int *)arg;
+	char buffer[512];
+	struct timespec pause;
+
+	while (read(fd, buffer, sizeof(buffer)) > 0) {
+		int ms = __atomic_load_n(&stall_ms, __ATOMIC_RELAXED);
+		pause.tv_sec = ms / 1000;
+		pause.tv_nsec = (ms % 1000) * 1000000L;
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+// So that the sink is behind from the first sweep
+static void fill_pipe(int fd)
+{
+	char block[512];
+	int flags = fcntl(fd, F_GETFL);
+
+	memset(block, '\n', sizeof(block));
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	while (write(fd, block, sizeof(block)) > 0)
+		;
+	fcntl(fd, F_SETFL, flags);
+}
+
+static int count_dropped(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev && dev->lane)
+		stall_dropped += dev->lane->dropped;
+	return 1;
+}
+
+static void time_sweeps(long *durations, int sweeps)
+{
+	struct timespec started;
+	int i;
+
+	for (i = 0; i < sweeps; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		sweep_temper1();
+		durations[i] = elapsed_usec(&started);
+	}
+	qsort(durations, sweeps, sizeof(long), compare_long);
+}
+
+static int bench_stall(int sweeps, int stall)
+{
+	long inline_usec[sweeps], pipelined_usec[sweeps];
+	char output_file[FILENAME_MAX];
+	pthread_t reader;
+	int fds[2], devices, pipelined = FALSE;
+
+	if (pipe(fds) < 0)
+		return 1;
+	stall_ms = stall;
+	if (pthread_create(&reader, NULL, slow_reader, &fds[0]) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return 1;
+	}
+	snprintf(output_file, sizeof(output_file), "/dev/fd/%d", fds[1]);
+	if ((devices = bench_setup(output_file)) > 0) {
+		fill_pipe(fds[1]);
+		time_sweeps(inline_usec, sweeps);
+		unplug_temper1();
+
+		if ((output_pipe = pipeline_start(sizeof(temper1_sample), opts.pipeline_records, 
+				opts.pipeline_wait_ms, deliver_records, flush_output, NULL))) {
+			fill_pipe(fds[1]);
+			iterate_usb(sensor_is_temper1, initialise_temper1, NULL, NULL);
+			time_sweeps(pipelined_usec, sweeps);
+			sweep_usb(count_dropped, 1);
+			pipelined = TRUE;
+		}
+		// Let the sink catch up with whatever is left
+		__atomic_store_n(&stall_ms, 0, __ATOMIC_RELAXED);
+		bench_teardown();
+	}
+	close(fds[1]);
+	pthread_join(reader, NULL);
+	close(fds[0]);
+	if (!pipelined)
+		return 1;
+
+	fprintf(stdout, "{\"devices\":%d,\"sweeps\":%d,\"stall_ms\":%d,"
+		"\"inline_sweep_p50_us\":%ld,\"inline_sweep_p99_us\":%ld,\"inline_sweep_max_us\":%ld,"
+		"\"pipelined_sweep_p50_us\":%ld,\"pipelined_sweep_p99_us\":%ld,\"pipelined_sweep_max_us\":%ld,"
+		"\"pipelined_dropped\":%lu}\n",
+		devices, sweeps, stall,
+		inline_usec[(sweeps - 1) / 2], inline_usec[(int)((sweeps - 1) * 0.99)], inline_usec[sweeps - 1],
+		pipelined_usec[(sweeps - 1) / 2], pipelined_usec[(int)((sweeps - 1) * 0.99)], pipelined_usec[sweeps - 1],
+		stall_dropped);
+	return 0;
+}
+
+// temper1 bench --push format:protocol: sweeps pushed to a listener on
+// the loopback standing in for Graphite or StatsD, which counts the
+// datagrams and lines that arrive
+static int push_listener = -1;
+static int listening = 0;
+static unsigned long received_lines = 0, received_datagrams = 0;
+
+static void *push_receiver(void *arg)
+{
+	int fd = push_listener, stream = opts.push.stream;
+	char buffer[65536];
+	ssize_t n, i;
+
+	while (stream && (fd = accept(push_listener, NULL, NULL)) < 0) {
+		if (!__atomic_load_n(&listening, __ATOMIC_ACQUIRE))
+			return NULL;
+	}
+	for (;;) {
+		if ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+			received_datagrams++;
+			for (i = 0; i < n; i++)
+				received_lines += (buffer[i] == '\n');
+		}
+		else if (n == 0 || !__atomic_load_n(&listening, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+	if (stream)
+		close(fd);
+	return NULL;
+}
+
+// Whatever is coming has arrived by the time the listener goes quiet
+static void stop_receiver(pthread_t receiver)
+{
+	__atomic_store_n(&listening, FALSE, __ATOMIC_RELEASE);
+	pthread_join(receiver, NULL);
+	close(push_listener);
+	push_listener = -1;
+}
+
+static int bench_push(int sweeps, const char *spec)
+{
+	struct sockaddr_in in;
+	socklen_t length = sizeof(in);
+	struct timeval poll_interval = { 0, 200000 };
+	struct timespec start;
+	char format[16] = "", protocol[8] = "", fields[100];
+	int buffer = 4 * 1024 * 1024, devices, i;
+	pthread_t receiver;
+
+	if (sscanf(spec, "%15[^:]:%7s", format, protocol) != 2) {
+		fprintf(stderr, "bench: --push graphite|statsd:udp|tcp\n");
+		return 1;
+	}
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	push_listener = socket(AF_INET, (strcmp(protocol, "tcp") == 0) ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (push_listener < 0 || bind(push_listener, (struct sockaddr *)&in, sizeof(in)) < 0 ||
+			getsockname(push_listener, (struct sockaddr *)&in, &length) < 0) {
+		perror("bench: listener");
+		if (push_listener >= 0)
+			close(push_listener);
+		return 1;
+	}
+	setsockopt(push_listener, SOL_SOCKET, SO_RCVTIMEO, &poll_interval, sizeof(poll_interval));
+	setsockopt(push_listener, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+	snprintf(fields, sizeof(fields), "%s %s 127.0.0.1:%d bench", format, protocol, ntohs(in.sin_port));
+	if (push_parse(&opts.push, fields) < 0) {
+		fprintf(stderr, "bench: --push graphite|statsd:udp|tcp\n");
+		close(push_listener);
+		return 1;
+	}
+	if (opts.push.stream)
+		listen(push_listener, 1);
+	listening = TRUE;
+	if (pthread_create(&receiver, NULL, push_receiver, NULL) != 0) {
+		close(push_listener);
+		return 1;
+	}
+
+	if ((devices = bench_setup("/dev/null")) == 0) {
+		stop_receiver(receiver);
+		return 1;
+	}
+	if (!push) {
+		bench_teardown();
+		stop_receiver(receiver);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < sweeps; i++)
+		sweep_temper1();
+	while (push->used > push->head && push->fd >= 0)
+		push_flush(push);
+	double elapsed = elapsed_usec(&start) / 1e6;
+	unsigned long sent = push->sent, dropped = push->dropped, datagrams = push->datagrams;
+
+	bench_teardown();
+	stop_receiver(receiver);
+
+	fprintf(stdout, "{\"format\":\"%s\",\"protocol\":\"%s\",\"devices\":%d,\"sweeps\":%d,"
+		"\"lines_sent\":%lu,\"lines_received\":%lu,\"lines_dropped\":%lu,\"datagrams\":%lu,"
+		"\"lines_per_sec\":%.1f,\"datagrams_per_sec\":%.1f}\n",
+		format, protocol, devices, sweeps, sent, received_lines, dropped, 
+		opts.push.stream ? received_datagrams : datagrams,
+		sent / elapsed, (opts.push.stream ? received_datagrams : datagrams) / elapsed);
+	return 0;
+}
+
+// temper1 bench --sysfs devices: bus-port lookups against a made-up
+// /sys/bus/usb/devices of that many devices, each with an interface
+// directory as the real ones have, served from the index against a scan
+// of the directory per lookup as before it was kept
+static int write_sysfs_device(const char *root, const char *name, int devnum)
+{
+	char path[FILENAME_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	if (mkdir(path, 0700) < 0)
+		return -1;
+	if (devnum < 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s/devnum", root, name);
+	if (!(fp = fopen(path, "w")))
+		return -1;
+	fprintf(fp, "%d\n", devnum);
+	fclose(fp);
+	return 0;
+}
+
+static void remove_sysfs_device(const char *root, const char *name)
+{
+	char path[FILENAME_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/devnum", root, name);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	rmdir(path);
+}
+
+static int bench_sysfs(int devices)
+{
+	char root[] = "/tmp/temper1-sysfs.XXXXXX", name[SYSFS_NAME_MAX], found[SYSFS_NAME_MAX];
+	struct timespec start;
+	int i, lookups, misses = 0;
+
+	if (!mkdtemp(root)) {
+		perror("bench: mkdtemp");
+		return 1;
+	}
+	for (i = 0; i < devices; i++) {
+		// 127 devices to a bus as USB allows, devnum 1 being the root hub
+		snprintf(name, sizeof(name), "%d-1.%d", 1 + i / 127, 1 + i % 127);
+		if (write_sysfs_device(root, name, 2 + i % 127) < 0)
+			break;
+		snprintf(name, sizeof(name), "%d-1.%d:1.0", 1 + i / 127, 1 + i % 127);
+		write_sysfs_device(root, name, -1);
+	}
+	sysfs_set_root(root);
+
+	// Every device once from the index, after the one scan that builds it
+	lookups = (devices < 1000) ? devices * 10 : 10000;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < lookups; i++) {
+		int n = i % devices;
+		if (sysfs_find_usb_device_name(1 + n / 127, 2 + n % 127, found) < 0)
+			misses++;
+	}
+	double indexed = elapsed_usec(&start) / 1e6;
+
+	int scans = (lookups < 1000) ? lookups : 1000;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < scans; i++) {
+		int n = i % devices;
+		sysfs_invalidate_index();
+		if (sysfs_find_usb_device_name(1 + n / 127, 2 + n % 127, found) < 0)
+			misses++;
+	}
+	double scanned = elapsed_usec(&start) / 1e6;
+
+	for (i = 0; i < devices; i++) {
+		snprintf(name, sizeof(name), "%d-1.%d", 1 + i / 127, 1 + i % 127);
+		remove_sysfs_device(root, name);
+		snprintf(name, sizeof(name), "%d-1.%d:1.0", 1 + i / 127, 1 + i % 127);
+		remove_sysfs_device(root, name);
+	}
+	rmdir(root);
+	fprintf(stdout, "{\"devices\":%d,\"lookups\":%d,\"misses\":%d,"
+		"\"indexed_lookups_per_sec\":%.1f,\"scanned_lookups_per_sec\":%.1f}\n",
+		devices, lookups + scans, misses, lookups / indexed, scans / scanned);
+	return misses ? 1 : 0;
+}
+
+// temper1 bench --format records: format_render's cost per record for
+// each preset, as a sweep of FORMAT_BENCH_DEVICES devices a second
+// would have it write them. Fails if any record is cut short.
+#define FORMAT_BENCH_DEVICES 100
+
+static int bench_format(int records)
+{
+	const char *presets[] = { FORMAT_PRESET_CSV, FORMAT_PRESET_JSON, FORMAT_PRESET_INFLUX };
+	char busports[FORMAT_BENCH_DEVICES][BUS_PORT_MAX], record[RECORD_MAX];
+	output_format *format;
+	struct timespec start;
+	double ns[3];
+	int i, p, failed = 0;
+
+	for (i = 0; i < FORMAT_BENCH_DEVICES; i++)
+		snprintf(busports[i], BUS_PORT_MAX, "1-%d", i + 1);
+	for (p = 0; p < 3; p++) {
+		if (!(format = format_compile(presets[p], opts.dt_format)))
+			return 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < records; i++) {
+			format_record fr = { 1350000000 + i / FORMAT_BENCH_DEVICES, 20.0 + (i % 1000) / 100.0,
+				5120 + i % 1000, 'C', busports[i % FORMAT_BENCH_DEVICES] };
+			// Cut short, a record loses its newline
+			int n = format_render(format, &fr, record, sizeof(record));
+			if (n == 0 || record[n - 1] != '\n')
+				failed++;
+		}
+		ns[p] = elapsed_usec(&start) * 1000.0 / records;
+		format_free(format);
+	}
+
+	fprintf(stdout, "{\"records\":%d,\"failed\":%d,\"csv_ns_per_record\":%.1f,"
+		"\"json_ns_per_record\":%.1f,\"influx_ns_per_record\":%.1f}\n",
+		records, failed, ns[0], ns[1], ns[2]);
+	return failed ? 1 : 0;
+}
+
+// temper1 bench --sqlite path: sweeps stored a transaction per sweep, as
+// the daemon does, then the same rows committed one at a time. path is
+// created for the run and removed afterwards.
+static void remove_database(const char *path)
+{
+	char scratch[FILENAME_MAX + 8];
+
+	unlink(path);
+	snprintf(scratch, sizeof(scratch), "%s-wal", path);
+	unlink(scratch);
+	snprintf(scratch, sizeof(scratch), "%s-shm", path);
+	unlink(scratch);
+}
+
+static int bench_sqlite(int sweeps, const char *path)
+{
+	struct timespec start;
+	unsigned long rows, i, per_row;
+	int devices, sweep;
+
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, "bench: %s already exists\n", path);
+		return 1;
+	}
+	snprintf(opts.sql.path, sizeof(opts.sql.path), "%s", path);
+	opts.sql.window_seconds = 0;
+
+	if ((devices = bench_setup("/dev/null")) == 0) {
+		remove_database(path);
+		return 1;
+	}
+	if (!database) {
+		bench_teardown();
+		remove_database(path);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (sweep = 0; sweep < sweeps; sweep++)
+		sweep_temper1();
+	double batched = elapsed_usec(&start) / 1e6;
+	rows = database->rows;
+
+	// As many rows again, or enough to time, each in its own transaction
+	per_row = (rows < 20000) ? rows : 20000;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < per_row; i++) {
+		sql_record(database, "bench", (int64_t)time(NULL), 20.0, 5120);
+		sql_flush(database, 0, TRUE);
+	}
+	double single = elapsed_usec(&start) / 1e6;
+	unsigned long errors = database->errors;
+
+	bench_teardown();
+	remove_database(path);
+
+	fprintf(stdout, "{\"devices\":%d,\"sweeps\":%d,\"rows\":%lu,\"failed\":%lu,"
+		"\"sweep_transaction_rows_per_sec\":%.1f,\"row_transaction_rows_per_sec\":%.1f,"
+		"\"speedup\":%.1f}\n",
+		devices, sweeps, rows, errors, rows / batched, per_row / single,
+		(rows / batched) / (per_row / single));
+	return 0;
+}
+
+int run_bench(int argc, char *argv[])
+{
+	static struct option bench_options[] =
+	 {
+	   {"sweeps",  required_argument, 0, 'n'},
+	   {"threads", required_argument, 0, 't'},
+	   {"capture", required_argument, 0, 'c'},
+	   {"library", no_argument,       0, 'l'},
+	   {"soak",    required_argument, 0, 's'},
+	   {"stall",   required_argument, 0, 'S'},
+	   {"push",    required_argument, 0, 'p'},
+	   {"sqlite",  required_argument, 0, 'q'},
+	   {"sysfs",   required_argument, 0, 'f'},
+	   {"uevents", no_argument,       0, 'u'},
+	   {"shm",     required_argument, 0, 'm'},
+	   {"clients", required_argument, 0, 'k'},
+	   {"format",  required_argument, 0, 'F'},
+	   {0, 0, 0, 0}
+	 };
+	int options_index = 0, c, i, sweeps = 20, devices, library = FALSE, soak = 0, stall = 0, sysfs = 0, shm = 0, clients = 0;
+	int uevents = FALSE, format = 0;
+	const char *push_spec = NULL, *sqlite_path = NULL;
+	struct timespec start, end;
+	struct rusage before, after;
+
+	while ((c = getopt_long(argc, argv, "n:t:c:ls:S:p:q:f:um:k:F:", bench_options, &options_index)) != -1) 
+	{
+		switch (c) {
+			case 'l':
+				library = TRUE;
+				break;
+			case 's':
+				if ((soak = atoi(optarg)) < 2)
+					soak = 2;
+				break;
+			case 'S':
+				if ((stall = atoi(optarg)) < 1)
+					stall = 1;
+				break;
+			case 'p':
+				push_spec = optarg;
+				break;
+			case 'q':
+				sqlite_path = optarg;
+				break;
+			case 'u':
+				uevents = TRUE;
+				break;
+			case 'm':
+				if ((shm = atoi(optarg)) < 1)
+					shm = 1;
+				break;
+			case 'k':
+				if ((clients = atoi(optarg)) < 1)
+					clients = 1;
+				break;
+			case 'f':
+				if ((sysfs = atoi(optarg)) < 1)
+					sysfs = 1;
+				break;
+			case 'F':
+				if ((format = atoi(optarg)) < 1)
+					format = 1;
+				break;
+			case 'c':
+				snprintf(opts.capture_file, FILENAME_MAX, "%s", optarg);
+				break;
+			case 'n':
+				if ((sweeps = atoi(optarg)) < 1)
+					sweeps = 1;
+				break;
+			case 't':
+				if ((opts.concurrency = atoi(optarg)) < 1)
+					opts.concurrency = 1;
+				break;
+			default:
+				return 1;
+		}
+	}
+
+	if (library)
+		return bench_library(sweeps);
+	if (soak)
+		return bench_soak(soak);
+	if (stall)
+		return bench_stall(sweeps, stall);
+	if (push_spec)
+		return bench_push(sweeps, push_spec);
+	if (sqlite_path)
+		return bench_sqlite(sweeps, sqlite_path);
+	if (sysfs)
+		return bench_sysfs(sysfs);
+	if (uevents)
+		return bench_uevents();
+	if (shm)
+		return bench_shm(shm);
+	if (clients)
+		return bench_clients(clients);
+	if (format)
+		return bench_format(format);
+
+	// Before the devices, which are each given a number in the log
+	if (strlen(opts.capture_file) > 0 && !(capture = capture_open(opts.capture_file)))
+		return 1;
+	if ((devices = bench_setup("/dev/null")) > 0) {
+		bench_max_reads = sweeps * devices;
+		if (!(bench_latency = (long *)malloc(bench_max_reads * sizeof(long)))) {
+			bench_teardown();
+			devices = 0;
+		}
+	}
+	if (devices == 0) {
+		capture_close(capture);
+		return 1;
+	}
+
+	getrusage(RUSAGE_SELF, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < sweeps; i++) {
+		query_usb(&sensor_query, bench_temper1, opts.concurrency);
+		tick_output();
+		if (capture)
+			capture_flush(capture);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &after);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double cpu = seconds_between(&before.ru_utime, &after.ru_utime) + 
+		seconds_between(&before.ru_stime, &after.ru_stime);
+	qsort(bench_latency, bench_reads, sizeof(long), compare_long);
+	fprintf(stdout, "{\"devices\":%d,\"threads\":%d,\"sweeps\":%d,\"reads\":%d,\"errors\":%d,"
+		"\"sweeps_per_sec\":%.3f,\"reads_per_sec\":%.1f,"
+		"\"latency_p50_us\":%ld,\"latency_p90_us\":%ld,\"latency_p99_us\":%ld,\"latency_max_us\":%ld,"
+		"\"cpu_us_per_sample\":%.2f}\n",
+		devices, opts.concurrency, sweeps, bench_reads, bench_errors,
+		sweeps / elapsed, bench_reads / elapsed,
+		percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0),
+		bench_reads ? cpu * 1e6 / bench_reads : 0.0);
+
+	free(bench_latency);
+	bench_teardown();
+	capture_close(capture);
+	return 0;
+}
+
+// temper1 replay --bench: the batched decode against the per-sample one
+// of the live path, and the largest difference between the two
+int replay_bench(capture_reader *reader)
+{
+	static capture_batch batch;
+	float value[CAPTURE_BATCH];
+	struct timespec start;
+	double scalar = 0, batched = 0, difference = 0, sum = 0;
+	long records = 0;
+	int i, pass, passes = 5;
+
+	for (pass = 0; pass < passes; pass++) {
+		capture_rewind(reader);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (capture_read_batch(reader, &batch) > 0) {
+			if (reader->names_changed) {
+				bind_replay_devices(reader);
+				reader->names_changed = 0;
+			}
+			for (i = 0; i < batch.count; i++) {
+				int raw = decode_raw_data((char *)batch.frame[i]);
+				sum += c_to_u(raw_to_c(&replay_devices[batch.device[i]], raw), opts.units);
+			}
+		}
+		scalar += elapsed_usec(&start) / 1e6;
+
+		capture_rewind(reader);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (capture_read_batch(reader, &batch) > 0) {
+			if (reader->names_changed) {
+				bind_replay_devices(reader);
+				reader->names_changed = 0;
+			}
+			calibrate_batch(&batch, value);
+			convert_batch(value, batch.count, opts.units);
+			for (i = 0; i < batch.count; i++)
+				sum -= value[i];
+			if (pass == 0)
+				records += batch.count;
+		}
+		batched += elapsed_usec(&start) / 1e6;
+	}
+
+	// And that the two agree
+	capture_rewind(reader);
+	while (capture_read_batch(reader, &batch) > 0) {
+		if (reader->names_changed) {
+			bind_replay_devices(reader);
+			reader->names_changed = 0;
+		}
+		calibrate_batch(&batch, value);
+		convert_batch(value, batch.count, opts.units);
+		for (i = 0; i < batch.count; i++) {
+			int raw = decode_raw_data((char *)batch.frame[i]);
+			double d = value[i] - c_to_u(raw_to_c(&replay_devices[batch.device[i]], raw), opts.units);
+			if (d < 0) d = -d;
+			if (d > difference) difference = d;
+		}
+	}
+
+	fprintf(stdout, "{\"records\":%ld,\"passes\":%d,\"scalar_per_sec\":%.0f,\"batched_per_sec\":%.0f,"
+		"\"speedup\":%.2f,\"max_difference\":%g,\"checksum\":%g}\n",
+		records, passes, records * passes / scalar, records * passes / batched, 
+		scalar / batched, difference, sum);
+	return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * benchhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// temper1 bench and temper1 replay --bench, built into temper1-bench by
+// 'make bench' (BENCH=1) and left out of temper1 itself. Include
+// capturehelper.h first.
+
+int run_bench(int argc, char *argv[]);
+// Times the batched decode of a CAPTURE log against the per-sample one
+int replay_bench(capture_reader *reader);
@@ -0,0 +1,173 @@
+/*
+ * calibrationhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "calibrationhelper.h"
+
+#define INITIAL_BUCKETS 64
+
+// FNV-1a
+static unsigned int hash_port(const char *port_descriptor)
+{
+	unsigned int h = 2166136261u;
+	while (*port_descriptor) {
+		h ^= (unsigned char)*port_descriptor++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int calibration_grow(calibration_table *table)
+{
+	unsigned int bucket_count = table->bucket_count * 2, i;
+	calibration **buckets = (calibration **)calloc(bucket_count, sizeof(calibration *));
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < table->bucket_count; i++) {
+		calibration *cal = table->buckets[i], *next;
+		for (; cal; cal = next) {
+			unsigned int b = hash_port(cal->port_descriptor) & (bucket_count - 1);
+			next = cal->next;
+			cal->next = buckets[b];
+			buckets[b] = cal;
+		}
+	}
+	free(table->buckets);
+	table->buckets = buckets;
+	table->bucket_count = bucket_count;
+	return 0;
+}
+
+// The entry for port, added with no calibration and no deadband if there
+// isn't one yet. A later line for the same port replaces the earlier one.
+static calibration *calibration_entry(calibration_table *table, const char *port)
+{
+	unsigned int b = hash_port(port) & (table->bucket_count - 1);
+	calibration *cal;
+
+	for (cal = table->buckets[b]; cal; cal = cal->next) {
+		if (strcmp(cal->port_descriptor, port) == 0)
+			return cal;
+	}
+
+	if (!(cal = (calibration *)malloc(sizeof(calibration))))
+		return NULL;
+	if (!(cal->port_descriptor = strdup(port))) {
+		free(cal);
+		return NULL;
+	}
+	cal->scale = 1.0;
+	cal->offset = 0.0;
+	cal->deadband = -1.0;
+	cal->heartbeat = 0;
+	cal->next = table->buckets[b];
+	table->buckets[b] = cal;
+
+	if (++table->count > table->bucket_count)
+		calibration_grow(table);
+	return cal;
+}
+
+// Returns NULL if the file can't be read, so that a reload can keep the
+// calibrations it already has.
+calibration_table *calibration_load(const char *config_file, int verbose)
+{
+	calibration_table *table;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fp = fopen(config_file, "r");
+
+	if (!fp) 
+		return NULL;
+	if (!(table = (calibration_table *)calloc(1, sizeof(calibration_table)))) {
+		fclose(fp);
+		return NULL;
+	}
+	table->bucket_count = INITIAL_BUCKETS;
+	if (!(table->buckets = (calibration **)calloc(table->bucket_count, sizeof(calibration *)))) {
+		free(table);
+		fclose(fp);
+		return NULL;
+	}
+
+	while (getline(&line, &size, fp) != -1)
+	{
+		if (strstr(line, "CALIBRATION\t") == line) {
+			char port[size];
+			float scale, offset;
+			calibration *cal;
+			if (sscanf(line, "CALIBRATION\t%s\t%f\t%f", port, &scale, &offset) == 3 &&
+					(cal = calibration_entry(table, port))) {
+				cal->scale = scale;
+				cal->offset = offset;
+				if (verbose) fprintf(stderr, "Loaded calibration (%s): scale: %f; offset %f\n", port, scale, offset);
+			}
+		}
+		else if (strstr(line, "DEADBAND\t") == line) {
+			char port[size];
+			float deadband;
+			int heartbeat = 0;
+			calibration *cal;
+			if (sscanf(line, "DEADBAND\t%s\t%f\t%d", port, &deadband, &heartbeat) >= 2 &&
+					deadband >= 0 && (cal = calibration_entry(table, port))) {
+				cal->deadband = deadband;
+				cal->heartbeat = (heartbeat > 0) ? heartbeat : 0;
+				if (verbose) fprintf(stderr, "Loaded deadband (%s): %f; heartbeat %ds\n", port, deadband, cal->heartbeat);
+			}
+		}
+	}
+	free(line);
+	fclose(fp);
+	return table;
+}
+
+const calibration *calibration_find(const calibration_table *table, const char *port_descriptor)
+{
+	calibration *cal;
+
+	if (!table)
+		return NULL;
+	cal = table->buckets[hash_port(port_descriptor) & (table->bucket_count - 1)];
+	for (; cal; cal = cal->next) {
+		if (strcmp(cal->port_descriptor, port_descriptor) == 0)
+			return cal;
+	}
+	return NULL;
+}
+
+void calibration_free(calibration_table *table)
+{
+	unsigned int i;
+
+	if (!table)
+		return;
+	for (i = 0; i < table->bucket_count; i++) {
+		calibration *cal = table->buckets[i], *next;
+		for (; cal; cal = next) {
+			next = cal->next;
+			free(cal->port_descriptor);
+			free(cal);
+		}
+	}
+	free(table->buckets);
+	free(table);
+}
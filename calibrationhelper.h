@@ -0,0 +1,40 @@
+/*
+ * calibrationhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Per-port calibrations from the CALIBRATION and DEADBAND lines of
+// temper1.conf, held in a hash table keyed on the port descriptor 
+// (e.g. "1-1.2").
+
+typedef struct calibration {
+	char *port_descriptor;
+	float scale;
+	float offset;
+	float deadband;		// degrees C, negative if not set
+	int heartbeat;		// seconds, 0 for none
+	struct calibration *next;
+} calibration;
+
+typedef struct calibration_table {
+	calibration **buckets;
+	unsigned int bucket_count;
+	unsigned int count;
+} calibration_table;
+
+calibration_table *calibration_load(const char *config_file, int verbose);
+const calibration *calibration_find(const calibration_table *table, const char *port_descriptor);
+void calibration_free(calibration_table *table);
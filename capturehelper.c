@@ -0,0 +1,266 @@
+/*
+ * capturehelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capturehelper.h"
+
+static void capture_write(capture_log *log)
+{
+	const char *p = (const char *)log->buffer;
+	size_t left = log->used * sizeof(capture_record);
+
+	while (left > 0) {
+		ssize_t n = write(log->fd, p, left);
+		if (n <= 0) {
+			fprintf(stderr, "Unable to write to the capture log\n");
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	log->used = 0;
+}
+
+// Called with the lock held
+static capture_record *capture_next(capture_log *log)
+{
+	if (log->used == CAPTURE_BUFFER)
+		capture_write(log);
+	return &log->buffer[log->used++];
+}
+
+capture_log *capture_open(const char *path)
+{
+	struct stat st;
+	capture_log *log;
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	if (!(log = (capture_log *)calloc(1, sizeof(capture_log)))) {
+		close(fd);
+		return NULL;
+	}
+	log->fd = fd;
+	pthread_mutex_init(&log->lock, NULL);
+
+	// A file left with a partial record would put every later one out
+	// of step, so anything after the last whole record is dropped
+	if (st.st_size % sizeof(capture_record) != 0 && 
+			ftruncate(fd, st.st_size - st.st_size % sizeof(capture_record)) < 0) {
+		fprintf(stderr, "Unable to truncate %s\n", path);
+	}
+	if (st.st_size == 0) {
+		capture_record *header = capture_next(log);
+		memset(header, 0, sizeof(capture_record));
+		header->timestamp = CAPTURE_MAGIC;
+		header->device = CAPTURE_VERSION;
+		header->kind = CAPTURE_HEADER;
+	}
+	return log;
+}
+
+int capture_device(capture_log *log, const char *busport)
+{
+	int i, length = strlen(busport);
+
+	if (length >= CAPTURE_NAME_MAX)
+		return -1;
+	pthread_mutex_lock(&log->lock);
+	for (i = 0; i < log->name_count; i++) {
+		if (strcmp(log->names[i], busport) == 0) {
+			pthread_mutex_unlock(&log->lock);
+			return i;
+		}
+	}
+
+	void *names = realloc(log->names, (log->name_count + 1) * CAPTURE_NAME_MAX);
+	if (!names || log->name_count > UINT16_MAX) {
+		pthread_mutex_unlock(&log->lock);
+		return -1;
+	}
+	log->names = names;
+	strcpy(log->names[log->name_count], busport);
+
+	// Name records are written on every open, so that a reader sees the
+	// numbers this run uses even when appending to an older log
+	capture_record *record = capture_next(log);
+	memset(record, 0, sizeof(capture_record));
+	record->device = log->name_count;
+	record->kind = CAPTURE_NAME;
+	record->frame[0] = length;
+	for (i = 0; i < length; i += sizeof(capture_record)) {
+		record = capture_next(log);
+		memset(record, 0, sizeof(capture_record));
+		memcpy(record, busport + i, (length - i < sizeof(capture_record)) ? length - i : sizeof(capture_record));
+	}
+	i = log->name_count++;
+	pthread_mutex_unlock(&log->lock);
+	return i;
+}
+
+void capture_frame(capture_log *log, int device, int64_t timestamp, const char *frame)
+{
+	pthread_mutex_lock(&log->lock);
+	capture_record *record = capture_next(log);
+	record->timestamp = (uint32_t)timestamp;
+	record->timestamp_high = (uint8_t)(timestamp >> 32);
+	record->device = device;
+	record->kind = CAPTURE_READ;
+	memcpy(record->frame, frame, CAPTURE_FRAME);
+	pthread_mutex_unlock(&log->lock);
+}
+
+void capture_flush(capture_log *log)
+{
+	pthread_mutex_lock(&log->lock);
+	capture_write(log);
+	pthread_mutex_unlock(&log->lock);
+}
+
+void capture_close(capture_log *log)
+{
+	if (!log)
+		return;
+	capture_write(log);
+	close(log->fd);
+	pthread_mutex_destroy(&log->lock);
+	free(log->names);
+	free(log);
+}
+
+capture_reader *capture_open_readonly(const char *path)
+{
+	struct stat st;
+	capture_reader *reader;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(capture_record)) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	if (!(reader = (capture_reader *)calloc(1, sizeof(capture_reader)))) {
+		close(fd);
+		return NULL;
+	}
+	reader->fd = fd;
+	reader->length = st.st_size;
+	reader->count = st.st_size / sizeof(capture_record);
+	reader->records = (const capture_record *)mmap(NULL, reader->length, PROT_READ, MAP_SHARED, fd, 0);
+	if (reader->records == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s\n", path);
+		close(fd);
+		free(reader);
+		return NULL;
+	}
+	madvise((void *)reader->records, reader->length, MADV_SEQUENTIAL);
+
+	const capture_record *header = &reader->records[0];
+	if (header->kind != CAPTURE_HEADER || header->timestamp != CAPTURE_MAGIC || 
+			header->device != CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a capture log\n", path);
+		capture_close_readonly(reader);
+		return NULL;
+	}
+	reader->next = 1;
+	return reader;
+}
+
+// A later name for the same number replaces the earlier one
+static int capture_read_name(capture_reader *reader, const capture_record *record)
+{
+	int length = record->frame[0], spans = (length + sizeof(capture_record) - 1) / sizeof(capture_record);
+
+	if (length >= CAPTURE_NAME_MAX || reader->next + spans > reader->count)
+		return -1;
+	if (record->device >= reader->name_count) {
+		void *names = realloc(reader->names, (record->device + 1) * CAPTURE_NAME_MAX);
+		if (!names)
+			return -1;
+		reader->names = names;
+		memset(reader->names[reader->name_count], 0, 
+			(record->device + 1 - reader->name_count) * CAPTURE_NAME_MAX);
+		reader->name_count = record->device + 1;
+	}
+	memcpy(reader->names[record->device], &reader->records[reader->next], length);
+	reader->names[record->device][length] = '\0';
+	reader->next += spans;
+	reader->names_changed = 1;
+	return 0;
+}
+
+int capture_read_batch(capture_reader *reader, capture_batch *batch)
+{
+	int n = 0;
+
+	while (n < CAPTURE_BATCH && reader->next < reader->count) {
+		const capture_record *record = &reader->records[reader->next++];
+		if (record->kind == CAPTURE_READ) {
+			// Frames from a device not named are left out
+			if (record->device >= reader->name_count)
+				continue;
+			batch->timestamp[n] = ((int64_t)record->timestamp_high << 32) | record->timestamp;
+			batch->device[n] = record->device;
+			batch->raw[n] = (int16_t)((record->frame[2] << 8) | record->frame[3]);
+			batch->frame[n] = record->frame;
+			n++;
+		}
+		else if (record->kind == CAPTURE_NAME) {
+			// The batch so far was read under the names before this one
+			if (n > 0) {
+				reader->next--;
+				break;
+			}
+			if (capture_read_name(reader, record) < 0)
+				reader->next = reader->count;
+		}
+	}
+	batch->count = n;
+	return n;
+}
+
+const char *capture_device_name(const capture_reader *reader, int device)
+{
+	return (device < reader->name_count) ? reader->names[device] : "";
+}
+
+void capture_rewind(capture_reader *reader)
+{
+	reader->next = 1;
+}
+
+void capture_close_readonly(capture_reader *reader)
+{
+	if (!reader)
+		return;
+	munmap((void *)reader->records, reader->length);
+	close(reader->fd);
+	free(reader->names);
+	free(reader);
+}
@@ -0,0 +1,102 @@
+/*
+ * capturehelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// A log of the raw frames read from the devices, so that history can be
+// decoded again once a calibration has been put right. The file is a run
+// of 16 byte records: a header, then frames, each tagged with a device
+// number that an earlier name record gave the bus-port of. A name record
+// is followed by as many records again as its bus-port needs.
+//
+// Timestamps are 40 bits, the low 32 in timestamp and the rest in
+// timestamp_high, which logs from before it was added have as 0: good
+// until the year 36812 rather than wrapping in 2106. Only reads that
+// returned a frame are logged. A frame of zeros is the TEMPer1's answer
+// when not ready, dropped on replay as it is when read live; a read that
+// failed outright leaves no record at all.
+
+#define CAPTURE_MAGIC 0x50433154	/* "T1CP" */
+#define CAPTURE_VERSION 1
+#define CAPTURE_FRAME 8
+#define CAPTURE_NAME_MAX 40
+
+#define CAPTURE_HEADER 0
+#define CAPTURE_READ 1
+#define CAPTURE_NAME 2
+
+typedef struct capture_record {
+	uint32_t timestamp;	// seconds since the epoch; the magic in a header
+	uint16_t device;	// the version in a header
+	uint8_t kind;
+	uint8_t timestamp_high;	// bits 32 to 39 of the timestamp
+	uint8_t frame[CAPTURE_FRAME];	// a name record's length in frame[0]
+} capture_record;
+
+#define CAPTURE_BUFFER 4096	// records held before a write
+
+typedef struct capture_log {
+	int fd;
+	pthread_mutex_t lock;
+	char (*names)[CAPTURE_NAME_MAX];
+	int name_count;
+	int used;
+	capture_record buffer[CAPTURE_BUFFER];
+} capture_log;
+
+// Frames are buffered and written when the buffer fills or on a flush.
+// capture_frame may be called from several threads at once.
+capture_log *capture_open(const char *path);
+// The number to log the device's frames under, the same for a bus-port
+// seen before. Returns -1 if it can't be logged.
+int capture_device(capture_log *log, const char *busport);
+void capture_frame(capture_log *log, int device, int64_t timestamp, const char *frame);
+void capture_flush(capture_log *log);
+void capture_close(capture_log *log);
+
+// Reading back, a batch at a time into parallel arrays so that decoding
+// can work down each array in turn
+#define CAPTURE_BATCH 1024
+
+typedef struct capture_batch {
+	int count;
+	int64_t timestamp[CAPTURE_BATCH];
+	uint16_t device[CAPTURE_BATCH];
+	int16_t raw[CAPTURE_BATCH];	// bytes 2 and 3 of the frame
+	const uint8_t *frame[CAPTURE_BATCH];
+} capture_batch;
+
+typedef struct capture_reader {
+	int fd;
+	size_t length;
+	const capture_record *records;
+	size_t count;
+	size_t next;
+	char (*names)[CAPTURE_NAME_MAX];
+	int name_count;
+	int names_changed;	// since the last batch
+} capture_reader;
+
+capture_reader *capture_open_readonly(const char *path);
+// Fills batch with the next frames, returning how many, 0 at the end
+int capture_read_batch(capture_reader *reader, capture_batch *batch);
+const char *capture_device_name(const capture_reader *reader, int device);
+void capture_rewind(capture_reader *reader);
+void capture_close_readonly(capture_reader *reader);
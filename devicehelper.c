@@ -0,0 +1,566 @@
+/*
+ * devicehelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbhelper.h"
+#include "devicehelper.h"
+
+// Timeouts follow the read latency: the 99th percentile times the margin,
+// within limits, once there are enough reads to go on. Until then a new
+// handle gets TIMEOUT_INITIAL_MS, so that a device wedged from the start
+// doesn't hold each sweep up for the backend's default of 5s.
+#define TIMEOUT_MARGIN 4
+#define TIMEOUT_MIN_MS 200
+#define TIMEOUT_MAX_MS 5000
+#define TIMEOUT_MIN_READS 32
+#define TIMEOUT_INITIAL_MS (TIMEOUT_MIN_MS * TIMEOUT_MARGIN)
+
+// Entries are carved out of blocks of REGISTRY_BLOCK that are never given
+// back: an entry freed by one device is reused by the next, so a daemon
+// that sees devices come and go for months stays at its high-water mark.
+#define REGISTRY_BLOCK 32
+
+typedef struct registry_block {
+	struct registry_block *next;
+	device_handle slots[REGISTRY_BLOCK];
+} registry_block;
+
+device_handle *device_handles = NULL;
+static device_handle *last_handle = NULL;
+static registry_block *blocks = NULL;
+static device_handle *free_slots = NULL;	// chained through next
+static int slot_count = 0;
+
+// Chained hash indexes by device, by handle and by bus-port, with at
+// least twice as many buckets as there are slots
+static device_handle **by_device = NULL;
+static device_handle **by_handle = NULL;
+static device_handle **by_port = NULL;
+static unsigned int bucket_count = 0;
+
+// Only the main thread changes the list, but queries held off it look
+// handles up while it does
+static pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int hash_pointer(const void *p)
+{
+	return (unsigned int)(((uintptr_t)p >> 4) * 2654435761u) & (bucket_count - 1);
+}
+
+// FNV-1a
+static unsigned int hash_port(const char *bus_port)
+{
+	unsigned int h = 2166136261u;
+	while (*bus_port) {
+		h ^= (unsigned char)*bus_port++;
+		h *= 16777619u;
+	}
+	return h & (bucket_count - 1);
+}
+
+static int is_listed(device_handle *dh)
+{
+	return dh->prev || device_handles == dh;
+}
+
+static void index_port(device_handle *dh)
+{
+	unsigned int b = hash_port(dh->bus_port);
+	dh->next_by_port = by_port[b];
+	by_port[b] = dh;
+}
+
+static void index_handle(device_handle *dh)
+{
+	unsigned int b = hash_pointer(dh->device);
+	dh->next_by_device = by_device[b];
+	by_device[b] = dh;
+	b = hash_pointer(dh->handle);
+	dh->next_by_handle = by_handle[b];
+	by_handle[b] = dh;
+	if (dh->bus_port[0])
+		index_port(dh);
+}
+
+static void unindex_port(device_handle *dh)
+{
+	device_handle **link = &by_port[hash_port(dh->bus_port)];
+	while (*link && *link != dh)
+		link = &(*link)->next_by_port;
+	if (*link)
+		*link = dh->next_by_port;
+}
+
+static void unindex_handle(device_handle *dh)
+{
+	device_handle **link = &by_device[hash_pointer(dh->device)];
+	while (*link && *link != dh)
+		link = &(*link)->next_by_device;
+	if (*link)
+		*link = dh->next_by_device;
+	link = &by_handle[hash_pointer(dh->handle)];
+	while (*link && *link != dh)
+		link = &(*link)->next_by_handle;
+	if (*link)
+		*link = dh->next_by_handle;
+	if (dh->bus_port[0])
+		unindex_port(dh);
+}
+
+// Called with registry_lock held for writing
+static int grow_registry()
+{
+	registry_block *block = (registry_block *)calloc(1, sizeof(registry_block));
+	unsigned int buckets = bucket_count ? bucket_count : REGISTRY_BLOCK;
+	device_handle **devices, **handles, **ports, *dh;
+	int i;
+
+	if (!block)
+		return -1;
+	while (buckets < 2 * (slot_count + REGISTRY_BLOCK))
+		buckets *= 2;
+	if (buckets != bucket_count) {
+		devices = (device_handle **)calloc(buckets, sizeof(device_handle *));
+		handles = (device_handle **)calloc(buckets, sizeof(device_handle *));
+		ports = (device_handle **)calloc(buckets, sizeof(device_handle *));
+		if (!devices || !handles || !ports) {
+			free(devices);
+			free(handles);
+			free(ports);
+			free(block);
+			return -1;
+		}
+		free(by_device);
+		free(by_handle);
+		free(by_port);
+		by_device = devices;
+		by_handle = handles;
+		by_port = ports;
+		bucket_count = buckets;
+		for (dh = device_handles; dh; dh = (device_handle *)dh->next)
+			index_handle(dh);
+	}
+
+	block->next = blocks;
+	blocks = block;
+	for (i = REGISTRY_BLOCK - 1; i >= 0; i--) {
+		block->slots[i].next = free_slots;
+		free_slots = &block->slots[i];
+	}
+	slot_count += REGISTRY_BLOCK;
+	return 0;
+}
+
+device_handle *add_device_handle(struct usb_device *dev, struct usb_dev_handle *handle)
+{
+	device_handle *dc;
+
+	pthread_rwlock_wrlock(&registry_lock);
+	if (!free_slots && grow_registry() < 0) {
+		pthread_rwlock_unlock(&registry_lock);
+		return NULL;
+	}
+	dc = free_slots;
+	free_slots = (device_handle *)dc->next;
+
+	memset(dc, 0, sizeof(device_handle));
+	dc->device = dev;
+	dc->handle = handle;
+	pthread_mutex_init(&dc->lock, NULL);
+	dc->closed = FALSE;
+	dc->refs = 1;
+	dc->timeout_ms = TIMEOUT_INITIAL_MS;
+
+	dc->prev = last_handle;
+	if (last_handle) last_handle->next = dc;
+	else device_handles = dc;
+	last_handle = dc;
+	index_handle(dc);
+	pthread_rwlock_unlock(&registry_lock);
+	return dc;
+}
+
+device_handle *get_device_handle_by_device(struct usb_device *dev)
+{
+	device_handle *dh = NULL;
+
+	pthread_rwlock_rdlock(&registry_lock);
+	if (bucket_count) {
+		dh = by_device[hash_pointer(dev)];
+		while (dh != NULL && dh->device != dev)
+			dh = dh->next_by_device;
+	}
+	pthread_rwlock_unlock(&registry_lock);
+	return dh;
+}
+
+static device_handle *find_by_handle(struct usb_dev_handle *handle)
+{
+	device_handle *dh = NULL;
+
+	if (bucket_count) {
+		dh = by_handle[hash_pointer(handle)];
+		while (dh != NULL && dh->handle != handle)
+			dh = dh->next_by_handle;
+	}
+	return dh;
+}
+
+device_handle *get_device_handle_by_handle(struct usb_dev_handle *handle)
+{
+	pthread_rwlock_rdlock(&registry_lock);
+	device_handle *dh = find_by_handle(handle);
+	pthread_rwlock_unlock(&registry_lock);
+	return dh;
+}
+
+// Records the port name the handle was resolved to and indexes it by that
+void name_device_handle(device_handle *dh, const char *bus_port)
+{
+	pthread_rwlock_wrlock(&registry_lock);
+	if (dh->bus_port[0])
+		unindex_port(dh);
+	snprintf(dh->bus_port, BUS_PORT_MAX, "%s", bus_port);
+	if (dh->bus_port[0] && is_listed(dh))
+		index_port(dh);
+	pthread_rwlock_unlock(&registry_lock);
+}
+
+// Open slots against those allocated, for seeing that they are reused
+void registry_usage(int *open, int *slots)
+{
+	device_handle *dh;
+
+	pthread_rwlock_rdlock(&registry_lock);
+	*open = 0;
+	for (dh = device_handles; dh; dh = (device_handle *)dh->next)
+		(*open)++;
+	*slots = slot_count;
+	pthread_rwlock_unlock(&registry_lock);
+}
+
+// The slot goes back to the pool once the last holder lets go of it
+void release_usb_handle(device_handle *dh)
+{
+	if (__atomic_sub_fetch(&dh->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	if (dh->data && dh->free_data)
+		dh->free_data(dh->data);
+	pthread_mutex_destroy(&dh->lock);
+
+	pthread_rwlock_wrlock(&registry_lock);
+	dh->next = free_slots;
+	free_slots = dh;
+	pthread_rwlock_unlock(&registry_lock);
+}
+
+// Taken under the registry lock, so the entry can't be removed and its
+// slot reused between finding it and holding it
+device_handle *hold_usb_handle(struct usb_dev_handle *handle)
+{
+	pthread_rwlock_rdlock(&registry_lock);
+	device_handle *dh = find_by_handle(handle);
+	if (dh)
+		__atomic_add_fetch(&dh->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&registry_lock);
+	return dh;
+}
+
+void remove_device_handle(device_handle *dh)
+{
+	pthread_rwlock_wrlock(&registry_lock);
+	if (!is_listed(dh)) {
+		pthread_rwlock_unlock(&registry_lock);
+		return;
+	}
+	unindex_handle(dh);
+	if (dh->prev) dh->prev->next = dh->next;
+	else device_handles = (device_handle *)dh->next;
+	if (dh->next) ((device_handle *)dh->next)->prev = dh->prev;
+	else last_handle = dh->prev;
+	dh->next = dh->prev = NULL;
+	pthread_rwlock_unlock(&registry_lock);
+	release_usb_handle(dh);
+}
+
+// Called before the handle is closed: waits for any query in flight on it
+// and stops later ones from starting
+void retire_device_handle(device_handle *dh)
+{
+	pthread_mutex_lock(&dh->lock);
+	dh->closed = TRUE;
+	pthread_mutex_unlock(&dh->lock);
+}
+
+// The registry passes data to free_data when the entry is removed
+void set_handle_data(struct usb_dev_handle *handle, void *data, void (*free_data)(void *))
+{
+	device_handle *dh = get_device_handle_by_handle(handle);
+	if (dh) {
+		if (dh->data && dh->free_data)
+			dh->free_data(dh->data);
+		dh->data = data;
+		dh->free_data = free_data;
+	}
+}
+
+void *get_handle_data(struct usb_dev_handle *handle)
+{
+	device_handle *dh = get_device_handle_by_handle(handle);
+	return dh ? dh->data : NULL;
+}
+
+// By the port name cached when the handle was opened
+struct usb_dev_handle *find_usb_handle(const char *bus_port)
+{
+	struct usb_dev_handle *handle = NULL;
+	device_handle *dh = NULL;
+
+	pthread_rwlock_rdlock(&registry_lock);
+	if (bucket_count)
+		dh = by_port[hash_port(bus_port)];
+	for (; dh; dh = dh->next_by_port) {
+		if (strcmp(dh->bus_port, bus_port) == 0) {
+			handle = dh->handle;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&registry_lock);
+	return handle;
+}
+
+long get_handle_query_usec(struct usb_dev_handle *handle)
+{
+	device_handle *dh = get_device_handle_by_handle(handle);
+	return dh ? dh->query_usec : 0;
+}
+
+usb_stats *get_handle_stats(struct usb_dev_handle *handle)
+{
+	device_handle *dh = get_device_handle_by_handle(handle);
+	return dh ? &dh->stats : NULL;
+}
+
+// Only ever called with the handle locked, so a device that stalls for
+// longer than its usual latency is given up on early without holding up
+// the rest of the sweep
+void adapt_timeout(device_handle *dh)
+{
+	const stats_histogram *reads = &dh->stats.stages[STATS_READ];
+	long timeout;
+
+	if (reads->count < TIMEOUT_MIN_READS || reads->count % 8 != 0)
+		return;
+	timeout = stats_percentile(reads, 0.99) * TIMEOUT_MARGIN / 1000;
+	if (timeout < TIMEOUT_MIN_MS)
+		timeout = TIMEOUT_MIN_MS;
+	if (timeout > TIMEOUT_MAX_MS)
+		timeout = TIMEOUT_MAX_MS;
+	dh->timeout_ms = timeout;
+}
+
+void quarantine_usb_handle(struct usb_dev_handle *handle, int sweeps)
+{
+	device_handle *dh = get_device_handle_by_handle(handle);
+	if (dh)
+		dh->skip_sweeps = sweeps;
+}
+
+// Counts a quarantined handle down by one query sweep
+int skip_device_handle(device_handle *dh)
+{
+	if (dh->skip_sweeps <= 0)
+		return FALSE;
+	dh->skip_sweeps--;
+	return TRUE;
+}
+
+void count_usb_error(device_handle *dh, int r)
+{
+	stats_error(&dh->stats, r);
+	if (r == USB_TIMEOUT)
+		dh->stats.timeouts++;
+}
+
+typedef struct sweep_job {
+	int (*do_process)(struct usb_dev_handle *);
+	const usb_query *query;
+	int (*do_result)(struct usb_dev_handle *, char *, int);
+	device_handle **handles;
+	int count;
+	int next;
+	int result;
+	pthread_mutex_t lock;
+} sweep_job;
+
+// A query is a control message followed by an interrupt read, both done
+// synchronously on the calling thread, which holds the handle's lock.
+static int query_locked(const usb_query *q, device_handle *dh, 
+	int (do_result)(struct usb_dev_handle *, char *, int))
+{
+	char data[q->datalength];
+	struct timespec started;
+	long control_usec;
+	int r;
+
+	memset(data, 0, q->datalength);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	r = control_message_within(dh->handle, q->requesttype, q->request, q->value, 
+			q->index, q->question, q->qlength, dh->timeout_ms);
+	control_usec = elapsed_usec(&started);
+	stats_record(&dh->stats.stages[STATS_CONTROL], control_usec);
+	dh->query_usec = control_usec;
+	if (r >= 0) {
+		r = interrupt_read_within(dh->handle, q->endpoint, data, q->datalength, dh->timeout_ms);
+		dh->query_usec = elapsed_usec(&started);
+	}
+	// Failures stay out of the read latency that the timeout follows
+	if (r < 0) {
+		count_usb_error(dh, r);
+	}
+	else {
+		stats_record(&dh->stats.stages[STATS_READ], dh->query_usec - control_usec);
+		adapt_timeout(dh);
+	}
+
+	return do_result(dh->handle, data, r);
+}
+
+// Quarantined devices are skipped, as is one already being queried
+// through query_usb_held, whose result is on the way regardless
+static int query_handle(sweep_job *job, device_handle *dh)
+{
+	int r;
+
+	if (skip_device_handle(dh) || pthread_mutex_trylock(&dh->lock) != 0)
+		return 0;
+	r = query_locked(job->query, dh, job->do_result);
+	pthread_mutex_unlock(&dh->lock);
+	return r;
+}
+
+int query_usb_held(const usb_query *query, device_handle *dh, 
+	int (do_result)(struct usb_dev_handle *, char *, int))
+{
+	int r = -1;
+
+	pthread_mutex_lock(&dh->lock);
+	if (!dh->closed)
+		r = query_locked(query, dh, do_result);
+	pthread_mutex_unlock(&dh->lock);
+	return r;
+}
+
+static int sweep_one(sweep_job *job, device_handle *dh)
+{
+	return job->query ? query_handle(job, dh) : job->do_process(dh->handle);
+}
+
+static void *sweep_worker(void *arg)
+{
+	sweep_job *job = (sweep_job *)arg;
+	int i, r;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->count)
+			break;
+
+		r = sweep_one(job, job->handles[i]);
+
+		pthread_mutex_lock(&job->lock);
+		job->result += r;
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+static int run_sweep(sweep_job *job, int concurrency)
+{
+	device_handle *dh;
+	int i, workers;
+
+	job->count = job->next = job->result = 0;
+	for (dh = device_handles; dh; dh = (device_handle *)dh->next)
+		job->count++;
+	if (job->count == 0)
+		return 0;
+
+	job->handles = (device_handle **)malloc(job->count * sizeof(device_handle *));
+	if (!job->handles)
+		return -1;
+	for (i = 0, dh = device_handles; dh; dh = (device_handle *)dh->next)
+		job->handles[i++] = dh;
+
+	workers = (concurrency < job->count) ? concurrency : job->count;
+	if (workers <= 1) {
+		for (i = 0; i < job->count; i++)
+			job->result += sweep_one(job, job->handles[i]);
+	}
+	else {
+		pthread_t threads[workers];
+		int started = 0;
+
+		// This thread is the last of the workers
+		pthread_mutex_init(&job->lock, NULL);
+		for (i = 0; i < workers - 1; i++) {
+			if (pthread_create(&threads[i], NULL, sweep_worker, job) != 0)
+				break;
+			started++;
+		}
+		sweep_worker(job);
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&job->lock);
+	}
+
+	free(job->handles);
+	return job->result;
+}
+
+// Runs do_process over every open handle without re-enumerating the bus.
+// With a concurrency above one, up to that many workers take handles off
+// a shared queue so a sweep costs roughly one device's latency rather than
+// the sum of them all. do_process must be safe to call from several threads.
+int sweep_usb(int (do_process)(struct usb_dev_handle *), int concurrency)
+{
+	sweep_job job;
+	job.do_process = do_process;
+	job.query = NULL;
+	job.do_result = NULL;
+	return run_sweep(&job, concurrency);
+}
+
+// The threaded query_usb used by the synchronous backends
+int sweep_query(const usb_query *query, 
+	int (do_result)(struct usb_dev_handle *, char *, int), int concurrency)
+{
+	sweep_job job;
+	job.do_process = NULL;
+	job.query = query;
+	job.do_result = do_result;
+	return run_sweep(&job, concurrency);
+}
@@ -0,0 +1,35 @@
+/*
+ * devicehelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Bookkeeping shared by the usbhelper backends: the registry of open
+// handles and the threaded sweeps over them.
+
+extern device_handle *device_handles;
+
+device_handle *add_device_handle(struct usb_device *dev, struct usb_dev_handle *handle);
+device_handle *get_device_handle_by_device(struct usb_device *dev);
+device_handle *get_device_handle_by_handle(struct usb_dev_handle *handle);
+void remove_device_handle(device_handle *dh);
+void name_device_handle(device_handle *dh, const char *bus_port);
+void retire_device_handle(device_handle *dh);
+void count_usb_error(device_handle *dh, int r);
+void adapt_timeout(device_handle *dh);
+int skip_device_handle(device_handle *dh);
+
+int sweep_query(const usb_query *query, 
+	int (do_result)(struct usb_dev_handle *, char *, int), int concurrency);
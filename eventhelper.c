@@ -0,0 +1,162 @@
+/*
+ * eventhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "eventhelper.h"
+
+#define EVENT_MAX 64
+
+typedef struct event_source {
+	int fd;
+	event_callback callback;
+	void *data;
+} event_source;
+
+static event_source sources[EVENT_MAX];
+static int source_count = 0;
+static int running = 0;
+
+int event_add(int fd, event_callback callback, void *data)
+{
+	if (fd < 0 || source_count >= EVENT_MAX)
+		return -1;
+
+	sources[source_count].fd = fd;
+	sources[source_count].callback = callback;
+	sources[source_count].data = data;
+	source_count++;
+	return 0;
+}
+
+int event_remove(int fd)
+{
+	int i;
+	for (i = 0; i < source_count; i++) {
+		if (sources[i].fd == fd) {
+			sources[i] = sources[--source_count];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void event_loop_stop(void)
+{
+	running = 0;
+}
+
+int event_loop_run(void)
+{
+	struct pollfd fds[EVENT_MAX];
+	event_source ready[EVENT_MAX];
+	int i, n, r;
+
+	running = 1;
+	while (running) {
+		n = source_count;
+		for (i = 0; i < n; i++) {
+			fds[i].fd = sources[i].fd;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			ready[i] = sources[i];
+		}
+
+		// Block indefinitely: all wakeups come from the descriptors, so
+		// there is no polling between samples.
+		r = poll(fds, n, -1);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("event_loop_run: poll");
+			return -1;
+		}
+
+		// Callbacks may add or remove sources, so dispatch from the
+		// snapshot taken before the poll.
+		for (i = 0; i < n && running; i++) {
+			if (fds[i].revents == 0)
+				continue;
+			if (ready[i].callback(ready[i].fd, ready[i].data) < 0)
+				event_remove(ready[i].fd);
+		}
+	}
+	return 0;
+}
+
+// Creates a timer that fires on wall-clock multiples of interval seconds.
+// The deadlines are absolute, so time spent handling a tick never shifts
+// the following ones.
+int event_timer_create(int interval)
+{
+	struct itimerspec its;
+	struct timespec now;
+	int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		perror("event_timer_create: timerfd_create");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ((now.tv_sec / interval) + 1) * interval;
+	its.it_interval.tv_sec = interval;
+
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("event_timer_create: timerfd_settime");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Returns the number of intervals elapsed since the last read; more than
+// one means ticks were missed while a sweep overran.
+int event_timer_expirations(int fd)
+{
+	uint64_t expirations = 0;
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	return (int)expirations;
+}
+
+// The signals must already be blocked by the caller so that they are only
+// ever delivered through the descriptor.
+int event_signal_create(const sigset_t *signals)
+{
+	int fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		perror("event_signal_create: signalfd");
+	return fd;
+}
+
+int event_signal_read(int fd)
+{
+	struct signalfd_siginfo info;
+	if (read(fd, &info, sizeof(info)) != sizeof(info))
+		return -1;
+	return (int)info.ssi_signo;
+}
@@ -0,0 +1,33 @@
+/*
+ * eventhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <signal.h>
+
+// Callback run by the loop when fd becomes readable. A negative return
+// removes the descriptor from the loop.
+typedef int (*event_callback)(int fd, void *data);
+
+int event_add(int fd, event_callback callback, void *data);
+int event_remove(int fd);
+int event_loop_run(void);
+void event_loop_stop(void);
+
+int event_timer_create(int interval);
+int event_timer_expirations(int fd);
+int event_signal_create(const sigset_t *signals);
+int event_signal_read(int fd);
@@ -0,0 +1,97 @@
+/*
+ * filterhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+
+#include "filterhelper.h"
+
+int filter_parse(filter_config *config, const char *spec)
+{
+	int burst = config->burst, decimate = config->decimate;
+	float weight = (float)config->ema_weight / FILTER_ONE;
+
+	if (sscanf(spec, "%d %f %d", &burst, &weight, &decimate) < 1)
+		return -1;
+	if (burst < 1 || burst > FILTER_BURST_MAX || 
+			weight <= 0 || weight > 1 || decimate < 1)
+		return -1;
+
+	config->burst = burst;
+	config->ema_weight = (int)(weight * FILTER_ONE + 0.5);
+	if (config->ema_weight < 1)
+		config->ema_weight = 1;
+	config->decimate = decimate;
+	return 0;
+}
+
+int filter_active(const filter_config *config)
+{
+	return config->burst > 1 || config->ema_weight < FILTER_ONE || config->decimate > 1;
+}
+
+void filter_add(const filter_config *config, filter_state *state, int16_t raw)
+{
+	if (state->count < config->burst)
+		state->burst[state->count++] = raw;
+}
+
+// Sorts the burst in place; it holds at most FILTER_BURST_MAX
+static int32_t burst_median(int16_t *burst, int count)
+{
+	int i, j;
+	for (i = 1; i < count; i++) {
+		int16_t raw = burst[i];
+		for (j = i; j > 0 && burst[j - 1] > raw; j--)
+			burst[j] = burst[j - 1];
+		burst[j] = raw;
+	}
+	if (count & 1)
+		return (int32_t)burst[count / 2] * FILTER_ONE;
+	return ((int32_t)burst[count / 2 - 1] + burst[count / 2]) * (FILTER_ONE / 2);
+}
+
+int filter_flush(const filter_config *config, filter_state *state, int32_t *value)
+{
+	// An interval with no good reads adds nothing, but still counts
+	// towards the period so that values keep to the same cadence
+	if (state->count > 0) {
+		int32_t median = burst_median(state->burst, state->count);
+		state->count = 0;
+
+		if (!state->primed) {
+			state->ema = median;
+			state->primed = 1;
+		}
+		else {
+			state->ema += (int32_t)(((int64_t)(median - state->ema) * config->ema_weight) / FILTER_ONE);
+		}
+		state->sum += state->ema;
+		state->values++;
+	}
+
+	if (++state->intervals < config->decimate)
+		return 0;
+
+	int emit = (state->values > 0);
+	if (emit)
+		*value = (int32_t)(state->sum / state->values);
+	state->sum = 0;
+	state->values = 0;
+	state->intervals = 0;
+	return emit;
+}
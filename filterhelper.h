@@ -0,0 +1,53 @@
+/*
+ * filterhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+// Per device smoothing of raw readings, all in integers and without
+// allocation. Each interval takes a burst of reads and keeps their median,
+// which throws out the odd garbage frame. The medians are smoothed by an
+// exponential moving average and every decimate intervals the mean of the
+// smoothed values is emitted. Values are raw readings in 24.8 fixed point.
+
+#define FILTER_BURST_MAX 16
+#define FILTER_ONE 256		// 1.0 in the fixed point used throughout
+
+typedef struct filter_config {
+	int burst;		// reads per interval, 1 to FILTER_BURST_MAX
+	int ema_weight;		// weight of each new median, FILTER_ONE for none
+	int decimate;		// intervals per value emitted
+} filter_config;
+
+typedef struct filter_state {
+	int16_t burst[FILTER_BURST_MAX];
+	int count;		// reads so far this interval
+	int32_t ema;
+	int primed;		// ema holds a value
+	int64_t sum;		// of this period's smoothed values
+	int values;
+	int intervals;		// so far this period
+} filter_state;
+
+// Reads a config such as "5 0.25 10" (burst, EMA weight, decimate), any
+// trailing fields being left as they were. Returns -1 if out of range.
+int filter_parse(filter_config *config, const char *spec);
+int filter_active(const filter_config *config);
+// Adds a read to the interval's burst, ignoring any beyond the burst size
+void filter_add(const filter_config *config, filter_state *state, int16_t raw);
+// Ends the interval. Returns 1 with *value set when one is due, 0 if not.
+int filter_flush(const filter_config *config, filter_state *state, int32_t *value);
@@ -0,0 +1,182 @@
+/*
+ * formathelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "formathelper.h"
+
+#define OP_LITERAL 0
+#define OP_EPOCH 1
+#define OP_DATETIME 2
+#define OP_VALUE 3
+#define OP_UNITS 4
+#define OP_DEVICE 5
+#define OP_RAW 6
+
+static const struct {
+	const char *name;
+	const char *template;
+} presets[] = {
+	{ "CSV", FORMAT_PRESET_CSV },
+	{ "JSON", FORMAT_PRESET_JSON },
+	{ "INFLUX", FORMAT_PRESET_INFLUX },
+};
+
+static void add_op(output_format *format, int type, const char *text, int length)
+{
+	// A literal following a literal (from %%) just extends it
+	if (type == OP_LITERAL && format->count > 0) {
+		format_op *last = &format->ops[format->count - 1];
+		if (last->type == OP_LITERAL && last->text + last->length == text) {
+			last->length += length;
+			return;
+		}
+	}
+	format->ops[format->count].type = type;
+	format->ops[format->count].text = text;
+	format->ops[format->count].length = length;
+	format->count++;
+}
+
+output_format *format_compile(const char *template, const char *dt_format)
+{
+	output_format *format;
+	const char *p, *literal;
+	int i;
+
+	for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+		if (strcmp(template, presets[i].name) == 0) {
+			template = presets[i].template;
+			break;
+		}
+	}
+
+	if (!(format = (output_format *)calloc(1, sizeof(output_format))))
+		return NULL;
+	// Never more ops than characters, plus the newline
+	format->template = strdup(template);
+	format->ops = (format_op *)calloc(strlen(template) + 2, sizeof(format_op));
+	if (!format->template || !format->ops) {
+		format_free(format);
+		return NULL;
+	}
+	snprintf(format->dt_format, sizeof(format->dt_format), "%s", dt_format);
+	format->cached_time = -1;
+
+	for (p = literal = format->template; *p; p++) {
+		int type;
+		if (*p != '%')
+			continue;
+		switch (p[1]) {
+			case 't': type = OP_EPOCH; break;
+			case 'T': type = OP_DATETIME; break;
+			case 'v': type = OP_VALUE; break;
+			case 'u': type = OP_UNITS; break;
+			case 'd': type = OP_DEVICE; break;
+			case 'r': type = OP_RAW; break;
+			case '%': type = OP_LITERAL; break;
+			default: continue;	// left as it is
+		}
+		if (p > literal)
+			add_op(format, OP_LITERAL, literal, p - literal);
+		if (type == OP_LITERAL)
+			add_op(format, OP_LITERAL, p + 1, 1);
+		else
+			add_op(format, type, NULL, 0);
+		literal = p + 2;
+		p++;
+	}
+	if (p > literal)
+		add_op(format, OP_LITERAL, literal, p - literal);
+	add_op(format, OP_LITERAL, "\n", 1);
+	return format;
+}
+
+static void update_time_cache(output_format *format, time_t t)
+{
+	struct tm utc;
+
+	format->cached_time = t;
+	format->cached_epoch_length = snprintf(format->cached_epoch, sizeof(format->cached_epoch), "%ld", (long)t);
+	gmtime_r(&t, &utc);
+	format->cached_datetime_length = strftime(format->cached_datetime, sizeof(format->cached_datetime), 
+		format->dt_format, &utc);
+}
+
+static size_t append(char *buffer, size_t length, size_t size, const char *text, int n)
+{
+	if (length + n >= size)
+		n = size - 1 - length;
+	memcpy(buffer + length, text, n);
+	return length + n;
+}
+
+// Returns the length of the record, truncated to fit size
+int format_render(output_format *format, const format_record *record, char *buffer, size_t size)
+{
+	char number[32];
+	size_t length = 0;
+	int i, n;
+
+	if (size == 0)
+		return 0;
+	if (record->timestamp != format->cached_time)
+		update_time_cache(format, (time_t)record->timestamp);
+
+	for (i = 0; i < format->count; i++) {
+		const format_op *op = &format->ops[i];
+		switch (op->type) {
+			case OP_LITERAL:
+				length = append(buffer, length, size, op->text, op->length);
+				break;
+			case OP_EPOCH:
+				length = append(buffer, length, size, format->cached_epoch, format->cached_epoch_length);
+				break;
+			case OP_DATETIME:
+				length = append(buffer, length, size, format->cached_datetime, format->cached_datetime_length);
+				break;
+			case OP_VALUE:
+				n = snprintf(number, sizeof(number), "%f", record->value);
+				length = append(buffer, length, size, number, n);
+				break;
+			case OP_UNITS:
+				length = append(buffer, length, size, &record->units, 1);
+				break;
+			case OP_DEVICE:
+				length = append(buffer, length, size, record->device, strlen(record->device));
+				break;
+			case OP_RAW:
+				n = snprintf(number, sizeof(number), "%d", record->raw);
+				length = append(buffer, length, size, number, n);
+				break;
+		}
+	}
+	buffer[length] = '\0';
+	return length;
+}
+
+void format_free(output_format *format)
+{
+	if (!format)
+		return;
+	free(format->template);
+	free(format->ops);
+	free(format);
+}
@@ -0,0 +1,65 @@
+/*
+ * formathelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Output record templates. A template is text with placeholders
+//   %t  seconds since the epoch     %T  time formatted with DATETIME
+//   %v  value in the output units   %u  the units (C, F or K)
+//   %d  device bus-port             %r  raw reading
+//   %%  a literal %
+// or the name of a preset (FORMAT_PRESET_*). It is parsed once into a list
+// of ops, and a newline is added to every record.
+
+#define FORMAT_PRESET_CSV "%t,%v,%d"
+#define FORMAT_PRESET_JSON "{\"time\":%t,\"device\":\"%d\",\"value\":%v,\"units\":\"%u\"}"
+#define FORMAT_PRESET_INFLUX "temperature,device=%d,units=%u value=%v %t000000000"
+
+typedef struct format_record {
+	int64_t timestamp;
+	float value;
+	int raw;
+	char units;
+	const char *device;
+} format_record;
+
+typedef struct format_op {
+	int type;
+	const char *text;	// literal ops point into the template copy
+	int length;
+} format_op;
+
+typedef struct output_format {
+	char *template;
+	format_op *ops;
+	int count;
+	char dt_format[100];
+	// The last second formatted, reused until the time moves on
+	time_t cached_time;
+	char cached_epoch[24];
+	int cached_epoch_length;
+	char cached_datetime[80];
+	int cached_datetime_length;
+} output_format;
+
+output_format *format_compile(const char *template, const char *dt_format);
+// Not thread safe: the time cache is shared, so callers serialise renders
+int format_render(output_format *format, const format_record *record, char *buffer, size_t size);
+void format_free(output_format *format);
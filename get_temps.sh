@@ -1,5 +1,5 @@
 #!/bin/sh
 
-temper1/temper1 -C temper1/temper1.conf | \
-awk -F "\"*,\"*" '{ print $1","$2 >> "public_html/temp."$3".csv"}'
-
+# temper1 writes each device's readings to its own file, substituting
+# the bus-port for %d in the output name
+temper1/temper1 -C temper1/temper1.conf -o 'public_html/temp.%d.csv'
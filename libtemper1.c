@@ -0,0 +1,200 @@
+/*
+ * libtemper1.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "usbhelper.h"
+#include "sensorhelper.h"
+#include "calibrationhelper.h"
+#include "libtemper1.h"
+
+typedef struct temper1_sensor {
+	char busport[TEMPER1_BUS_PORT_MAX];
+	float scale;
+	float offset;
+	device_handle *held;
+} temper1_sensor;
+
+struct temper1_context {
+	calibration_table *calibrations;
+	temper1_sensor *sensors;
+	int count;
+};
+
+// Opening and closing, and so the USB registry's membership, is one
+// context at a time
+static pthread_mutex_t library_lock = PTHREAD_MUTEX_INITIALIZER;
+static int library_users = 0;
+static int usb_initialised = 0;
+static temper1_context *opening = NULL;
+
+// The reading a query on this thread fills in
+static __thread temper1_reading *pending = NULL;
+static __thread const temper1_sensor *pending_sensor = NULL;
+
+static int add_sensor(struct usb_dev_handle *handle)
+{
+	temper1_context *ctx = opening;
+	temper1_sensor *sensors = (temper1_sensor *)realloc(ctx->sensors, 
+		(ctx->count + 1) * sizeof(temper1_sensor));
+	if (!sensors)
+		return 0;
+	ctx->sensors = sensors;
+
+	temper1_sensor *sensor = &sensors[ctx->count];
+	memset(sensor, 0, sizeof(temper1_sensor));
+	if (!(sensor->held = hold_usb_handle(handle)))
+		return 0;
+	handle_bus_port(handle, sensor->busport);
+	const calibration *cal = calibration_find(ctx->calibrations, sensor->busport);
+	sensor->scale = (cal && cal->scale != 0) ? cal->scale : 1.0;
+	sensor->offset = cal ? cal->offset : 0.0;
+	ctx->count++;
+	return 1;
+}
+
+temper1_context *temper1_open(const char *config_file)
+{
+	temper1_context *ctx = (temper1_context *)calloc(1, sizeof(temper1_context));
+	if (!ctx)
+		return NULL;
+	if (config_file)
+		ctx->calibrations = calibration_load(config_file, 0);
+
+	pthread_mutex_lock(&library_lock);
+	if (!usb_initialised) {
+		initialise_usb(0);
+		usb_initialised = 1;
+	}
+	library_users++;
+	iterate_usb(sensor_is_temper1, sensor_claim, NULL, NULL);
+	opening = ctx;
+	sweep_usb(add_sensor, 1);
+	opening = NULL;
+	pthread_mutex_unlock(&library_lock);
+	return ctx;
+}
+
+int temper1_devices(temper1_context *ctx, char (*busports)[TEMPER1_BUS_PORT_MAX], int max)
+{
+	int i;
+	for (i = 0; i < ctx->count && i < max; i++)
+		strcpy(busports[i], ctx->sensors[i].busport);
+	return ctx->count;
+}
+
+static int on_frame(struct usb_dev_handle *handle, char *data, int r)
+{
+	temper1_reading *reading = pending;
+
+	reading->timestamp = time(NULL);
+	reading->raw = 0;
+	reading->celsius = 0;
+	if (r > 0 && (reading->raw = sensor_decode(data)) != 0) {
+		reading->celsius = sensor_celsius(reading->raw, pending_sensor->scale, pending_sensor->offset);
+		reading->status = 0;
+	}
+	else {
+		reading->status = (r < 0) ? r : -1;
+	}
+	return reading->status;
+}
+
+static int read_sensor(const temper1_sensor *sensor, temper1_reading *reading)
+{
+	// A device closed since the context was opened (unplugged, say)
+	// fails without on_frame being called
+	memset(reading, 0, sizeof(temper1_reading));
+	strcpy(reading->busport, sensor->busport);
+	reading->status = -1;
+
+	pending = reading;
+	pending_sensor = sensor;
+	query_usb_held(&sensor_query, sensor->held, on_frame);
+	pending = NULL;
+	return reading->status;
+}
+
+int temper1_read(temper1_context *ctx, const char *busport, temper1_reading *reading)
+{
+	int i;
+	for (i = 0; i < ctx->count; i++) {
+		if (strcmp(ctx->sensors[i].busport, busport) == 0)
+			return read_sensor(&ctx->sensors[i], reading);
+	}
+	memset(reading, 0, sizeof(temper1_reading));
+	snprintf(reading->busport, TEMPER1_BUS_PORT_MAX, "%s", busport);
+	reading->status = -1;
+	return -1;
+}
+
+int temper1_read_all(temper1_context *ctx, temper1_reading *readings, int max)
+{
+	int i;
+	for (i = 0; i < ctx->count && i < max; i++)
+		read_sensor(&ctx->sensors[i], &readings[i]);
+	return i;
+}
+
+// Called with library_lock held once the last context has let go
+static struct { u_int8_t bus, dev; } *closing = NULL;
+static int closing_count = 0;
+
+static int count_handle(struct usb_dev_handle *handle)
+{
+	return 1;
+}
+
+static int note_address(struct usb_dev_handle *handle)
+{
+	if (handle_bus_address(handle, &closing[closing_count].bus, &closing[closing_count].dev))
+		closing_count++;
+	return 1;
+}
+
+void temper1_close(temper1_context *ctx)
+{
+	int i;
+
+	if (!ctx)
+		return;
+	for (i = 0; i < ctx->count; i++)
+		release_usb_handle(ctx->sensors[i].held);
+
+	pthread_mutex_lock(&library_lock);
+	if (--library_users == 0) {
+		int devices = sweep_usb(count_handle, 1);
+		if ((closing = calloc(devices + 1, sizeof(*closing)))) {
+			closing_count = 0;
+			sweep_usb(note_address, 1);
+			for (i = 0; i < closing_count; i++)
+				forget_usb_device(closing[i].bus, closing[i].dev, sensor_release);
+			free(closing);
+			closing = NULL;
+		}
+	}
+	pthread_mutex_unlock(&library_lock);
+
+	calibration_free(ctx->calibrations);
+	free(ctx->sensors);
+	free(ctx);
+}
@@ -0,0 +1,49 @@
+/*
+ * libtemper1.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+// libtemper1: readings from TEMPer1s for programs of their own, without
+// running temper1. Open a context, read one device or all of them as
+// often as needed, and close it. A context may be read from several
+// threads at once; a device is only ever read by one of them at a time.
+// Contexts share the devices they find, which stay claimed until the
+// last context is closed.
+
+#define TEMPER1_BUS_PORT_MAX 40
+
+typedef struct temper1_reading {
+	char busport[TEMPER1_BUS_PORT_MAX];	// e.g. "1-1.2"
+	int64_t timestamp;		// seconds since the epoch
+	float celsius;			// calibrated
+	int16_t raw;
+	int status;			// 0, or negative if the read failed
+} temper1_reading;
+
+typedef struct temper1_context temper1_context;
+
+// Claims every TEMPer1 that can be opened. Calibrations are read from the
+// CALIBRATION lines of config_file, which may be NULL for none.
+temper1_context *temper1_open(const char *config_file);
+// The number of devices, and their bus-ports in busports[0 .. max-1]
+int temper1_devices(temper1_context *ctx, char (*busports)[TEMPER1_BUS_PORT_MAX], int max);
+// Returns 0, or negative if the device is unknown or the read failed
+int temper1_read(temper1_context *ctx, const char *busport, temper1_reading *reading);
+// Reads up to max devices, returning how many readings were filled in
+int temper1_read_all(temper1_context *ctx, temper1_reading *readings, int max);
+void temper1_close(temper1_context *ctx);
@@ -0,0 +1,235 @@
+/*
+ * metricshelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "eventhelper.h"
+#include "metricshelper.h"
+
+#define METRICS_UNIX_PREFIX "unix:"
+#define METRICS_REQUEST_MAX 2048
+#define METRICS_CLIENTS_MAX 8
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+typedef struct metrics_client {
+	char request[METRICS_REQUEST_MAX];
+	size_t length;
+} metrics_client;
+
+static metrics_render renderer = NULL;
+static metrics_page page = { NULL, 0, 0 };
+static int clients = 0;
+
+void metrics_printf(metrics_page *page, const char *format, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;) {
+		va_start(args, format);
+		n = vsnprintf(page->text + page->length, page->size - page->length, format, args);
+		va_end(args);
+		if (n < 0)
+			return;
+		if (page->length + n < page->size)
+			break;
+
+		// The page is kept between scrapes, so this only happens while
+		// it grows to fit the number of devices
+		size_t size = page->size ? page->size * 2 : 4096;
+		while (size <= page->length + n)
+			size *= 2;
+		char *text = (char *)realloc(page->text, size);
+		if (!text)
+			return;
+		page->text = text;
+		page->size = size;
+	}
+	page->length += n;
+}
+
+static void send_all(int fd, const char *data, size_t length)
+{
+	ssize_t n;
+	while (length > 0) {
+		n = send(fd, data, length, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		data += n;
+		length -= n;
+	}
+}
+
+static void respond(int fd, const char *request)
+{
+	char header[200];
+	int length;
+	const char *status = "200 OK";
+
+	page.length = 0;
+	if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+		renderer(&page);
+		metrics_printf(&page, "# EOF\n");
+	}
+	else {
+		status = "404 Not Found";
+		metrics_printf(&page, "Not found, try /metrics\n");
+	}
+
+	length = snprintf(header, sizeof(header), 
+		"HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+		status, (*status == '2') ? METRICS_CONTENT_TYPE : "text/plain", (unsigned long)page.length);
+	send_all(fd, header, length);
+	send_all(fd, page.text, page.length);
+}
+
+static int close_client(int fd, metrics_client *client)
+{
+	close(fd);
+	free(client);
+	clients--;
+	return -1;
+}
+
+// A scrape is answered as soon as its request headers are in, and the
+// connection closed. A page is small enough for the socket buffer, so
+// sending it can not hold up the loop for long.
+static int on_client(int fd, void *data)
+{
+	metrics_client *client = (metrics_client *)data;
+	ssize_t n;
+
+	n = recv(fd, client->request + client->length, 
+		METRICS_REQUEST_MAX - 1 - client->length, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return close_client(fd, client);
+
+	client->length += n;
+	client->request[client->length] = '\0';
+	if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n")) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		respond(fd, client->request);
+		return close_client(fd, client);
+	}
+	if (client->length >= METRICS_REQUEST_MAX - 1)
+		return close_client(fd, client);
+	return 0;
+}
+
+static int on_accept(int fd, void *data)
+{
+	int client_fd;
+	metrics_client *client;
+
+	while ((client_fd = accept(fd, NULL, NULL)) >= 0) {
+		// Keep clear of the loop's limit whatever the scrapers do
+		if (clients >= METRICS_CLIENTS_MAX || !(client = (metrics_client *)calloc(1, sizeof(metrics_client)))) {
+			close(client_fd);
+			continue;
+		}
+		fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+		struct timeval timeout = { 1, 0 };
+		setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		clients++;
+		if (event_add(client_fd, on_client, client) < 0)
+			close_client(client_fd, client);
+	}
+	return 0;
+}
+
+// address is [host:]port for TCP (host defaults to 127.0.0.1) or 
+// unix:path for a Unix domain socket. Returns the listening descriptor,
+// already added to the event loop.
+int metrics_listen(const char *address, metrics_render render)
+{
+	int fd, r, on = 1;
+
+	if (strncmp(address, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX)) == 0) {
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		snprintf(un.sun_path, sizeof(un.sun_path), "%s", address + strlen(METRICS_UNIX_PREFIX));
+		unlink(un.sun_path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+			perror("metrics_listen: socket");
+			return -1;
+		}
+		r = bind(fd, (struct sockaddr *)&un, sizeof(un));
+	}
+	else {
+		struct sockaddr_in in;
+		char host[64] = "127.0.0.1";
+		const char *port = strrchr(address, ':');
+		if (port) {
+			snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+			port++;
+		}
+		else {
+			port = address;
+		}
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(atoi(port));
+		if (inet_pton(AF_INET, host, &in.sin_addr) != 1) {
+			fprintf(stderr, "metrics_listen: bad address %s\n", address);
+			return -1;
+		}
+		if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+			perror("metrics_listen: socket");
+			return -1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		r = bind(fd, (struct sockaddr *)&in, sizeof(in));
+	}
+
+	if (r < 0 || listen(fd, METRICS_CLIENTS_MAX) < 0) {
+		perror("metrics_listen: bind");
+		close(fd);
+		return -1;
+	}
+	renderer = render;
+	event_add(fd, on_accept, NULL);
+	return fd;
+}
+
+void metrics_close(int fd, const char *address)
+{
+	if (fd < 0)
+		return;
+	event_remove(fd);
+	close(fd);
+	if (strncmp(address, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX)) == 0)
+		unlink(address + strlen(METRICS_UNIX_PREFIX));
+	free(page.text);
+	page.text = NULL;
+	page.length = page.size = 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * metricshelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+
+// A minimal HTTP server for a Prometheus/OpenMetrics scrape of /metrics,
+// run from the daemon's event loop. Pages are rendered from what is
+// already in memory; nothing on this path may wait on a device.
+
+typedef struct metrics_page {
+	char *text;
+	size_t length;
+	size_t size;
+} metrics_page;
+
+// Called for every scrape to fill in the page
+typedef void (*metrics_render)(metrics_page *page);
+
+int metrics_listen(const char *address, metrics_render render);
+void metrics_close(int fd, const char *address);
+
+void metrics_printf(metrics_page *page, const char *format, ...)
+	__attribute__ ((format (printf, 2, 3)));
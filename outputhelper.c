@@ -0,0 +1,274 @@
+/*
+ * outputhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "outputhelper.h"
+#include "strreplace.h"
+
+#define MIN_BUFFER 4096
+#define SHARD_BUFFER 4096
+
+static int open_path(const char *path)
+{
+	int fd;
+
+	if (path[0] == '\0')
+		return STDOUT_FILENO;
+	// Appending, so that every reading is kept and logrotate can move the
+	// file out from under us between reopens
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+		fprintf(stderr, "Unable to open %s for appending\n", path);
+	return fd;
+}
+
+output_sink *output_open(const char *path, const output_policy *policy)
+{
+	output_sink *sink = (output_sink *)calloc(1, sizeof(output_sink));
+	if (!sink)
+		return NULL;
+
+	snprintf(sink->path, sizeof(sink->path), "%s", path ? path : "");
+	sink->policy = *policy;
+	sink->size = (policy->flush_bytes > MIN_BUFFER) ? policy->flush_bytes : MIN_BUFFER;
+	sink->last_sync = time(NULL);
+	if (!(sink->buffer = (char *)malloc(sink->size)) || 
+			(sink->fd = open_path(sink->path)) < 0) {
+		free(sink->buffer);
+		free(sink);
+		return NULL;
+	}
+	return sink;
+}
+
+int output_flush(output_sink *sink)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < sink->used) {
+		r = write(sink->fd, sink->buffer + done, sink->used - done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("output_flush: write");
+			break;
+		}
+		done += r;
+	}
+	// Whatever could not be written is dropped rather than grown without bound
+	sink->used = 0;
+	return (done > 0) ? (int)done : 0;
+}
+
+int output_write(output_sink *sink, const char *record, size_t length)
+{
+	if (sink->used + length > sink->size)
+		output_flush(sink);
+	if (length > sink->size) 
+		return (int)write(sink->fd, record, length);
+
+	if (sink->used == 0)
+		sink->oldest = time(NULL);
+	memcpy(sink->buffer + sink->used, record, length);
+	sink->used += length;
+
+	if (sink->policy.flush_bytes > 0 && sink->used >= sink->policy.flush_bytes)
+		output_flush(sink);
+	return (int)length;
+}
+
+// Applies the time based parts of the policy; called once per sweep
+int output_tick(output_sink *sink, time_t now)
+{
+	int r = 0;
+
+	if (sink->used > 0 && now - sink->oldest >= sink->policy.flush_seconds)
+		r = output_flush(sink);
+
+	if (sink->policy.fsync_seconds > 0 && sink->fd != STDOUT_FILENO && 
+			now - sink->last_sync >= sink->policy.fsync_seconds) {
+		fdatasync(sink->fd);
+		sink->last_sync = now;
+	}
+	return r;
+}
+
+// For logrotate: buffered records go to the old file, new ones to the new
+int output_reopen(output_sink *sink)
+{
+	int fd;
+
+	output_flush(sink);
+	if (sink->fd == STDOUT_FILENO)
+		return 0;
+	if ((fd = open_path(sink->path)) < 0)
+		return -1;
+	close(sink->fd);
+	sink->fd = fd;
+	return 0;
+}
+
+void output_close(output_sink *sink)
+{
+	if (!sink)
+		return;
+	output_flush(sink);
+	if (sink->fd != STDOUT_FILENO) {
+		if (sink->policy.fsync_seconds > 0)
+			fdatasync(sink->fd);
+		close(sink->fd);
+	}
+	free(sink->buffer);
+	free(sink);
+}
+
+int output_is_template(const char *path)
+{
+	return (path && strstr(path, OUTPUT_DEVICE_PATTERN) != NULL);
+}
+
+output_shards *output_shards_create(const char *template, const output_policy *policy, int max_open)
+{
+	output_shards *shards = (output_shards *)calloc(1, sizeof(output_shards));
+	if (!shards)
+		return NULL;
+
+	snprintf(shards->template, sizeof(shards->template), "%s", template);
+	// Many files are open at once, so each gets a small buffer
+	shards->policy = *policy;
+	if (shards->policy.flush_bytes == 0 || shards->policy.flush_bytes > SHARD_BUFFER)
+		shards->policy.flush_bytes = SHARD_BUFFER;
+	shards->max_open = (max_open > 0) ? max_open : 1;
+	for (shards->bucket_count = 16; shards->bucket_count < 2 * shards->max_open; )
+		shards->bucket_count *= 2;
+	if (!(shards->buckets = (output_shard **)calloc(shards->bucket_count, sizeof(output_shard *)))) {
+		free(shards);
+		return NULL;
+	}
+	return shards;
+}
+
+// FNV-1a
+static unsigned int hash_key(const char *key)
+{
+	unsigned int h = 2166136261u;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void unlink_shard(output_shards *shards, output_shard *shard)
+{
+	if (shard->newer) shard->newer->older = shard->older;
+	else shards->newest = shard->older;
+	if (shard->older) shard->older->newer = shard->newer;
+	else shards->oldest = shard->newer;
+	shard->newer = shard->older = NULL;
+}
+
+static void link_newest(output_shards *shards, output_shard *shard)
+{
+	shard->older = shards->newest;
+	shard->newer = NULL;
+	if (shards->newest) shards->newest->newer = shard;
+	shards->newest = shard;
+	if (!shards->oldest) shards->oldest = shard;
+}
+
+static void close_shard(output_shards *shards, output_shard *shard)
+{
+	output_shard **link = &shards->buckets[hash_key(shard->key) & (shards->bucket_count - 1)];
+	while (*link != shard)
+		link = &(*link)->chain;
+	*link = shard->chain;
+
+	unlink_shard(shards, shard);
+	output_close(shard->sink);
+	free(shard->key);
+	free(shard);
+	shards->open--;
+}
+
+output_sink *output_shard_sink(output_shards *shards, const char *key)
+{
+	unsigned int b = hash_key(key) & (shards->bucket_count - 1);
+	output_shard *shard;
+	char *path;
+
+	for (shard = shards->buckets[b]; shard; shard = shard->chain) {
+		if (strcmp(shard->key, key) == 0) {
+			if (shard != shards->newest) {
+				unlink_shard(shards, shard);
+				link_newest(shards, shard);
+			}
+			return shard->sink;
+		}
+	}
+
+	if (shards->open >= shards->max_open)
+		close_shard(shards, shards->oldest);
+
+	if (!(shard = (output_shard *)calloc(1, sizeof(output_shard))))
+		return NULL;
+	if (!(path = strreplace(shards->template, OUTPUT_DEVICE_PATTERN, key)) || 
+			!(shard->key = strdup(key)) ||
+			!(shard->sink = output_open(path, &shards->policy))) {
+		free(path);
+		free(shard->key);
+		free(shard);
+		return NULL;
+	}
+	free(path);
+
+	shard->chain = shards->buckets[b];
+	shards->buckets[b] = shard;
+	link_newest(shards, shard);
+	shards->open++;
+	return shard->sink;
+}
+
+void output_shards_tick(output_shards *shards, time_t now)
+{
+	output_shard *shard;
+	for (shard = shards->newest; shard; shard = shard->older)
+		output_tick(shard->sink, now);
+}
+
+// Closing is enough: each file is opened again when next written to
+void output_shards_reopen(output_shards *shards)
+{
+	while (shards->oldest)
+		close_shard(shards, shards->oldest);
+}
+
+void output_shards_close(output_shards *shards)
+{
+	if (!shards)
+		return;
+	output_shards_reopen(shards);
+	free(shards->buckets);
+	free(shards);
+}
@@ -0,0 +1,83 @@
+/*
+ * outputhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+// A long-lived, buffered output file. Records are collected in memory and
+// written out when the buffer reaches flush_bytes or its oldest record is
+// flush_seconds old; 0 seconds means at every output_tick. With
+// fsync_seconds above 0 the file is also synced at most that often.
+
+typedef struct output_policy {
+	size_t flush_bytes;
+	int flush_seconds;
+	int fsync_seconds;
+} output_policy;
+
+typedef struct output_sink {
+	char path[FILENAME_MAX];	// "" for stdout
+	int fd;
+	char *buffer;
+	size_t size;
+	size_t used;
+	time_t oldest;
+	time_t last_sync;
+	output_policy policy;
+} output_sink;
+
+output_sink *output_open(const char *path, const output_policy *policy);
+int output_write(output_sink *sink, const char *record, size_t length);
+int output_flush(output_sink *sink);
+int output_tick(output_sink *sink, time_t now);
+int output_reopen(output_sink *sink);
+void output_close(output_sink *sink);
+
+// A set of sinks, one per device, whose paths come from a template with
+// OUTPUT_DEVICE_PATTERN in place of the device's bus-port. At most max_open
+// are kept open; the least recently written is closed to make room and
+// is opened again (appending) when next needed.
+
+#define OUTPUT_DEVICE_PATTERN "%d"
+
+typedef struct output_shard {
+	char *key;
+	output_sink *sink;
+	struct output_shard *newer;
+	struct output_shard *older;
+	struct output_shard *chain;
+} output_shard;
+
+typedef struct output_shards {
+	char template[FILENAME_MAX];
+	output_policy policy;
+	int max_open;
+	int open;
+	output_shard **buckets;
+	unsigned int bucket_count;
+	output_shard *newest;
+	output_shard *oldest;
+} output_shards;
+
+int output_is_template(const char *path);
+output_shards *output_shards_create(const char *template, const output_policy *policy, int max_open);
+output_sink *output_shard_sink(output_shards *shards, const char *key);
+void output_shards_tick(output_shards *shards, time_t now);
+void output_shards_reopen(output_shards *shards);
+void output_shards_close(output_shards *shards);
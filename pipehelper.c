@@ -0,0 +1,272 @@
+/*
+ * pipehelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+
+#include "pipehelper.h"
+
+pipe_ring *pipe_ring_create(size_t record_size, unsigned int capacity)
+{
+	unsigned int size = 2;
+	pipe_ring *ring;
+
+	while (size < capacity)
+		size <<= 1;
+	if (posix_memalign((void **)&ring, PIPE_CACHE_LINE, sizeof(pipe_ring)) != 0)
+		return NULL;
+	memset(ring, 0, sizeof(pipe_ring));
+	if (!(ring->records = (char *)malloc(size * record_size))) {
+		free(ring);
+		return NULL;
+	}
+	ring->record_size = record_size;
+	ring->mask = size - 1;
+	return ring;
+}
+
+// Producer only. Returns -1 if the ring is full.
+int pipe_ring_push(pipe_ring *ring, const void *record)
+{
+	unsigned int head = ring->head;
+
+	if (head - ring->cached_tail > ring->mask) {
+		ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head - ring->cached_tail > ring->mask)
+			return -1;
+	}
+	memcpy(ring->records + (head & ring->mask) * ring->record_size, record, ring->record_size);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Consumer only. Copies out up to max records, oldest first.
+unsigned int pipe_ring_pop(pipe_ring *ring, void *records, unsigned int max)
+{
+	unsigned int tail = ring->tail, count, first;
+
+	if (ring->cached_head == tail)
+		ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	count = ring->cached_head - tail;
+	if (count > max)
+		count = max;
+	if (count == 0)
+		return 0;
+
+	// In at most two pieces, either side of the end of the buffer
+	first = ring->mask + 1 - (tail & ring->mask);
+	if (first > count)
+		first = count;
+	memcpy(records, ring->records + (tail & ring->mask) * ring->record_size, first * ring->record_size);
+	memcpy((char *)records + first * ring->record_size, ring->records, (count - first) * ring->record_size);
+	__atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+void pipe_ring_free(pipe_ring *ring)
+{
+	if (ring) {
+		free(ring->records);
+		free(ring);
+	}
+}
+
+static void free_lane(pipe_lane *lane)
+{
+	pipe_ring_free(lane->ring);
+	free(lane);
+}
+
+// Lanes are only unlinked and freed here, on the pipeline's thread, so the
+// walk needs no lock: producers only ever append.
+static void drain_lanes(pipeline *p)
+{
+	pipe_lane *lane, *next, *prev = NULL;
+	unsigned int count;
+
+	pthread_mutex_lock(&p->lock);
+	lane = p->lanes;
+	pthread_mutex_unlock(&p->lock);
+
+	for (; lane; lane = next) {
+		// Retired before the drain, so nothing can follow what is drained
+		int retired = __atomic_load_n(&lane->retired, __ATOMIC_ACQUIRE);
+		while ((count = pipe_ring_pop(lane->ring, p->batch, PIPE_BATCH)) > 0)
+			p->deliver(lane, p->batch, count, p->arg);
+
+		pthread_mutex_lock(&p->lock);
+		next = lane->next;
+		if (retired) {
+			if (prev) prev->next = next;
+			else p->lanes = next;
+			if (p->last_lane == lane)
+				p->last_lane = prev;
+		}
+		pthread_mutex_unlock(&p->lock);
+		if (retired)
+			free_lane(lane);
+		else
+			prev = lane;
+	}
+}
+
+static void *pipeline_thread(void *arg)
+{
+	pipeline *p = (pipeline *)arg;
+	struct timespec until;
+	int stopping = 0;
+
+	while (!stopping) {
+		pthread_mutex_lock(&p->lock);
+		if (!p->kicked && !p->stopping) {
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += 1;
+			pthread_cond_timedwait(&p->wake, &p->lock, &until);
+		}
+		p->kicked = 0;
+		stopping = p->stopping;
+		pthread_mutex_unlock(&p->lock);
+
+		drain_lanes(p);
+		if (p->idle)
+			p->idle(p->arg);
+	}
+	return NULL;
+}
+
+pipeline *pipeline_start(size_t record_size, unsigned int capacity, int wait_ms, 
+	void (*deliver)(const pipe_lane *, const void *, unsigned int, void *),
+	void (*idle)(void *), void *arg)
+{
+	sigset_t all, old;
+	int r;
+	pipeline *p = (pipeline *)calloc(1, sizeof(pipeline));
+	if (!p)
+		return NULL;
+	if (!(p->batch = (char *)malloc(PIPE_BATCH * record_size))) {
+		free(p);
+		return NULL;
+	}
+	p->record_size = record_size;
+	p->capacity = capacity;
+	p->wait_ms = wait_ms;
+	p->deliver = deliver;
+	p->idle = idle;
+	p->arg = arg;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	// Signals are left to the thread that started it, which may not have
+	// blocked them yet for its own handling, so none are taken here
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&p->thread, NULL, pipeline_thread, p);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r != 0) {
+		pthread_cond_destroy(&p->wake);
+		pthread_mutex_destroy(&p->lock);
+		free(p->batch);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+pipe_lane *pipeline_lane(pipeline *p, const char *name)
+{
+	pipe_lane *lane = (pipe_lane *)calloc(1, sizeof(pipe_lane));
+	if (!lane)
+		return NULL;
+	if (!(lane->ring = pipe_ring_create(p->record_size, p->capacity))) {
+		free(lane);
+		return NULL;
+	}
+	snprintf(lane->name, PIPE_NAME_MAX, "%s", name);
+
+	pthread_mutex_lock(&p->lock);
+	if (p->last_lane) p->last_lane->next = lane;
+	else p->lanes = lane;
+	p->last_lane = lane;
+	pthread_mutex_unlock(&p->lock);
+	return lane;
+}
+
+void pipeline_kick(pipeline *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->kicked = 1;
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Only ever called by the lane's producer, or by whoever is serialised
+// with it. Returns -1 if the record was dropped.
+int pipeline_push(pipeline *p, pipe_lane *lane, const void *record)
+{
+	struct timespec pause = { 0, 1000000L };
+	int waited = 0;
+
+	while (pipe_ring_push(lane->ring, record) < 0) {
+		if (waited >= p->wait_ms) {
+			lane->dropped++;
+			return -1;
+		}
+		pipeline_kick(p);
+		nanosleep(&pause, NULL);
+		waited++;
+	}
+	lane->pushed++;
+	// Wake the drain early rather than let a lane fill between kicks
+	if ((lane->pushed & (lane->ring->mask >> 1)) == 0)
+		pipeline_kick(p);
+	return 0;
+}
+
+void pipeline_retire(pipeline *p, pipe_lane *lane)
+{
+	if (!p || !lane)
+		return;
+	__atomic_store_n(&lane->retired, 1, __ATOMIC_RELEASE);
+	pipeline_kick(p);
+}
+
+// Drains every lane one last time and frees the pipeline, and any lanes
+// left in it
+void pipeline_stop(pipeline *p)
+{
+	pipe_lane *lane, *next;
+
+	if (!p)
+		return;
+	pthread_mutex_lock(&p->lock);
+	p->stopping = 1;
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	for (lane = p->lanes; lane; lane = next) {
+		next = lane->next;
+		free_lane(lane);
+	}
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+	free(p->batch);
+	free(p);
+}
@@ -0,0 +1,88 @@
+/*
+ * pipehelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// A lock-free ring of fixed size records between exactly one producer and
+// one consumer. head is only written by the producer and tail by the
+// consumer, each on its own cache line, and each side keeps a copy of
+// the other's index so that it only reads the shared one when it seems
+// to have run out of room or records.
+
+#define PIPE_CACHE_LINE 64
+
+typedef struct pipe_ring {
+	size_t record_size;
+	unsigned int mask;		// capacity - 1, capacity a power of two
+	char *records;
+	unsigned int head __attribute__((aligned(PIPE_CACHE_LINE)));
+	unsigned int cached_tail;
+	unsigned int tail __attribute__((aligned(PIPE_CACHE_LINE)));
+	unsigned int cached_head;
+} pipe_ring;
+
+pipe_ring *pipe_ring_create(size_t record_size, unsigned int capacity);
+int pipe_ring_push(pipe_ring *ring, const void *record);
+unsigned int pipe_ring_pop(pipe_ring *ring, void *records, unsigned int max);
+void pipe_ring_free(pipe_ring *ring);
+
+// A pipeline has a ring, a lane, per producer and one thread draining them
+// all in batches into deliver. A full lane makes its producer wait up to
+// wait_ms for room, then drop the record and count it. idle runs after
+// every pass over the lanes, and at least once a second.
+
+#define PIPE_NAME_MAX 40
+#define PIPE_BATCH 256
+
+typedef struct pipe_lane {
+	char name[PIPE_NAME_MAX];	// the producer's, for deliver
+	pipe_ring *ring;
+	unsigned long pushed;		// written by the producer only
+	unsigned long dropped;
+	int retired;			// no more pushes, free once drained
+	struct pipe_lane *next;
+} pipe_lane;
+
+typedef struct pipeline {
+	size_t record_size;
+	unsigned int capacity;
+	int wait_ms;
+	void (*deliver)(const pipe_lane *lane, const void *records, unsigned int count, void *arg);
+	void (*idle)(void *arg);
+	void *arg;
+	pipe_lane *lanes;		// in the order they were added
+	pipe_lane *last_lane;
+	pthread_mutex_t lock;		// for lanes and the wakeup, never held during deliver
+	pthread_cond_t wake;
+	int kicked;
+	int stopping;
+	pthread_t thread;
+	char *batch;
+} pipeline;
+
+pipeline *pipeline_start(size_t record_size, unsigned int capacity, int wait_ms, 
+	void (*deliver)(const pipe_lane *, const void *, unsigned int, void *),
+	void (*idle)(void *), void *arg);
+pipe_lane *pipeline_lane(pipeline *p, const char *name);
+int pipeline_push(pipeline *p, pipe_lane *lane, const void *record);
+void pipeline_kick(pipeline *p);
+void pipeline_retire(pipeline *p, pipe_lane *lane);
+void pipeline_stop(pipeline *p);
+
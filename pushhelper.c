@@ -0,0 +1,408 @@
+/*
+ * pushhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "pushhelper.h"
+
+static int64_t now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// "[graphite|statsd] [udp|tcp] [host:port] [prefix] [queue bytes]", the
+// last two optional
+int push_parse(push_config *config, const char *fields)
+{
+	char format[16], protocol[8], address[strlen(fields) + 1], prefix[64] = "temper1";
+	unsigned long queue_max = PUSH_QUEUE_DEFAULT;
+
+	if (sscanf(fields, "%15s %7s %s %63s %lu", format, protocol, address, prefix, &queue_max) < 3)
+		return -1;
+	if (strcmp(format, "graphite") == 0)
+		config->format = PUSH_GRAPHITE;
+	else if (strcmp(format, "statsd") == 0)
+		config->format = PUSH_STATSD;
+	else
+		return -1;
+	if (strcmp(protocol, "tcp") == 0)
+		config->stream = 1;
+	else if (strcmp(protocol, "udp") == 0)
+		config->stream = 0;
+	else
+		return -1;
+	if (!strrchr(address, ':') || queue_max < PUSH_DATAGRAM_MAX)
+		return -1;
+	snprintf(config->address, FILENAME_MAX, "%s", address);
+	snprintf(config->prefix, sizeof(config->prefix), "%s", prefix);
+	config->queue_max = queue_max;
+	return 0;
+}
+
+// The first of the addresses the host resolves to
+static int resolve(const push_config *config, struct sockaddr_storage *address, socklen_t *length)
+{
+	struct addrinfo hints, *addresses = NULL;
+	char host[FILENAME_MAX];
+	const char *port = strrchr(config->address, ':');
+	int r;
+
+	snprintf(host, sizeof(host), "%.*s", (int)(port - config->address), config->address);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = config->stream ? SOCK_STREAM : SOCK_DGRAM;
+	if ((r = getaddrinfo(host, port + 1, &hints, &addresses)) != 0) {
+		fprintf(stderr, "push: %s: %s\n", config->address, gai_strerror(r));
+		return -1;
+	}
+	memcpy(address, addresses->ai_addr, addresses->ai_addrlen);
+	*length = addresses->ai_addrlen;
+	freeaddrinfo(addresses);
+	return 0;
+}
+
+static void schedule_retry(push_sink *sink)
+{
+	if (sink->backoff_ms == 0)
+		sink->backoff_ms = PUSH_BACKOFF_MIN_MS;
+	else if ((sink->backoff_ms *= 2) > PUSH_BACKOFF_MAX_MS)
+		sink->backoff_ms = PUSH_BACKOFF_MAX_MS;
+	sink->retry_at_ms = now_ms() + sink->backoff_ms;
+}
+
+// The sink's address is only read once the thread has been joined
+static void *resolve_thread(void *arg)
+{
+	push_sink *sink = (push_sink *)arg;
+	resolve(&sink->config, &sink->address, &sink->address_length);
+	__atomic_store_n(&sink->resolved, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void start_resolver(push_sink *sink)
+{
+	sigset_t all, old;
+	int r;
+
+	// Signals are left to the daemon's own thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	sink->resolved = 0;
+	r = pthread_create(&sink->resolver, NULL, resolve_thread, sink);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r == 0)
+		sink->resolving = 1;
+	else
+		schedule_retry(sink);
+}
+
+// Returns 0 once the resolver has finished, whether it found the address
+// or not
+static int join_resolver(push_sink *sink)
+{
+	if (!__atomic_load_n(&sink->resolved, __ATOMIC_ACQUIRE))
+		return -1;
+	pthread_join(sink->resolver, NULL);
+	sink->resolving = 0;
+	return 0;
+}
+
+// Looked up here at startup, where blocking does no harm. A sink is kept
+// even if that fails, to queue lines until the lookup works.
+push_sink *push_open(const push_config *config)
+{
+	push_sink *sink = (push_sink *)calloc(1, sizeof(push_sink));
+	if (!sink)
+		return NULL;
+	if (!(sink->queue = (char *)malloc(config->queue_max))) {
+		free(sink);
+		return NULL;
+	}
+	sink->config = *config;
+	sink->fd = -1;
+	if (resolve(config, &sink->address, &sink->address_length) < 0)
+		schedule_retry(sink);
+	return sink;
+}
+
+// Takes n bytes off the front of the queue, counting the lines among them
+static void consume(push_sink *sink, size_t n, int sent)
+{
+	const char *p = sink->queue + sink->head, *end = p + n;
+	unsigned long lines = 0;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		lines++;
+		p++;
+	}
+	if (sent)
+		sink->sent += lines;
+	else
+		sink->dropped += lines;
+	sink->head += n;
+	if (sink->head == sink->used)
+		sink->head = sink->used = 0;
+}
+
+// The rest of a line half sent on a connection that has gone is no use
+// on the next one
+static void disconnect(push_sink *sink)
+{
+	close(sink->fd);
+	sink->fd = -1;
+	sink->connecting = 0;
+	if (sink->partial > 0) {
+		consume(sink, sink->partial, 0);
+		sink->partial = 0;
+	}
+	schedule_retry(sink);
+}
+
+static int reconnect(push_sink *sink)
+{
+	int r;
+
+	if (sink->resolving) {
+		if (join_resolver(sink) < 0)
+			return -1;
+		if (sink->address_length == 0) {
+			schedule_retry(sink);
+			return -1;
+		}
+	}
+	else if (now_ms() < sink->retry_at_ms) {
+		return -1;
+	}
+	else if (sink->address_length == 0) {
+		start_resolver(sink);
+		return -1;
+	}
+	sink->connects++;
+	sink->fd = socket(sink->address.ss_family,
+		(sink->config.stream ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sink->fd >= 0) {
+		r = connect(sink->fd, (struct sockaddr *)&sink->address, sink->address_length);
+		if (r < 0 && errno == EINPROGRESS)
+			sink->connecting = 1;
+		else if (r < 0)
+			disconnect(sink);
+	}
+	else {
+		schedule_retry(sink);
+	}
+	return sink->fd;
+}
+
+static int connected(push_sink *sink)
+{
+	struct pollfd pfd = { sink->fd, POLLOUT, 0 };
+	int error = 0;
+	socklen_t length = sizeof(error);
+
+	if (!sink->connecting)
+		return 1;
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+	if (getsockopt(sink->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+		disconnect(sink);
+		return 0;
+	}
+	sink->connecting = 0;
+	return 1;
+}
+
+// A whole number of lines per datagram, so no reading is ever split
+static int flush_datagrams(push_sink *sink)
+{
+	ssize_t n;
+	size_t length, waiting;
+	const char *start, *end;
+
+	while ((waiting = sink->used - sink->head) > 0) {
+		start = sink->queue + sink->head;
+		length = waiting;
+		if (length > PUSH_DATAGRAM_MAX) {
+			for (end = start + PUSH_DATAGRAM_MAX - 1; end > start && *end != '\n'; end--)
+				;
+			if (*end != '\n' && !(end = memchr(start, '\n', waiting)))
+				end = start + waiting - 1;
+			length = end - start + 1;
+		}
+		n = send(sink->fd, start, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+			return 0;
+		if (n < 0) {
+			// Refused (an ICMP from a connected socket) counts as an outage
+			disconnect(sink);
+			return -1;
+		}
+		consume(sink, length, 1);
+		sink->datagrams++;
+		sink->backoff_ms = 0;
+	}
+	return 0;
+}
+
+static int flush_stream(push_sink *sink)
+{
+	ssize_t n;
+	const char *newline;
+
+	while (sink->used > sink->head) {
+		n = send(sink->fd, sink->queue + sink->head, sink->used - sink->head, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0) {
+			disconnect(sink);
+			return -1;
+		}
+		consume(sink, n, 1);
+		sink->backoff_ms = 0;
+		// Where the next line starts, if the send stopped part way through
+		sink->partial = 0;
+		if (sink->used > sink->head && sink->queue[sink->head - 1] != '\n' &&
+				(newline = memchr(sink->queue + sink->head, '\n', sink->used - sink->head)))
+			sink->partial = newline - (sink->queue + sink->head) + 1;
+	}
+	return 0;
+}
+
+// Sends what it can without blocking
+int push_flush(push_sink *sink)
+{
+	if (!sink || sink->used == sink->head)
+		return 0;
+	if (sink->fd < 0 && reconnect(sink) < 0)
+		return -1;
+	if (!connected(sink))
+		return 0;
+	return sink->config.stream ? flush_stream(sink) : flush_datagrams(sink);
+}
+
+// Makes room for length bytes, dropping the oldest whole lines, a quarter
+// of the queue at a time, if it is full
+static int make_room(push_sink *sink, size_t length)
+{
+	size_t cut, needed;
+	const char *newline;
+
+	if (sink->used + length <= sink->config.queue_max)
+		return 0;
+	if (sink->head > 0 && sink->used - sink->head + length <= sink->config.queue_max) {
+		memmove(sink->queue, sink->queue + sink->head, sink->used - sink->head);
+		sink->used -= sink->head;
+		sink->head = 0;
+		return 0;
+	}
+
+	needed = sink->used - sink->head + length - sink->config.queue_max;
+	if (needed < sink->config.queue_max / 4)
+		needed = sink->config.queue_max / 4;
+	// Never the part of a line still to go down the connection
+	cut = sink->head + sink->partial;
+	while (cut < sink->used && cut - sink->head < needed) {
+		newline = memchr(sink->queue + cut, '\n', sink->used - cut);
+		cut = newline ? newline - sink->queue + 1 : sink->used;
+		sink->dropped++;
+	}
+	memmove(sink->queue + sink->head + sink->partial, sink->queue + cut, sink->used - cut);
+	sink->used -= cut - (sink->head + sink->partial);
+	if (sink->head > 0) {
+		memmove(sink->queue, sink->queue + sink->head, sink->used - sink->head);
+		sink->used -= sink->head;
+		sink->head = 0;
+	}
+	return (sink->used + length <= sink->config.queue_max) ? 0 : -1;
+}
+
+// Graphite paths and StatsD names are split on '.', and StatsD uses ':'
+// and '|' too, so a bus-port such as 1-1.2 becomes 1-1_2
+static void metric_name(char *out, size_t size, const char *prefix, const char *name)
+{
+	int n = snprintf(out, size, "%s%s", prefix, *prefix ? "." : "");
+	char *p;
+
+	snprintf(out + n, size - n, "%s", name);
+	for (p = out + n; *p; p++) {
+		if (*p == '.' || *p == ':' || *p == '|' || *p == ' ' || *p == '/')
+			*p = '_';
+	}
+}
+
+int push_record(push_sink *sink, const char *name, float value, int64_t timestamp)
+{
+	char metric[PUSH_LINE_MAX / 2], line[PUSH_LINE_MAX];
+	int length;
+
+	metric_name(metric, sizeof(metric), sink->config.prefix, name);
+	if (sink->config.format == PUSH_GRAPHITE)
+		length = snprintf(line, sizeof(line), "%s %.3f %lld\n", metric, value, (long long)timestamp);
+	// A signed StatsD gauge is a change, so a reading below zero is sent
+	// as a reset to zero first
+	else if (value < 0)
+		length = snprintf(line, sizeof(line), "%s:0|g\n%s:%.3f|g\n", metric, metric, value);
+	else
+		length = snprintf(line, sizeof(line), "%s:%.3f|g\n", metric, value);
+	if (length < 0 || length >= (int)sizeof(line))
+		return -1;
+
+	if (make_room(sink, length) < 0) {
+		sink->dropped++;
+		return -1;
+	}
+	memcpy(sink->queue + sink->used, line, length);
+	sink->used += length;
+	sink->queued += (sink->config.format == PUSH_STATSD && value < 0) ? 2 : 1;
+	return 0;
+}
+
+// Keeps trying for up to linger_ms to send what is left
+void push_close(push_sink *sink, int linger_ms)
+{
+	int64_t until = now_ms() + linger_ms;
+	struct timespec pause = { 0, 10000000L };
+
+	if (!sink)
+		return;
+	while (sink->used > sink->head && now_ms() < until) {
+		push_flush(sink);
+		if (sink->used > sink->head)
+			nanosleep(&pause, NULL);
+	}
+	// A lookup still under way is waited for, as it writes to the sink
+	if (sink->resolving)
+		pthread_join(sink->resolver, NULL);
+	if (sink->fd >= 0)
+		close(sink->fd);
+	free(sink->queue);
+	free(sink);
+}
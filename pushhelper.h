@@ -0,0 +1,81 @@
+/*
+ * pushhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// Readings pushed to Graphite (plaintext protocol) or StatsD (gauges) over
+// UDP or TCP. Lines are queued as records are written and sent on each
+// push_flush: over UDP packed into datagrams of up to PUSH_DATAGRAM_MAX
+// bytes, over TCP down a persistent non-blocking connection. While the
+// far end is unreachable the socket is reopened with a backoff doubling
+// up to PUSH_BACKOFF_MAX_MS and the lines wait, the oldest being dropped
+// once queue_max bytes are waiting. The address is looked up by push_open
+// and kept. If that fails, as it may early in boot, the lines queue and
+// the lookup is tried again on the same backoff, on a thread of its own,
+// so that a slow DNS server never holds up a flush.
+
+#define PUSH_GRAPHITE 0
+#define PUSH_STATSD 1
+#define PUSH_DATAGRAM_MAX 1432	// fits an Ethernet frame with room to spare
+#define PUSH_QUEUE_DEFAULT (1024 * 1024)
+#define PUSH_BACKOFF_MIN_MS 500
+#define PUSH_BACKOFF_MAX_MS 60000
+#define PUSH_LINE_MAX 200
+
+typedef struct push_config {
+	int format;		// PUSH_GRAPHITE or PUSH_STATSD
+	int stream;		// TCP rather than UDP
+	char address[FILENAME_MAX];	// host:port, "" for no push
+	char prefix[64];
+	size_t queue_max;
+} push_config;
+
+typedef struct push_sink {
+	push_config config;
+	struct sockaddr_storage address;
+	socklen_t address_length;	// 0 until the address has been looked up
+	pthread_t resolver;
+	int resolving;		// the resolver is to be joined
+	int resolved;		// set by the resolver once it is done
+	int fd;
+	int connecting;		// a TCP connect still in progress
+	char *queue;		// lines waiting, oldest first, from head to used
+	size_t head;
+	size_t used;
+	size_t partial;		// bytes of the line at head still to go, the rest
+				// having been sent over TCP; 0 at a line's start
+	int backoff_ms;
+	int64_t retry_at_ms;
+	// In lines, of which a StatsD reading below zero takes two
+	unsigned long queued;
+	unsigned long sent;
+	unsigned long dropped;
+	unsigned long datagrams;
+	unsigned long connects;
+} push_sink;
+
+int push_parse(push_config *config, const char *fields);
+push_sink *push_open(const push_config *config);
+int push_record(push_sink *sink, const char *name, float value, int64_t timestamp);
+int push_flush(push_sink *sink);
+void push_close(push_sink *sink, int linger_ms);
+
@@ -0,0 +1,197 @@
+/*
+ * ringhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ringhelper.h"
+
+static ring_store *ring_map(const char *path, int fd, size_t length, int prot)
+{
+	ring_store *ring;
+	void *map = mmap(NULL, length, prot, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s\n", path);
+		close(fd);
+		return NULL;
+	}
+	if (!(ring = (ring_store *)malloc(sizeof(ring_store)))) {
+		munmap(map, length);
+		close(fd);
+		return NULL;
+	}
+	ring->fd = fd;
+	ring->length = length;
+	ring->header = (ring_header *)map;
+	ring->records = (char *)map + RING_HEADER_SIZE;
+	return ring;
+}
+
+static int ring_valid(const char *path, const ring_header *header, uint32_t record_size, size_t length)
+{
+	if (header->magic != RING_MAGIC || header->version != RING_VERSION || 
+			header->record_size != record_size || header->capacity == 0 ||
+			length < RING_HEADER_SIZE + (size_t)header->capacity * record_size) {
+		fprintf(stderr, "%s is not a ring of %u byte records\n", path, record_size);
+		return 0;
+	}
+	return 1;
+}
+
+// Opens the ring at path for appending, creating it with room for capacity
+// records if it doesn't exist. The whole file is allocated up front, so
+// its size never changes afterwards. An existing ring keeps its own
+// capacity.
+ring_store *ring_open(const char *path, uint32_t record_size, uint32_t capacity)
+{
+	struct stat st;
+	ring_store *ring;
+	size_t length;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		length = RING_HEADER_SIZE + (size_t)capacity * record_size;
+		if (capacity == 0 || posix_fallocate(fd, 0, length) != 0) {
+			fprintf(stderr, "Unable to allocate %s\n", path);
+			close(fd);
+			return NULL;
+		}
+		if (!(ring = ring_map(path, fd, length, PROT_READ | PROT_WRITE)))
+			return NULL;
+		ring->header->record_size = record_size;
+		ring->header->capacity = capacity;
+		ring->header->written = 0;
+		ring->header->version = RING_VERSION;
+		ring->header->magic = RING_MAGIC;
+		return ring;
+	}
+
+	length = st.st_size;
+	if (!(ring = ring_map(path, fd, length, PROT_READ | PROT_WRITE)))
+		return NULL;
+	if (!ring_valid(path, ring->header, record_size, length)) {
+		ring_close(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+ring_store *ring_open_readonly(const char *path, uint32_t record_size)
+{
+	struct stat st;
+	ring_store *ring;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < RING_HEADER_SIZE) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	if (!(ring = ring_map(path, fd, st.st_size, PROT_READ)))
+		return NULL;
+	if (!ring_valid(path, ring->header, record_size, st.st_size)) {
+		ring_close(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+// The cursor is only advanced once the record is in place, so a reader
+// mapping the same file never sees a half written record as the newest.
+// A record older than the newest, after the clock has been stepped back,
+// would put the ring out of order for ring_lower_bound, so it is left out
+// and -1 returned; the caller counts it.
+int ring_append(ring_store *ring, const void *record)
+{
+	ring_header *header = ring->header;
+	uint64_t written = header->written;
+	char *slot = ring->records + (written % header->capacity) * header->record_size;
+
+	if (written > 0 && *(const int64_t *)record < *(const int64_t *)(ring->records + 
+			((written - 1) % header->capacity) * header->record_size))
+		return -1;
+	memcpy(slot, record, header->record_size);
+	__atomic_store_n(&header->written, written + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Records ever appended, as a reader's view of the ring
+uint64_t ring_written(const ring_store *ring)
+{
+	return __atomic_load_n(&ring->header->written, __ATOMIC_ACQUIRE);
+}
+
+uint64_t ring_count(const ring_store *ring, uint64_t written)
+{
+	return (written < ring->header->capacity) ? written : ring->header->capacity;
+}
+
+// Index 0 is the oldest record held when written was taken
+const void *ring_record(const ring_store *ring, uint64_t written, uint64_t index)
+{
+	const ring_header *header = ring->header;
+	uint64_t first = (written > header->capacity) ? written - header->capacity : 0;
+
+	return ring->records + ((first + index) % header->capacity) * header->record_size;
+}
+
+// The newest record, for updating in place, or NULL if there is none yet.
+// A reader may catch it half updated, unlike an appended record.
+void *ring_newest(ring_store *ring)
+{
+	uint64_t written = ring->header->written;
+	if (written == 0)
+		return NULL;
+	return ring->records + ((written - 1) % ring->header->capacity) * ring->header->record_size;
+}
+
+// The index of the first record at or after timestamp, or ring_count if
+// there is none
+uint64_t ring_lower_bound(const ring_store *ring, uint64_t written, int64_t timestamp)
+{
+	uint64_t low = 0, high = ring_count(ring, written);
+
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		if (*(const int64_t *)ring_record(ring, written, mid) < timestamp)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+void ring_close(ring_store *ring)
+{
+	if (!ring)
+		return;
+	munmap(ring->header, ring->length);
+	close(ring->fd);
+	free(ring);
+}
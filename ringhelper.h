@@ -0,0 +1,59 @@
+/*
+ * ringhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A fixed-size ring of fixed-size records in a memory mapped file. Every
+// record starts with an int64_t timestamp and records are appended in
+// time order, so a time range can be found by binary search and read
+// straight out of the mapping. Timestamps must therefore never go back:
+// ring_append turns away a record older than the newest, after the wall
+// clock has been stepped back. Appends overwrite the oldest record once
+// the ring is full. A reader takes written once with ring_written and
+// passes it to the rest, so that appends made meanwhile don't shift the
+// indexes it is using.
+
+#define RING_MAGIC 0x47523154	/* "T1RG" */
+#define RING_VERSION 1
+#define RING_HEADER_SIZE 64
+
+typedef struct ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint64_t written;	// records ever appended; the next goes at written % capacity
+} ring_header;
+
+typedef struct ring_store {
+	int fd;
+	size_t length;
+	ring_header *header;
+	char *records;
+} ring_store;
+
+ring_store *ring_open(const char *path, uint32_t record_size, uint32_t capacity);
+ring_store *ring_open_readonly(const char *path, uint32_t record_size);
+int ring_append(ring_store *ring, const void *record);
+uint64_t ring_written(const ring_store *ring);
+uint64_t ring_count(const ring_store *ring, uint64_t written);
+const void *ring_record(const ring_store *ring, uint64_t written, uint64_t index);
+void *ring_newest(ring_store *ring);
+uint64_t ring_lower_bound(const ring_store *ring, uint64_t written, int64_t timestamp);
+void ring_close(ring_store *ring);
@@ -0,0 +1,150 @@
+/*
+ * rolluphelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringhelper.h"
+#include "rolluphelper.h"
+#include "strreplace.h"
+
+int rollup_parse(rollup_spec *spec, const char *text)
+{
+	unsigned int resolution, capacity;
+	int used;
+
+	spec->count = 0;
+	while (sscanf(text, " %u:%u%n", &resolution, &capacity, &used) == 2) {
+		text += used;
+		if (spec->count == ROLLUP_MAX || resolution == 0 || capacity == 0 ||
+				(spec->count > 0 && resolution <= spec->resolution[spec->count - 1]))
+			return -1;
+		spec->resolution[spec->count] = resolution;
+		spec->capacity[spec->count] = capacity;
+		spec->count++;
+	}
+	return (spec->count > 0) ? 0 : -1;
+}
+
+char *rollup_path(const char *pattern, const char *busport, uint32_t resolution)
+{
+	char seconds[16];
+	char *device_path, *path;
+
+	snprintf(seconds, sizeof(seconds), "%u", resolution);
+	if (!(device_path = strreplace(pattern, "%d", busport)))
+		return NULL;
+	path = strreplace(device_path, ROLLUP_RESOLUTION_PATTERN, seconds);
+	free(device_path);
+	return path;
+}
+
+rollup_set *rollup_open(const char *pattern, const char *busport, const rollup_spec *spec)
+{
+	rollup_set *set = (rollup_set *)calloc(1, sizeof(rollup_set));
+	int i;
+
+	if (!set)
+		return NULL;
+	for (i = 0; i < spec->count; i++) {
+		char *path = rollup_path(pattern, busport, spec->resolution[i]);
+		ring_store *archive = path ? ring_open(path, sizeof(rollup_record), spec->capacity[i]) : NULL;
+		free(path);
+		// An archive that can't be opened is left out, not the others
+		if (archive) {
+			set->resolution[set->count] = spec->resolution[i];
+			set->archives[set->count] = archive;
+			set->count++;
+		}
+	}
+	if (set->count == 0) {
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+void rollup_add(rollup_set *set, int64_t timestamp, float value)
+{
+	int i;
+
+	for (i = 0; i < set->count; i++) {
+		int64_t start = timestamp - timestamp % set->resolution[i];
+		rollup_record *newest = (rollup_record *)ring_newest(set->archives[i]);
+
+		if (newest && newest->timestamp == start) {
+			if (value < newest->min) newest->min = value;
+			if (value > newest->max) newest->max = value;
+			newest->sum += value;
+			newest->count++;
+		}
+		else if (!newest || newest->timestamp < start) {
+			rollup_record record = { start, value, value, value, 1, 0 };
+			ring_append(set->archives[i], &record);
+		}
+		// else the clock has gone back, and the reading is dropped
+	}
+}
+
+void rollup_close(rollup_set *set)
+{
+	int i;
+
+	if (!set)
+		return;
+	for (i = 0; i < set->count; i++)
+		ring_close(set->archives[i]);
+	free(set);
+}
+
+ring_store *rollup_open_best(const char *pattern, const char *busport, 
+	const rollup_spec *spec, int64_t from, uint32_t *resolution)
+{
+	ring_store *best = NULL;
+	int64_t best_oldest = INT64_MAX;
+	int i;
+
+	for (i = 0; i < spec->count; i++) {
+		char *path = rollup_path(pattern, busport, spec->resolution[i]);
+		ring_store *archive = path ? ring_open_readonly(path, sizeof(rollup_record)) : NULL;
+		free(path);
+		if (!archive)
+			continue;
+		uint64_t written = ring_written(archive);
+		if (ring_count(archive, written) == 0) {
+			ring_close(archive);
+			continue;
+		}
+
+		int64_t oldest = ((const rollup_record *)ring_record(archive, written, 0))->timestamp;
+		if (oldest < best_oldest) {
+			ring_close(best);
+			best = archive;
+			best_oldest = oldest;
+			*resolution = spec->resolution[i];
+		}
+		else {
+			ring_close(archive);
+		}
+		// Archives are finest first, so the first to reach back will do
+		if (best_oldest <= from)
+			break;
+	}
+	return best;
+}
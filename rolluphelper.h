@@ -0,0 +1,66 @@
+/*
+ * rolluphelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+struct ring_store;
+
+// Min, max and mean of a device's readings at several resolutions, each
+// kept in its own round-robin archive: a ring file of one record per
+// period, like an RRD. A reading only updates the newest record of each
+// archive (or starts a new one), so the cost of a reading and of reading
+// back a window are independent of how much history there is.
+
+#define ROLLUP_MAX 8
+#define ROLLUP_RESOLUTION_PATTERN "%r"
+
+typedef struct rollup_record {
+	int64_t timestamp;	// start of the period
+	float min;
+	float max;
+	double sum;
+	uint32_t count;
+	uint32_t reserved;
+} rollup_record;
+
+typedef struct rollup_spec {
+	int count;
+	uint32_t resolution[ROLLUP_MAX];	// seconds, ascending
+	uint32_t capacity[ROLLUP_MAX];		// records in the archive
+} rollup_spec;
+
+typedef struct rollup_set {
+	int count;
+	uint32_t resolution[ROLLUP_MAX];
+	struct ring_store *archives[ROLLUP_MAX];
+} rollup_set;
+
+// Reads "60:1440 3600:8760 ..." ([seconds]:[records] per archive)
+int rollup_parse(rollup_spec *spec, const char *text);
+// The archive file for a device and resolution, from a pattern holding
+// %d for the bus-port and %r for the resolution. Free it after use.
+char *rollup_path(const char *pattern, const char *busport, uint32_t resolution);
+
+rollup_set *rollup_open(const char *pattern, const char *busport, const rollup_spec *spec);
+void rollup_add(rollup_set *set, int64_t timestamp, float value);
+void rollup_close(rollup_set *set);
+
+// Opens the finest archive reaching back to from, or failing that the one
+// reaching back furthest, setting *resolution to its resolution
+struct ring_store *rollup_open_best(const char *pattern, const char *busport, 
+	const rollup_spec *spec, int64_t from, uint32_t *resolution);
@@ -0,0 +1,116 @@
+/*
+ * sensorhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "usbhelper.h"
+#include "sensorhelper.h"
+
+#define INTERFACE0 0
+#define INTERFACE1 1
+
+#define CTRL_REQ_TYPE 0x21
+#define CTRL_REQ 0x09
+#define CTRL_VALUE 0x0200
+
+#define READ_ENDPOINT 0x82
+const static char cq_temperature[] = { 0x01, 0x80, 0x33, 0x01, 0x00, 0x00, 0x00, 0x00 };
+
+const usb_query sensor_query = { 
+	CTRL_REQ_TYPE, CTRL_REQ, CTRL_VALUE, 1, 
+	cq_temperature, sizeof(cq_temperature), READ_ENDPOINT, SENSOR_FRAME 
+};
+
+int sensor_is_temper1(struct usb_device *device)
+{
+	return device_vendor_product_is(device, SENSOR_VENDOR_ID, SENSOR_PRODUCT_ID);
+}
+
+int sensor_claim(struct usb_dev_handle *handle)
+{
+	int r = detach_driver(handle, INTERFACE0);
+	if (r >= 0) r = 
+		detach_driver(handle, INTERFACE1);
+	if (r >= 0) r = 
+		set_configuration(handle, 0x01);
+	if (r >= 0) r = 
+		claim_interface(handle, INTERFACE0);
+	if (r >= 0) r = 
+		claim_interface(handle, INTERFACE1);
+/*
+	// In light of discovery that the HID implementation has a keyboard emulation
+	// and a vendor specific mode, don't touch anything else. No init needed?
+	const static char cq_initialise[] = { 0x01, 0x01 };
+	if (r >= 0) r = 
+		control_message(handle, CTRL_REQ_TYPE, CTRL_REQ, CTRL_VALUE, 
+			0, cq_initialise, sizeof(cq_initialise));
+		
+*/
+	return r;
+}
+
+int sensor_reclaim(struct usb_dev_handle *handle)
+{
+	release_interface(handle, INTERFACE0);
+	release_interface(handle, INTERFACE1);
+	int r = 
+		claim_interface(handle, INTERFACE0);
+	if (r >= 0) r = 
+		claim_interface(handle, INTERFACE1);
+	return r;
+}
+
+int sensor_release(struct usb_dev_handle *handle)
+{
+	int r = 
+		release_interface(handle, INTERFACE0);	
+	if (r >= 0) r = 
+		release_interface(handle, INTERFACE1);
+	if (r >= 0) r = 
+		restore_driver(handle, INTERFACE0);
+	if (r >= 0) r = 
+		restore_driver(handle, INTERFACE1);
+		
+	return r;
+}
+
+int sensor_decode(const char *frame)
+{
+	unsigned int rawtemp = (frame[3] & 0xFF) + ((frame[2] & 0xFF) << 8);
+    
+	/* msb means the temperature is negative -- less than 0 Celsius -- and in 2'complement form.
+ 	 * We can't be sure that the host uses 2's complement to store negative numbers
+ 	 * so if the temperature is negative, we 'manually' get its magnitude
+ 	 * by explicity getting it's 2's complement and then we return the negative of that.
+ 	 */
+    
+	if ((frame[2] & 0x80) != 0) {
+		/* return the negative of magnitude of the temperature */
+		rawtemp = -((rawtemp ^ 0xffff) + 1);
+	}
+    
+	return rawtemp;
+}
+
+/* Calibration adjustments */
+/* See http://www.pitt-pladdy.com/blog/_20110824-191017_0100_TEMPer_under_Linux_perl_with_Cacti/ */
+float sensor_celsius(float raw, float scale, float offset)
+{
+	float temp_c = raw * SENSOR_C_PER_RAW;
+	
+	temp_c = (temp_c * scale) + offset;
+	return temp_c;
+}
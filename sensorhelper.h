@@ -0,0 +1,42 @@
+/*
+ * sensorhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// The TEMPer1 itself: recognising one, claiming its interfaces and the
+// query that reads it, shared by libtemper1 and the temper1 command.
+// Include usbhelper.h first.
+
+#define SENSOR_VENDOR_ID 0x0c45
+#define SENSOR_PRODUCT_ID 0x7401
+#define SENSOR_FRAME 8
+// Degrees C per unit of a raw reading before calibration, as used by
+// sensor_celsius and by temper1's batched replay
+#define SENSOR_C_PER_RAW (125.0 / 32000.0)
+
+extern const usb_query sensor_query;
+
+int sensor_is_temper1(struct usb_device *device);
+int sensor_claim(struct usb_dev_handle *handle);
+// Releases and claims the interfaces again, for a device that has stopped
+// answering without going away
+int sensor_reclaim(struct usb_dev_handle *handle);
+int sensor_release(struct usb_dev_handle *handle);
+
+// The raw reading in a frame, 0 if the device had none ready
+int sensor_decode(const char *frame);
+// A raw reading in degrees C, calibrated
+float sensor_celsius(float raw, float scale, float offset);
@@ -0,0 +1,343 @@
+/*
+ * serverhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "eventhelper.h"
+#include "serverhelper.h"
+
+#define SERVER_REQUEST_MAX 256
+#define SERVER_CLIENTS_MAX 32
+#define SERVER_KEY_MAX 64
+
+typedef struct server_client {
+	int fd;
+	char request[SERVER_REQUEST_MAX];
+	size_t length;
+	struct server_flight *waiting;	// the read this client is waiting on
+	struct server_client *next_waiter;
+	struct server_client *prev;	// every connected client, for server_close
+	struct server_client *next;
+} server_client;
+
+// One read in flight, and the clients waiting on it
+typedef struct server_flight {
+	char key[SERVER_KEY_MAX];
+	void *target;
+	int result;
+	pthread_t thread;
+	server_client *waiters;
+	struct server_flight *next;
+} server_flight;
+
+static server_answer answer_request = NULL;
+static server_refresh refresh_target = NULL;
+static server_release release_target = NULL;
+static server_flight *flights = NULL;
+static int done_pipe[2] = { -1, -1 };
+static server_client *connected = NULL;
+static int clients = 0;
+
+static void reply(server_client *client, const char *text)
+{
+	ssize_t n;
+	size_t length = strlen(text);
+	while (length > 0) {
+		n = send(client->fd, text, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		// A client that doesn't read its replies loses them
+		if (n <= 0)
+			return;
+		text += n;
+		length -= n;
+	}
+}
+
+static void *flight_worker(void *arg)
+{
+	server_flight *flight = (server_flight *)arg;
+	ssize_t n;
+
+	flight->result = refresh_target(flight->target);
+	do {
+		n = write(done_pipe[1], &flight, sizeof(flight));
+	} while (n < 0 && errno == EINTR);
+	return NULL;
+}
+
+static int handle_requests(server_client *client);
+
+static void start_waiting(server_client *client, const char *key, void *target)
+{
+	server_flight *flight;
+
+	for (flight = flights; flight; flight = flight->next) {
+		if (strcmp(flight->key, key) == 0)
+			break;
+	}
+	if (flight) {
+		// Already being read; the target was only needed to start one
+		release_target(target);
+	}
+	else {
+		if (!(flight = (server_flight *)calloc(1, sizeof(server_flight)))) {
+			release_target(target);
+			reply(client, "ERROR out of memory\n");
+			return;
+		}
+		snprintf(flight->key, sizeof(flight->key), "%s", key);
+		flight->target = target;
+		if (pthread_create(&flight->thread, NULL, flight_worker, flight) != 0) {
+			release_target(target);
+			free(flight);
+			reply(client, "ERROR unable to start read\n");
+			return;
+		}
+		flight->next = flights;
+		flights = flight;
+	}
+	client->waiting = flight;
+	client->next_waiter = flight->waiters;
+	flight->waiters = client;
+}
+
+static void stop_waiting(server_client *client)
+{
+	server_client **link;
+
+	if (!client->waiting)
+		return;
+	for (link = &client->waiting->waiters; *link; link = &(*link)->next_waiter) {
+		if (*link == client) {
+			*link = client->next_waiter;
+			break;
+		}
+	}
+	client->waiting = NULL;
+}
+
+// Answers the buffered request lines in turn, stopping at one that has to
+// wait for a read
+static int handle_requests(server_client *client)
+{
+	char key[SERVER_KEY_MAX], text[SERVER_REPLY_MAX], *eol;
+	int max_age, r;
+	void *target;
+
+	while (!client->waiting && (eol = memchr(client->request, '\n', client->length))) {
+		*eol = '\0';
+		if (sscanf(client->request, "%63s %d", key, &max_age) != 2) {
+			reply(client, "ERROR expected <device> <max age>\n");
+		}
+		else {
+			target = NULL;
+			r = answer_request(key, max_age, text, &target);
+			if (r == 0 && target)
+				start_waiting(client, key, target);
+			else
+				reply(client, text);
+		}
+		client->length -= (eol + 1 - client->request);
+		memmove(client->request, eol + 1, client->length);
+	}
+	return 0;
+}
+
+static int close_client(server_client *client)
+{
+	stop_waiting(client);
+	if (client->prev)
+		client->prev->next = client->next;
+	else
+		connected = client->next;
+	if (client->next)
+		client->next->prev = client->prev;
+	close(client->fd);
+	free(client);
+	clients--;
+	return -1;
+}
+
+static int on_client(int fd, void *data)
+{
+	server_client *client = (server_client *)data;
+	ssize_t n;
+
+	n = recv(fd, client->request + client->length, 
+		SERVER_REQUEST_MAX - client->length, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return close_client(client);
+
+	client->length += n;
+	handle_requests(client);
+	// A full buffer without a complete line is never going to be one
+	if (client->length >= SERVER_REQUEST_MAX)
+		return close_client(client);
+	return 0;
+}
+
+static int on_accept(int fd, void *data)
+{
+	int client_fd;
+	server_client *client;
+
+	while ((client_fd = accept(fd, NULL, NULL)) >= 0) {
+		if (clients >= SERVER_CLIENTS_MAX || !(client = (server_client *)calloc(1, sizeof(server_client)))) {
+			close(client_fd);
+			continue;
+		}
+		fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+		client->fd = client_fd;
+		client->next = connected;
+		if (connected)
+			connected->prev = client;
+		connected = client;
+		clients++;
+		if (event_add(client_fd, on_client, client) < 0)
+			close_client(client);
+	}
+	return 0;
+}
+
+// Fans a finished read out to everyone waiting on it. Their own max age
+// no longer matters: this is as fresh as a reading gets.
+static void finish_flight(server_flight *flight)
+{
+	server_flight **link;
+	server_client *client, *next;
+	char text[SERVER_REPLY_MAX];
+	void *target;
+
+	for (link = &flights; *link; link = &(*link)->next) {
+		if (*link == flight) {
+			*link = flight->next;
+			break;
+		}
+	}
+	pthread_join(flight->thread, NULL);
+	release_target(flight->target);
+
+	target = NULL;
+	if (flight->result < 0) {
+		snprintf(text, sizeof(text), "ERROR unable to read %s\n", flight->key);
+	}
+	else if (answer_request(flight->key, INT_MAX, text, &target) == 0) {
+		if (target)
+			release_target(target);
+		snprintf(text, sizeof(text), "ERROR no reading from %s\n", flight->key);
+	}
+
+	for (client = flight->waiters; client; client = next) {
+		next = client->next_waiter;
+		client->waiting = NULL;
+		reply(client, text);
+		handle_requests(client);
+	}
+	free(flight);
+}
+
+static int on_flight_done(int fd, void *data)
+{
+	server_flight *flight;
+	while (read(fd, &flight, sizeof(flight)) == sizeof(flight))
+		finish_flight(flight);
+	return 0;
+}
+
+int server_listen(const char *path, server_answer answer, server_refresh refresh, 
+	server_release release)
+{
+	struct sockaddr_un un;
+	int fd;
+
+	int i;
+
+	if (pipe(done_pipe) < 0) {
+		perror("server_listen: pipe");
+		return -1;
+	}
+	// Workers may block writing, the loop never does reading
+	fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+	for (i = 0; i < 2; i++)
+		fcntl(done_pipe[i], F_SETFD, FD_CLOEXEC);
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	snprintf(un.sun_path, sizeof(un.sun_path), "%s", path);
+	unlink(un.sun_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror("server_listen: socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(fd, SERVER_CLIENTS_MAX) < 0) {
+		perror("server_listen: bind");
+		close(fd);
+		return -1;
+	}
+
+	answer_request = answer;
+	refresh_target = refresh;
+	release_target = release;
+	event_add(fd, on_accept, NULL);
+	event_add(done_pipe[0], on_flight_done, NULL);
+	return fd;
+}
+
+// Waits for the reads still in flight, so that nothing is left using a
+// target once this returns, then hangs up on every client, those still
+// waiting on a read included
+void server_close(int fd, const char *path)
+{
+	server_client *client;
+
+	if (fd < 0)
+		return;
+	event_remove(fd);
+	close(fd);
+	unlink(path);
+
+	while (flights) {
+		server_flight *flight = flights;
+		pthread_join(flight->thread, NULL);
+		flights = flight->next;
+		release_target(flight->target);
+		for (client = flight->waiters; client; client = client->next_waiter)
+			client->waiting = NULL;
+		free(flight);
+	}
+	while ((client = connected)) {
+		event_remove(client->fd);
+		close_client(client);
+	}
+	event_remove(done_pipe[0]);
+	close(done_pipe[0]);
+	close(done_pipe[1]);
+	done_pipe[0] = done_pipe[1] = -1;
+}
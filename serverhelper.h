@@ -0,0 +1,40 @@
+/*
+ * serverhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+
+// A line based Unix socket server for readings. Each request line is
+//   <key> <max age in seconds>
+// and is answered with one line, either from what the owner already has
+// or, when that is too old, after a fresh read. Only one read per key is
+// ever in flight; everyone asking for that key meanwhile shares its result.
+
+#define SERVER_REPLY_MAX 160
+
+// Main thread. Returns 1 with reply filled in when there is an answer no
+// older than max_age, 0 with target set when a read is needed, or -1 with
+// reply holding the error.
+typedef int (*server_answer)(const char *key, int max_age, char *reply, void **target);
+// Run on a worker thread to read the target; negative on failure
+typedef int (*server_refresh)(void *target);
+// Main thread, once the read of target is over
+typedef void (*server_release)(void *target);
+
+int server_listen(const char *path, server_answer answer, server_refresh refresh, 
+	server_release release);
+void server_close(int fd, const char *path);
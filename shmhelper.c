@@ -0,0 +1,176 @@
+/*
+ * shmhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmhelper.h"
+
+shm_table *shm_create(const char *name)
+{
+	shm_table *table;
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror("shm_create: shm_open");
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(shm_table)) < 0) {
+		perror("shm_create: ftruncate");
+		close(fd);
+		return NULL;
+	}
+	table = (shm_table *)mmap(NULL, sizeof(shm_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED) {
+		perror("shm_create: mmap");
+		return NULL;
+	}
+
+	// Left over from an earlier run; nothing in it is current any more
+	memset(table, 0, sizeof(shm_table));
+	table->slot_count = SHM_SLOTS;
+	table->version = SHM_VERSION;
+	__atomic_store_n(&table->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	return table;
+}
+
+// A device that comes back on the same port gets its old slot back. Once
+// every slot has been used, the slot of a device that has gone is given
+// to the new one. Only called from the daemon's main thread.
+int shm_slot_for(shm_table *table, const char *busport)
+{
+	uint32_t i;
+	shm_reading reading;
+
+	for (i = 0; i < table->used; i++) {
+		if (strcmp(table->slots[i].reading.busport, busport) == 0)
+			return i;
+	}
+	if (table->used >= table->slot_count) {
+		for (i = 0; i < table->used; i++) {
+			if (table->slots[i].reading.status == SHM_STATUS_REMOVED)
+				break;
+		}
+		if (i == table->used)
+			return -1;
+	}
+
+	memset(&reading, 0, sizeof(reading));
+	snprintf(reading.busport, sizeof(reading.busport), "%s", busport);
+	reading.status = SHM_STATUS_ERROR;
+	shm_publish(table, i, &reading);
+	if (i == table->used)
+		__atomic_store_n(&table->used, i + 1, __ATOMIC_RELEASE);
+	return i;
+}
+
+// Each slot has a single writer: the thread reading that device
+void shm_publish(shm_table *table, int slot, const shm_reading *reading)
+{
+	shm_slot *s = &table->slots[slot];
+	uint32_t seq = s->seq;
+
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&s->reading, reading, sizeof(shm_reading));
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Keeps the last good value and time, only the status changes
+void shm_publish_status(shm_table *table, int slot, int status)
+{
+	shm_slot *s = &table->slots[slot];
+	uint32_t seq = s->seq;
+
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->reading.status = status;
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void shm_destroy(shm_table *table, const char *name)
+{
+	if (!table)
+		return;
+	munmap(table, sizeof(shm_table));
+	shm_unlink(name);
+}
+
+shm_table *shm_attach(const char *name)
+{
+	shm_table *table;
+	struct stat st;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(shm_table)) {
+		close(fd);
+		return NULL;
+	}
+	table = (shm_table *)mmap(NULL, sizeof(shm_table), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED)
+		return NULL;
+	if (__atomic_load_n(&table->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || table->version != SHM_VERSION) {
+		munmap(table, sizeof(shm_table));
+		return NULL;
+	}
+	return table;
+}
+
+// Copies a consistent snapshot of the slot, retrying while it is being
+// written. Returns -1 for a slot that has never been used.
+int shm_read_slot(const shm_table *table, int slot, shm_reading *reading)
+{
+	const shm_slot *s;
+	uint32_t before, after;
+
+	if (slot < 0 || (uint32_t)slot >= __atomic_load_n(&table->used, __ATOMIC_ACQUIRE))
+		return -1;
+	s = &table->slots[slot];
+	do {
+		before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (before & 1)
+			continue;
+		memcpy(reading, (const void *)&s->reading, sizeof(shm_reading));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+	return 0;
+}
+
+int shm_read(const shm_table *table, const char *busport, shm_reading *reading)
+{
+	uint32_t i, used = __atomic_load_n(&table->used, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < used; i++) {
+		if (shm_read_slot(table, i, reading) == 0 && strcmp(reading->busport, busport) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+void shm_detach(shm_table *table)
+{
+	if (table)
+		munmap(table, sizeof(shm_table));
+}
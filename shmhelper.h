@@ -0,0 +1,72 @@
+/*
+ * shmhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+// The latest reading of every device, published by the daemon in a POSIX
+// shared memory segment. Each slot is guarded by a sequence lock: the
+// daemon bumps seq to odd before changing a slot and back to even after,
+// and readers retry until they see the same even value either side of
+// their copy. Readers never block the daemon and never touch USB.
+// There are SHM_SLOTS slots; once they have all been used, the slots of
+// devices that have gone are handed to new ones, and a device that finds
+// none free is left out.
+
+#define SHM_MAGIC 0x4d533154	/* "T1SM" */
+#define SHM_VERSION 1
+#define SHM_SLOTS 256
+#define SHM_BUS_PORT_MAX 40
+
+#define SHM_STATUS_OK 0
+#define SHM_STATUS_ERROR 1
+#define SHM_STATUS_REMOVED 2
+
+typedef struct shm_reading {
+	char busport[SHM_BUS_PORT_MAX];
+	int64_t timestamp;	// of the last good reading
+	float value;		// calibrated, in C
+	int16_t raw;
+	uint16_t status;
+} shm_reading;
+
+typedef struct shm_slot {
+	uint32_t seq;
+	uint32_t reserved;
+	shm_reading reading;
+} shm_slot;
+
+typedef struct shm_table {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t used;
+	shm_slot slots[SHM_SLOTS];
+} shm_table;
+
+// Daemon side
+shm_table *shm_create(const char *name);
+int shm_slot_for(shm_table *table, const char *busport);
+void shm_publish(shm_table *table, int slot, const shm_reading *reading);
+void shm_publish_status(shm_table *table, int slot, int status);
+void shm_destroy(shm_table *table, const char *name);
+
+// Reader side
+shm_table *shm_attach(const char *name);
+int shm_read_slot(const shm_table *table, int slot, shm_reading *reading);
+int shm_read(const shm_table *table, const char *busport, shm_reading *reading);
+void shm_detach(shm_table *table);
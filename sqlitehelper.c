@@ -0,0 +1,171 @@
+/*
+ * sqlitehelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqlitehelper.h"
+
+// "sqlite:[path] [window seconds]", the window optional
+int sql_parse(sql_config *config, const char *fields)
+{
+	char path[strlen(fields) + 1];
+	int window_seconds = 0;
+
+	if (sscanf(fields, "sqlite:%s %d", path, &window_seconds) < 1 || window_seconds < 0)
+		return -1;
+	snprintf(config->path, sizeof(config->path), "%s", path);
+	config->window_seconds = window_seconds;
+	return 0;
+}
+
+#ifdef WITH_SQLITE
+#include <sqlite3.h>
+
+// NORMAL is as safe as FULL against a crash of temper1 in WAL mode, and
+// only syncs on checkpoints
+static const char *schema =
+	"PRAGMA journal_mode=WAL;"
+	"PRAGMA synchronous=NORMAL;"
+	"CREATE TABLE IF NOT EXISTS readings ("
+		"device TEXT NOT NULL, timestamp INTEGER NOT NULL, "
+		"celsius REAL NOT NULL, raw INTEGER NOT NULL);"
+	"CREATE INDEX IF NOT EXISTS readings_device_timestamp ON readings (device, timestamp);"
+	"CREATE INDEX IF NOT EXISTS readings_timestamp ON readings (timestamp);";
+
+static void sql_error(sql_sink *sink, const char *doing)
+{
+	fprintf(stderr, "sqlite: %s %s: %s\n", doing, sink->config.path, sqlite3_errmsg(sink->db));
+}
+
+sql_sink *sql_open(const sql_config *config)
+{
+	sql_sink *sink = (sql_sink *)calloc(1, sizeof(sql_sink));
+	if (!sink)
+		return NULL;
+	sink->config = *config;
+
+	// Every use is under the caller's lock, so SQLite needn't take its own
+	if (sqlite3_open_v2(config->path, &sink->db, 
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+		sql_error(sink, "opening");
+		sql_close(sink);
+		return NULL;
+	}
+	// Readers of the history may hold a lock for a moment
+	sqlite3_busy_timeout(sink->db, 5000);
+	if (sqlite3_exec(sink->db, schema, NULL, NULL, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2(sink->db, "INSERT INTO readings VALUES (?, ?, ?, ?)", -1, 
+				&sink->insert, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2(sink->db, "BEGIN", -1, &sink->begin, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2(sink->db, "COMMIT", -1, &sink->commit, NULL) != SQLITE_OK) {
+		sql_error(sink, "preparing");
+		sql_close(sink);
+		return NULL;
+	}
+	return sink;
+}
+
+static int step(sqlite3_stmt *statement)
+{
+	int r = sqlite3_step(statement);
+	sqlite3_reset(statement);
+	return (r == SQLITE_DONE) ? 0 : -1;
+}
+
+int sql_record(sql_sink *sink, const char *device, int64_t timestamp, float celsius, int raw)
+{
+	if (!sink)
+		return 0;
+	if (sink->began == 0) {
+		if (step(sink->begin) < 0) {
+			sql_error(sink, "beginning");
+			sink->errors++;
+			return -1;
+		}
+		sink->began = (timestamp > 0) ? timestamp : 1;
+	}
+
+	sqlite3_bind_text(sink->insert, 1, device, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(sink->insert, 2, timestamp);
+	sqlite3_bind_double(sink->insert, 3, celsius);
+	sqlite3_bind_int(sink->insert, 4, raw);
+	if (step(sink->insert) < 0) {
+		sink->errors++;
+		return -1;
+	}
+	sink->pending++;
+	return 0;
+}
+
+int sql_flush(sql_sink *sink, int64_t now, int force)
+{
+	if (!sink || sink->began == 0)
+		return 0;
+	if (!force && now - sink->began < sink->config.window_seconds)
+		return 0;
+
+	// A failed commit leaves nothing for the next one to pick up
+	if (step(sink->commit) < 0) {
+		sql_error(sink, "committing");
+		sqlite3_exec(sink->db, "ROLLBACK", NULL, NULL, NULL);
+		sink->errors += sink->pending;
+		sink->pending = 0;
+		sink->began = 0;
+		return -1;
+	}
+	sink->rows += sink->pending;
+	sink->transactions++;
+	sink->pending = 0;
+	sink->began = 0;
+	return 0;
+}
+
+void sql_close(sql_sink *sink)
+{
+	if (!sink)
+		return;
+	if (sink->db)
+		sql_flush(sink, 0, 1);
+	sqlite3_finalize(sink->insert);
+	sqlite3_finalize(sink->begin);
+	sqlite3_finalize(sink->commit);
+	sqlite3_close(sink->db);
+	free(sink);
+}
+#else
+sql_sink *sql_open(const sql_config *config)
+{
+	fprintf(stderr, "sqlite: built without SQLite, rebuild with 'make SQLITE=1' for %s\n", config->path);
+	return NULL;
+}
+
+int sql_record(sql_sink *sink, const char *device, int64_t timestamp, float celsius, int raw)
+{
+	return 0;
+}
+
+int sql_flush(sql_sink *sink, int64_t now, int force)
+{
+	return 0;
+}
+
+void sql_close(sql_sink *sink)
+{
+}
+#endif
@@ -0,0 +1,57 @@
+/*
+ * sqlitehelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Readings kept in a SQLite database (OUTPUT sqlite:path in temper1.conf),
+// in a table
+//   readings (device TEXT, timestamp INTEGER, celsius REAL, raw INTEGER)
+// indexed on (device, timestamp) and on timestamp. One connection and its
+// prepared statements last as long as the sink; the rows of a sweep, or
+// of window_seconds of sweeps, go in a single transaction against a
+// write-ahead log, so a row costs an insert rather than a commit.
+// Only built with 'make SQLITE=1'; otherwise sql_open fails.
+
+typedef struct sql_config {
+	char path[FILENAME_MAX];	// "" for no database
+	int window_seconds;		// 0 to commit after every sweep
+} sql_config;
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+typedef struct sql_sink {
+	sql_config config;
+	struct sqlite3 *db;
+	struct sqlite3_stmt *insert;
+	struct sqlite3_stmt *begin;
+	struct sqlite3_stmt *commit;
+	int64_t began;			// when the open transaction began, 0 for none
+	unsigned long pending;		// rows in the open transaction
+	unsigned long rows;		// committed
+	unsigned long transactions;
+	unsigned long errors;		// rows lost to failed inserts or commits
+} sql_sink;
+
+int sql_parse(sql_config *config, const char *fields);
+sql_sink *sql_open(const sql_config *config);
+int sql_record(sql_sink *sink, const char *device, int64_t timestamp, float celsius, int raw);
+// Commits once the window is up, or at once when force is set
+int sql_flush(sql_sink *sink, int64_t now, int force);
+void sql_close(sql_sink *sink);
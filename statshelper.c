@@ -0,0 +1,51 @@
+/*
+ * statshelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "statshelper.h"
+
+const char *stats_stage_names[STATS_STAGES] = { "control", "read", "bus_port", "output" };
+
+// Monotonic, so not upset by the clock being stepped mid query
+long elapsed_usec(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+long stats_bucket_limit(int bucket)
+{
+	return 1L << bucket;
+}
+
+long stats_percentile(const stats_histogram *h, double p)
+{
+	uint64_t seen = 0, wanted = (uint64_t)(h->count * p);
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	if (wanted >= h->count)
+		wanted = h->count - 1;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > wanted)
+			break;
+	}
+	return stats_bucket_limit(i < STATS_BUCKETS ? i : STATS_BUCKETS - 1);
+}
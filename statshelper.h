@@ -0,0 +1,70 @@
+/*
+ * statshelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+// Always on latency histograms and error counts. A histogram has a bucket
+// per power of two microseconds, so recording is a count leading zeros
+// and two adds. Each is written by one thread at a time (whoever holds
+// the device); readers take what they find.
+
+#define STATS_BUCKETS 24	// the last also holds anything over 2^22us (4s)
+#define STATS_ERROR_CODES 128
+
+#define STATS_CONTROL 0		// control_message
+#define STATS_READ 1		// interrupt_read
+#define STATS_BUS_PORT 2	// handle_bus_port
+#define STATS_OUTPUT 3		// formatting and writing a record
+#define STATS_STAGES 4
+
+typedef struct stats_histogram {
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t count;
+	uint64_t sum_usec;
+} stats_histogram;
+
+typedef struct usb_stats {
+	stats_histogram stages[STATS_STAGES];
+	uint32_t errors[STATS_ERROR_CODES];	// by -(return code), the last for anything beyond
+	uint64_t timeouts;
+	uint64_t zero_reads;
+} usb_stats;
+
+extern const char *stats_stage_names[STATS_STAGES];
+
+static inline void stats_record(stats_histogram *h, long usec)
+{
+	int bucket = (usec > 0) ? 64 - __builtin_clzll((unsigned long long)usec) : 0;
+	h->buckets[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+	h->count++;
+	h->sum_usec += (usec > 0) ? usec : 0;
+}
+
+static inline void stats_error(usb_stats *stats, int r)
+{
+	int code = -r;
+	stats->errors[(code > 0 && code < STATS_ERROR_CODES) ? code : STATS_ERROR_CODES - 1]++;
+}
+
+// Upper bound in microseconds of bucket, or of the bucket holding the
+// p'th fraction of the samples
+long stats_bucket_limit(int bucket);
+// Microseconds since a CLOCK_MONOTONIC time
+long elapsed_usec(const struct timespec *since);
+long stats_percentile(const stats_histogram *h, double p);
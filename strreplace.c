@@ -32,10 +32,10 @@ char * strreplace(char const * const original,
       {
         size_t const skplen = patloc - oriptr;
         // copy the section until the occurence of the pattern
-        strncpy(retptr, oriptr, skplen);
+        memcpy(retptr, oriptr, skplen);
         retptr += skplen;
         // copy the replacement 
-        strncpy(retptr, replacement, replen);
+        memcpy(retptr, replacement, replen);
         retptr += replen;
       }
       // copy the rest of the string.
@@ -24,6 +24,9 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+
+#include "sysfshelper.h"
 
 static int file_exists(const char *filepath) 
 {
@@ -31,16 +34,44 @@ static int file_exists(const char *filepath)
 	return (((stat(filepath, &filestat)) == 0));
 }
 
-int sysfs_find_usb_device_name(const int busnum, const int devnum, char * const usbname) 
+// (bus, devnum) -> sysfs device name, e.g. (1, 5) -> "1-1.2". Built by a
+// single scan of sysfs and kept until a lookup misses, which only happens
+// when a device has been (re)enumerated since the last scan.
+typedef struct sysfs_usb_entry {
+	int busnum;
+	int devnum;
+	char name[SYSFS_NAME_MAX];
+} sysfs_usb_entry;
+
+static sysfs_usb_entry *usb_index = NULL;
+static int usb_index_count = 0;
+static int usb_index_capacity = 0;
+static int usb_index_valid = 0;
+
+static int read_devnum(const char *devnum_path)
 {
-	const char root_sys_bus_usb_devices[] = "/sys/bus/usb/devices";
+	char devnum_string[8];
+	FILE *fpdn = fopen(devnum_path, "r");
+	if (fpdn == NULL) {
+		perror("Failed to open devnum file");
+		return -1;
+	}
+	if (fgets(devnum_string, sizeof(devnum_string), fpdn) == NULL)
+		devnum_string[0] = '\0';
+	fclose(fpdn);
+	return atoi(devnum_string);
+}
+
+static char root_sys_bus_usb_devices[FILENAME_MAX] = "/sys/bus/usb/devices";
 
+static int sysfs_build_index()
+{
 	struct dirent *entry;
-	char busnum_part[5];
-	char devnum_path[FILENAME_MAX - 1];
+	char devnum_path[2 * FILENAME_MAX];
 	DIR *dp;
-	int r = -1;
  
+	usb_index_count = 0;
+	usb_index_valid = 0;
 	dp = opendir(root_sys_bus_usb_devices);
 	if (dp == NULL) {
 		perror("Failed to open sysfs direcory");
@@ -55,33 +86,73 @@ int sysfs_find_usb_device_name(const int busnum, const int devnum, char * const
 	// http://cateee.net/lkddb/web-lkddb/USB_DEVICE_CLASS.html
 	while((entry = readdir(dp))) 
 	{
-		if ((strncmp(entry->d_name, ".", 1) == 0) || (strncmp(entry->d_name, "..", 2) == 0))
+		int busnum, devnum;
+		char *dash;
+
+		if (entry->d_name[0] == '.')
 			continue;
-		sprintf(busnum_part, "%i-", busnum);
-		sprintf(devnum_path, "%s/%s/devnum", root_sys_bus_usb_devices, entry->d_name);
 		// Modern kernels have a busnum file in the device directory, but not older
 		// ones like RHEL5, so we have to infer it by testing the first part of the 
-		// directory name.
-		if ((strncmp(entry->d_name, busnum_part, strlen(busnum_part)) == 0) && 
-				file_exists(devnum_path)) {
-			
-			char devnum_string[5];
-			FILE *fpdn = fopen(devnum_path, "r");
-			if (fpdn == NULL) {
-				perror("Failed to open devnum file");
-				return 2;
-			}
-			fgets(devnum_string, 5, fpdn);
-			fclose(fpdn);
-			
-			if (atoi(devnum_string) == devnum) {
-				r = devnum;
-				strncpy(usbname, entry->d_name, strlen(entry->d_name));
-			}
-		
+		// directory name. Interfaces ("1-1.2:1.0") and root hubs ("usb1") are skipped.
+		if (!isdigit(entry->d_name[0]) || !(dash = strchr(entry->d_name, '-')) || 
+				strchr(entry->d_name, ':') || strlen(entry->d_name) >= SYSFS_NAME_MAX)
+			continue;
+		busnum = atoi(entry->d_name);
+
+		snprintf(devnum_path, sizeof(devnum_path), "%s/%s/devnum", root_sys_bus_usb_devices, entry->d_name);
+		if (!file_exists(devnum_path) || (devnum = read_devnum(devnum_path)) < 0)
+			continue;
+
+		if (usb_index_count == usb_index_capacity) {
+			int grown = usb_index_capacity ? usb_index_capacity * 2 : 32;
+			sysfs_usb_entry *entries = (sysfs_usb_entry *)realloc(usb_index, grown * sizeof(sysfs_usb_entry));
+			if (entries == NULL)
+				break;
+			usb_index = entries;
+			usb_index_capacity = grown;
 		}
+		usb_index[usb_index_count].busnum = busnum;
+		usb_index[usb_index_count].devnum = devnum;
+		strcpy(usb_index[usb_index_count].name, entry->d_name);
+		usb_index_count++;
 	}
 	
 	closedir(dp);
+	usb_index_valid = 1;
+	return usb_index_count;
+}
+
+void sysfs_invalidate_index()
+{
+	usb_index_valid = 0;
+}
+
+void sysfs_set_root(const char *root)
+{
+	snprintf(root_sys_bus_usb_devices, sizeof(root_sys_bus_usb_devices), "%s", root);
+	usb_index_valid = 0;
+}
+
+static int sysfs_lookup(const int busnum, const int devnum, char * const usbname)
+{
+	int i;
+	for (i = 0; i < usb_index_count; i++) {
+		if (usb_index[i].busnum == busnum && usb_index[i].devnum == devnum) {
+			strcpy(usbname, usb_index[i].name);
+			return devnum;
+		}
+	}
+	return -1;
+}
+
+int sysfs_find_usb_device_name(const int busnum, const int devnum, char * const usbname) 
+{
+	int r = -1;
+
+	if (usb_index_valid)
+		r = sysfs_lookup(busnum, devnum, usbname);
+	// A miss means the topology has changed since the index was built
+	if (r < 0 && sysfs_build_index() >= 0)
+		r = sysfs_lookup(busnum, devnum, usbname);
 	return r;
 }
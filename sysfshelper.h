@@ -16,4 +16,10 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define SYSFS_NAME_MAX 40
+
 int sysfs_find_usb_device_name(const int busnum, const int devnum, char * const usbname);
+void sysfs_invalidate_index();
+// Where the USB devices are listed, /sys/bus/usb/devices unless a
+// benchmark has made up a tree of its own
+void sysfs_set_root(const char *root);
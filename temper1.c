@@ -26,53 +26,138 @@
 #include <getopt.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "usbhelper.h"
+#include "eventhelper.h"
+#include "ueventhelper.h"
+#include "calibrationhelper.h"
+#include "outputhelper.h"
+#include "ringhelper.h"
+#include "shmhelper.h"
+#include "metricshelper.h"
+#include "serverhelper.h"
+#include "formathelper.h"
+#include "filterhelper.h"
+#include "rolluphelper.h"
+#include "capturehelper.h"
+#include "pipehelper.h"
+#include "pushhelper.h"
+#include "sqlitehelper.h"
+#include "sysfshelper.h"
+#include "sensorhelper.h"
+#include "libtemper1.h"
 #include "strreplace.h"
+#include "temper1.h"
+#include "benchhelper.h"
 
 #define VERSION "0.1"
 
-#define VENDOR_ID 0x0c45
-#define PRODUCT_ID 0x7401
-#define INTERFACE0 0
-#define INTERFACE1 1
+#define DEFAULT_INTERVAL 60
+#define DEFAULT_FLUSH_BYTES 65536
+#define DEFAULT_MAX_FILES 64
+#define DEFAULT_STORE_CAPACITY 525600
+#define DEFAULT_SHM_NAME "/temper1"
+#define DEFAULT_PIPELINE_RECORDS 1024
+// How long closing the output keeps trying to send what is left to PUSH
+#define PUSH_LINGER_MS 1000
+// A file per device has no need to say which device each reading is from
+#define SHARD_FORMAT "%t,%v"
+// A device failing BREAKER_FAILURES reads in a row is left out of the next
+// 2^(trips-1) sweeps, up to BREAKER_MAX_SKIP. Its second trip re-claims the
+// interfaces and any later one resets the port.
+#define BREAKER_FAILURES 3
+#define BREAKER_MAX_SKIP 64
+#define RESETS_MAX 16
 
 // Forward declarations
 static void load_configuration();
+static void reopen_output();
+static void write_records(const char *busport, const temper1_sample *samples, unsigned int count);
 static void load_calibrations();
-static int is_device_temper1(struct usb_device *device);
-static int initialise_temper1(struct usb_dev_handle *handle);
-static int use_temper1(struct usb_dev_handle *handle);
-static int read_temper1(struct usb_dev_handle *handle, char *data, int datalen);
-static int close_temper1(struct usb_dev_handle *handle);
+static void reload_calibrations();
+static int bind_calibration(struct usb_dev_handle *handle);
+static void calibrate_device(temper1_device *dev);
+static ring_store *open_store(char *busport, int readonly);
+static void free_temper1_device(void *data);
+static void publish_status(temper1_device *dev, int status);
+static int refresh_temper1(struct usb_dev_handle *handle, char *data, int r);
+static int burst_temper1(struct usb_dev_handle *handle, char *data, int r);
+static int filter_temper1(struct usb_dev_handle *handle, char *data, int r);
+static void trip_breaker(struct usb_dev_handle *handle, temper1_device *dev, int ok);
+static void reset_sick_temper1();
+static int recall_trips(const char *busport);
+static int run_daemon();
+static void render_metrics(metrics_page *page);
+static void dump_stats();
+static int run_query(int argc, char *argv[]);
+static int run_rollup(int argc, char *argv[]);
+static int run_latest(int argc, char *argv[]);
+static int run_replay(int argc, char *argv[]);
 
 static void parse_units(char *arg);
-static int decode_raw_data(char *data);
-static float raw_to_c(char *busport, int rawtemp);
-static float c_to_u(float deg_c, char unit);
-
-typedef struct options {
-	int verbose;
-	int daemon;
-	char output_file[FILENAME_MAX];
-	char config_file[FILENAME_MAX];
-	char units;
-	char dt_format[100];
-	char only_device[40];
-} options;
 
 options opts;
+static output_sink *sink = NULL;
+static output_shards *shards = NULL;
+static output_format *record_format = NULL;
+static shm_table *latest = NULL;
+capture_log *capture = NULL;
+pipeline *output_pipe = NULL;
+push_sink *push = NULL;
+sql_sink *database = NULL;
 
 // Main...
 int main(int argc, char *argv[])
 {
 	opts.verbose = FALSE;
 	opts.daemon = FALSE;
+	opts.interval = DEFAULT_INTERVAL;
+	opts.concurrency = 1;
 	bzero(opts.output_file, FILENAME_MAX);
+	opts.output_policy.flush_bytes = DEFAULT_FLUSH_BYTES;
+	opts.output_policy.flush_seconds = 0;
+	opts.output_policy.fsync_seconds = 0;
+	opts.max_files = DEFAULT_MAX_FILES;
+	bzero(opts.store_file, FILENAME_MAX);
+	opts.store_capacity = DEFAULT_STORE_CAPACITY;
+	bzero(opts.rollup_file, FILENAME_MAX);
+	opts.rollups.count = 0;
+	bzero(opts.capture_file, FILENAME_MAX);
+	bzero(opts.shm_name, FILENAME_MAX);
+	bzero(opts.metrics_address, FILENAME_MAX);
+	bzero(opts.socket_path, FILENAME_MAX);
+	opts.pipeline_records = DEFAULT_PIPELINE_RECORDS;
+	opts.pipeline_wait_ms = 0;
+	bzero(&opts.push, sizeof(opts.push));
+	bzero(&opts.sql, sizeof(opts.sql));
 	strcpy(opts.config_file, "temper1.conf");
 	opts.units = 'C';
+	bzero(opts.format, FILENAME_MAX);
 	strcpy(opts.dt_format, "%d-%b-%Y %H:%M");
 	bzero(opts.only_device, 40);
+	opts.filter.burst = 1;
+	opts.filter.ema_weight = FILTER_ONE;
+	opts.filter.decimate = 1;
+
+	if (argc > 1 && strcmp(argv[1], "query") == 0)
+		return run_query(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "latest") == 0)
+		return run_latest(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "rollup") == 0)
+		return run_rollup(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+#ifdef WITH_BENCH
+		return run_bench(argc - 1, argv + 1);
+#else
+		fprintf(stderr, "bench: built without the benchmarks, run 'make bench' for temper1-bench\n");
+		return 1;
+#endif
+	}
+	if (argc > 1 && strcmp(argv[1], "replay") == 0)
+		return run_replay(argc - 1, argv + 1);
 	
 	static struct option long_options[] =
 	 {
@@ -84,11 +169,12 @@ int main(int argc, char *argv[])
 	   {"output",  required_argument, 0, 'o'},
 	   {"units",   required_argument, 0, 'u'},
 	   {"device",  required_argument, 0, 'd'},
+	   {"threads", required_argument, 0, 't'},
 	   {0, 0, 0, 0}
 	 };
 	int options_index = 0, c = 0, proceed = TRUE;
 	
-	while ((c = getopt_long(argc, argv, "hVvD:C:o:u:d:", long_options, &options_index)) != -1) 
+	while ((c = getopt_long(argc, argv, "hVvD:C:o:u:d:t:", long_options, &options_index)) != -1) 
 	{
 		switch (c) {
 			case 'C':
@@ -99,13 +185,30 @@ int main(int argc, char *argv[])
 	load_configuration();
 	
 	optind = 1;
-	while ((c = getopt_long(argc, argv, "hVvD:C:o:u:d:", long_options, &options_index)) != -1) 
+	while ((c = getopt_long(argc, argv, "hVvD:C:o:u:d:t:", long_options, &options_index)) != -1) 
 	{
 		switch (c) {
 			case 'h':
 				fprintf(stdout, "usage: temper1 [--version|-V] [--help|-h] [--daemon|-D [seconds]]\n");
 				fprintf(stdout, "               [--verbose|-v] [--config|-C [file]] [--output|-o [file]]\n");
+				fprintf(stdout, "               (an output file containing %s is split by device)\n", OUTPUT_DEVICE_PATTERN);
 				fprintf(stdout, "               [--units|-u [C|F|K]] [--device|-d [bus_no-port_no]]\n");
+				fprintf(stdout, "               [--threads|-t [count]]\n");
+				fprintf(stdout, "       temper1 query --device|-d bus_no-port_no [--from|-f time] [--to|-t time]\n");
+				fprintf(stdout, "               [--config|-C [file]] [--units|-u [C|F|K]]\n");
+				fprintf(stdout, "       temper1 rollup --device|-d bus_no-port_no [--from|-f time] [--to|-t time]\n");
+				fprintf(stdout, "               [--resolution|-r seconds] [--config|-C [file]] [--units|-u [C|F|K]]\n");
+				fprintf(stdout, "       temper1 latest [--device|-d bus_no-port_no] [--config|-C [file]]\n");
+				fprintf(stdout, "               [--units|-u [C|F|K]]\n");
+#ifdef WITH_BENCH
+				fprintf(stdout, "       temper1 bench [--sweeps|-n count] [--threads|-t count] [--capture|-c file]\n");
+				fprintf(stdout, "               [--library|-l] [--soak|-s cycles] [--stall|-S ms]\n");
+				fprintf(stdout, "               [--push|-p graphite|statsd:udp|tcp] [--sqlite|-q path]\n");
+				fprintf(stdout, "               [--sysfs|-f devices] [--uevents|-u] [--shm|-m readers]\n");
+				fprintf(stdout, "               [--clients|-k count] [--format|-F records]\n");
+#endif
+				fprintf(stdout, "       temper1 replay [--device|-d bus_no-port_no] [--from|-f time] [--to|-t time]\n");
+				fprintf(stdout, "               [--config|-C [file]] [--units|-u [C|F|K]] [--bench|-b] file\n");
 				proceed = FALSE;
 				break;
 			case 'V':
@@ -117,6 +220,12 @@ int main(int argc, char *argv[])
 				break;
 			case 'D':
 				opts.daemon = TRUE;
+				if ((opts.interval = atoi(optarg)) <= 0)
+					opts.interval = DEFAULT_INTERVAL;
+				break;
+			case 't':
+				if ((opts.concurrency = atoi(optarg)) < 1)
+					opts.concurrency = 1;
 				break;
 			case 'd':
 				strcpy(opts.only_device, optarg);
@@ -141,20 +250,37 @@ int main(int argc, char *argv[])
 	if (proceed) {	
 		initialise_usb(opts.verbose);
 		load_calibrations();
+		open_output();
+		if (strlen(opts.capture_file) > 0)
+			capture = capture_open(opts.capture_file);
+		// Only a daemon keeps the latest readings current
+		if (opts.daemon && strlen(opts.shm_name) > 0)
+			latest = shm_create(opts.shm_name);
+		// and hands its records to a thread of their own to write, so a
+		// slow disk or pipe never holds up the next sweep
+		if (opts.daemon && opts.pipeline_records > 0)
+			output_pipe = pipeline_start(sizeof(temper1_sample), opts.pipeline_records, 
+				opts.pipeline_wait_ms, deliver_records, flush_output, NULL);
 		
+		// Open every device first so that the read sweep can query them
+		// all at once (--threads) rather than one after another.
+		iterate_usb(sensor_is_temper1, initialise_temper1, NULL, NULL);
 		if (!opts.daemon) {
-			// This is the one shot read
-			iterate_usb(is_device_temper1, 
-						initialise_temper1, use_temper1, close_temper1);
+			// This is the one shot read, a burst's median if FILTER asks
+			opts.filter.decimate = 1;
+			sweep_temper1();
 		}
 		else {
-			// These separate iterations allow for the use_temper1 to do loops over all devices (daemon mode)
-			// by simply using a different use_temper1 method pointer.
-			int r = iterate_usb(is_device_temper1, initialise_temper1, NULL, NULL);
-			if (r >= 0) r = iterate_usb(is_device_temper1, NULL, use_temper1, NULL);
-			// TODO install signal handler to run this
-			if (r >= 0) r = iterate_usb(is_device_temper1, NULL, NULL, close_temper1);
+			// Handles are kept across sweeps; run_daemon only returns once 
+			// SIGTERM or SIGINT has been caught.
+			run_daemon();
 		}
+		iterate_usb(sensor_is_temper1, NULL, NULL, sensor_release);
+		pipeline_stop(output_pipe);
+		output_pipe = NULL;
+		close_output();
+		capture_close(capture);
+		shm_destroy(latest, opts.shm_name);
 	}
 	
 	return (!proceed);
@@ -173,72 +299,912 @@ static void parse_units(char *arg)
 	}
 }
 
-// Worker methods
-static void output_data(char *busport, char *data)
+// Daemon mode
+// The bus is only enumerated again after a TEMPer1 has been plugged in.
+// That is left to the next tick, by which time udev will normally have 
+// applied the permissions from 60-temper.rules; a device that still can't
+// be opened is retried on the ticks after that.
+int rescan_pending = 0;
+static int hotplug_fd = -1;
+
+static int on_sample_timer(int fd, void *data)
+{
+	int missed = event_timer_expirations(fd) - 1;
+	if (missed > 0 && opts.verbose) 
+		fprintf(stderr, "Sweep overran, skipped %d interval(s)\n", missed);
+
+	// Without hotplug events every sweep has to look for new devices
+	if (rescan_pending > 0 || hotplug_fd < 0) {
+		if (iterate_usb(sensor_is_temper1, initialise_temper1, NULL, NULL) > 0)
+			rescan_pending--;
+		else
+			rescan_pending = 0;
+	}
+	sweep_temper1();
+	reset_sick_temper1();
+	return 0;
+}
+
+// A removal carries no vendor or product, so any device unplugged is
+// looked for among the open ones
+void apply_uevent(const uevent *event)
+{
+	if (event->action == UEVENT_ADD && 
+			event->vendor == SENSOR_VENDOR_ID && event->product == SENSOR_PRODUCT_ID) {
+		if (opts.verbose) fprintf(stderr, "TEMPer1 added at %d:%d\n", event->busnum, event->devnum);
+		rescan_pending = RESCAN_ATTEMPTS;
+	}
+	else if (event->action == UEVENT_REMOVE) {
+		// The device is gone, so there is nothing to release
+		if (forget_usb_device(event->busnum, event->devnum, NULL) >= 0 && opts.verbose)
+			fprintf(stderr, "TEMPer1 removed from %d:%d\n", event->busnum, event->devnum);
+	}
+}
+
+static int on_hotplug_event(int fd, void *data)
+{
+	uevent event;
+	int r;
+
+	while ((r = uevent_receive(fd, &event)) >= 0) {
+		if (r > 0)
+			apply_uevent(&event);
+	}
+	return 0;
+}
+
+static int on_signal(int fd, void *data)
+{
+	int signo = event_signal_read(fd);
+	if (signo == SIGHUP) {
+		reopen_output();
+		reload_calibrations();
+	}
+	else if (signo == SIGUSR1) {
+		dump_stats();
+	}
+	else {
+		if (opts.verbose) fprintf(stderr, "Caught signal %d, shutting down\n", signo);
+		event_loop_stop();
+	}
+	return 0;
+}
+
+static int run_daemon()
 {
-	struct tm *utc;
-	time_t tm;
-	tm = time(NULL);
-	utc = gmtime(&tm);
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+
+	int timer_fd = event_timer_create(opts.interval);
+	int signal_fd = event_signal_create(&signals);
+	if (timer_fd < 0 || signal_fd < 0) 
+		return -1;
+
+	event_add(timer_fd, on_sample_timer, NULL);
+	event_add(signal_fd, on_signal, NULL);
+	if ((hotplug_fd = uevent_open()) >= 0)
+		event_add(hotplug_fd, on_hotplug_event, NULL);
+	else if (opts.verbose) 
+		fprintf(stderr, "No hotplug events, rescanning the bus every sweep\n");
 	
-	char dt[80];
-	strftime(dt, 80, opts.dt_format, utc);
+	int metrics_fd = -1;
+	if (strlen(opts.metrics_address) > 0 && 
+			(metrics_fd = metrics_listen(opts.metrics_address, render_metrics)) >= 0 && opts.verbose)
+		fprintf(stderr, "Serving /metrics on %s\n", opts.metrics_address);
+	int server_fd = -1;
+	if (strlen(opts.socket_path) > 0 && 
+			(server_fd = server_listen(opts.socket_path, answer_request, refresh_device, release_device)) >= 0 && 
+			opts.verbose)
+		fprintf(stderr, "Answering requests on %s\n", opts.socket_path);
 
-	float t = c_to_u(raw_to_c(busport, decode_raw_data(data)), opts.units);
+	if (opts.verbose) fprintf(stderr, "Sampling every %d seconds\n", opts.interval);
+	int r = event_loop_run();
 
-	FILE *fp = stdout;
-	if (strlen(opts.output_file) > 0) {
-		if (!(fp = fopen(opts.output_file, "w+"))) {
-			fprintf(stderr, "Unable to open %s for appending\n", opts.output_file);
-			fp = stdout;
+	server_close(server_fd, opts.socket_path);
+	metrics_close(metrics_fd, opts.metrics_address);
+	close(timer_fd);
+	close(signal_fd);
+	if (hotplug_fd >= 0)
+		close(hotplug_fd);
+	return r;
+}
+
+// Only ever one writer at a time, the one holding the handle's lock
+static void publish_last(temper1_device *dev, float value, int64_t timestamp)
+{
+	uint32_t seq = dev->last_seq;
+
+	__atomic_store_n(&dev->last_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store(&dev->last_value, &value, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->last_timestamp, timestamp, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->last_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Returns the timestamp, 0 before the first reading
+static int64_t read_last(temper1_device *dev, float *value)
+{
+	uint32_t before, after;
+	int64_t timestamp;
+
+	do {
+		before = __atomic_load_n(&dev->last_seq, __ATOMIC_ACQUIRE);
+		__atomic_load(&dev->last_value, value, __ATOMIC_RELAXED);
+		timestamp = __atomic_load_n(&dev->last_timestamp, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&dev->last_seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+	return timestamp;
+}
+
+// /metrics is served from the event loop thread, which also runs the
+// sweeps, but a read for the SOCKET may be under way on another thread
+// meanwhile. The last reading is taken through read_last; the counters
+// and histograms only ever grow and may be rendered a read behind.
+static metrics_page *metrics = NULL;
+static time_t metrics_time;
+
+static int render_temperature(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	float value;
+	if (dev && read_last(dev, &value) > 0)
+		metrics_printf(metrics, "temper1_temperature_celsius{device=\"%s\"} %.3f\n", 
+			dev->busport, value);
+	return 0;
+}
+
+static int render_sample_age(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	float value;
+	int64_t timestamp = dev ? read_last(dev, &value) : 0;
+	if (timestamp > 0)
+		metrics_printf(metrics, "temper1_sample_age_seconds{device=\"%s\"} %ld\n", 
+			dev->busport, (long)(metrics_time - timestamp));
+	return 0;
+}
+
+static int render_reads(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev)
+		metrics_printf(metrics, "temper1_reads_total{device=\"%s\"} %lu\n", dev->busport, dev->reads);
+	return 0;
+}
+
+static int render_errors(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev)
+		metrics_printf(metrics, "temper1_read_errors_total{device=\"%s\"} %lu\n", dev->busport, dev->errors);
+	return 0;
+}
+
+static int render_written(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev)
+		metrics_printf(metrics, "temper1_records_written_total{device=\"%s\"} %lu\n", dev->busport, dev->written);
+	return 0;
+}
+
+static int render_suppressed(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev)
+		metrics_printf(metrics, "temper1_records_suppressed_total{device=\"%s\"} %lu\n", dev->busport, dev->suppressed);
+	return 0;
+}
+
+static int render_unstored(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev && dev->store)
+		metrics_printf(metrics, "temper1_records_unstored_total{device=\"%s\"} %lu\n", dev->busport, dev->unstored);
+	return 0;
+}
+
+static int render_dropped(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev && dev->lane)
+		metrics_printf(metrics, "temper1_records_dropped_total{device=\"%s\"} %lu\n", dev->busport, dev->lane->dropped);
+	return 0;
+}
+
+static int render_latency(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev && dev->reads > 0)
+		metrics_printf(metrics, "temper1_read_latency_seconds{device=\"%s\"} %.6f\n", 
+			dev->busport, dev->query_usec / 1e6);
+	return 0;
+}
+
+static int render_stages(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	int stage, i;
+	uint64_t total;
+
+	if (!dev || !dev->stats)
+		return 0;
+	for (stage = 0; stage < STATS_STAGES; stage++) {
+		const stats_histogram *h = &dev->stats->stages[stage];
+		const char *name = stats_stage_names[stage];
+		for (i = 0, total = 0; i < STATS_BUCKETS - 1; i++) {
+			total += h->buckets[i];
+			metrics_printf(metrics, "temper1_stage_seconds_bucket{device=\"%s\",stage=\"%s\",le=\"%g\"} %llu\n",
+				dev->busport, name, stats_bucket_limit(i) / 1e6, (unsigned long long)total);
 		}
+		metrics_printf(metrics, "temper1_stage_seconds_bucket{device=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n"
+			"temper1_stage_seconds_count{device=\"%s\",stage=\"%s\"} %llu\n"
+			"temper1_stage_seconds_sum{device=\"%s\",stage=\"%s\"} %.6f\n",
+			dev->busport, name, (unsigned long long)h->count, dev->busport, name, 
+			(unsigned long long)h->count, dev->busport, name, h->sum_usec / 1e6);
 	}
+	return 0;
+}
 
-// Uncomment this line to use the opts.dt_format output 
-//	fprintf(fp, "%s,%s,%f\n", dt, busport, t);
-// Otherwise we default to outputing a timestamp in seconds as this is easier
-// to use in JQuery/Javascript and Oracle 
-	fprintf(fp, "%ld,%f,%s\n", tm, t, busport) ;
+static int render_usb_errors(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	int code;
 
-	fflush(fp);
-	if (fp != stdout) 
-		fclose(fp);
+	if (!dev || !dev->stats)
+		return 0;
+	for (code = 1; code < STATS_ERROR_CODES; code++) {
+		if (dev->stats->errors[code])
+			metrics_printf(metrics, "temper1_usb_errors_total{device=\"%s\",code=\"%d\"} %u\n", 
+				dev->busport, -code, dev->stats->errors[code]);
+	}
+	return 0;
 }
 
-static int is_device_temper1(struct usb_device *device)
+static int render_timeouts(struct usb_dev_handle *handle)
 {
-	return device_vendor_product_is(device, VENDOR_ID, PRODUCT_ID);
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev && dev->stats)
+		metrics_printf(metrics, "temper1_usb_timeouts_total{device=\"%s\"} %llu\n", 
+			dev->busport, (unsigned long long)dev->stats->timeouts);
+	return 0;
 }
 
-static int use_temper1(struct usb_dev_handle *handle)
+static int render_zero_reads(struct usb_dev_handle *handle)
 {
-	int r, do_read = TRUE;
-	char data[8];
-	char busport[100] = {};
-		
-	r = handle_bus_port(handle, busport);
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev && dev->stats)
+		metrics_printf(metrics, "temper1_zero_reads_total{device=\"%s\"} %llu\n", 
+			dev->busport, (unsigned long long)dev->stats->zero_reads);
+	return 0;
+}
 
-	if (strlen(opts.only_device) > 0) {
-		do_read = (strcmp(busport, opts.only_device) == 0);
+// Families may not be interleaved, so each one is a pass over the devices
+static void render_metrics(metrics_page *page)
+{
+	metrics = page;
+	metrics_time = time(NULL);
+	metrics_printf(page, "# TYPE temper1_temperature_celsius gauge\n"
+		"# UNIT temper1_temperature_celsius celsius\n"
+		"# HELP temper1_temperature_celsius Last calibrated reading.\n");
+	sweep_usb(render_temperature, 1);
+	metrics_printf(page, "# TYPE temper1_sample_age_seconds gauge\n"
+		"# UNIT temper1_sample_age_seconds seconds\n"
+		"# HELP temper1_sample_age_seconds Time since the last good reading.\n");
+	sweep_usb(render_sample_age, 1);
+	metrics_printf(page, "# TYPE temper1_reads counter\n"
+		"# HELP temper1_reads Reads attempted.\n");
+	sweep_usb(render_reads, 1);
+	metrics_printf(page, "# TYPE temper1_read_errors counter\n"
+		"# HELP temper1_read_errors Reads that failed or returned nothing.\n");
+	sweep_usb(render_errors, 1);
+	metrics_printf(page, "# TYPE temper1_records_written counter\n"
+		"# HELP temper1_records_written Readings written to the output and store.\n");
+	sweep_usb(render_written, 1);
+	metrics_printf(page, "# TYPE temper1_records_suppressed counter\n"
+		"# HELP temper1_records_suppressed Readings held back by the DEADBAND.\n");
+	sweep_usb(render_suppressed, 1);
+	if (strlen(opts.store_file) > 0) {
+		metrics_printf(page, "# TYPE temper1_records_unstored counter\n"
+			"# HELP temper1_records_unstored Readings kept out of the STORE, older than its newest after the clock went back.\n");
+		sweep_usb(render_unstored, 1);
 	}
-	
-	if (do_read) {
-		bzero(data, 8);
-		r = read_temper1(handle, data, 8);
-		if (r != 0) {
-			if (decode_raw_data(data) != 0) { 
-				output_data(busport, data);
-			}
-			else {
-				if (opts.verbose) fprintf(stderr, "Read returned 0 value (r = %i)\n", r);
-				r = -1;
-			}
+	if (output_pipe) {
+		metrics_printf(page, "# TYPE temper1_records_dropped counter\n"
+			"# HELP temper1_records_dropped Readings dropped with the PIPELINE to the output full.\n");
+		sweep_usb(render_dropped, 1);
+	}
+	metrics_printf(page, "# TYPE temper1_read_latency_seconds gauge\n"
+		"# UNIT temper1_read_latency_seconds seconds\n"
+		"# HELP temper1_read_latency_seconds Duration of the last read.\n");
+	sweep_usb(render_latency, 1);
+	metrics_printf(page, "# TYPE temper1_stage_seconds histogram\n"
+		"# UNIT temper1_stage_seconds seconds\n"
+		"# HELP temper1_stage_seconds Time spent in each stage of a read.\n");
+	sweep_usb(render_stages, 1);
+	metrics_printf(page, "# TYPE temper1_usb_errors counter\n"
+		"# HELP temper1_usb_errors Failed transfers by return code.\n");
+	sweep_usb(render_usb_errors, 1);
+	metrics_printf(page, "# TYPE temper1_usb_timeouts counter\n"
+		"# HELP temper1_usb_timeouts Transfers that timed out.\n");
+	sweep_usb(render_timeouts, 1);
+	metrics_printf(page, "# TYPE temper1_zero_reads counter\n"
+		"# HELP temper1_zero_reads Reads that came back as zero.\n");
+	sweep_usb(render_zero_reads, 1);
+	if (push) {
+		metrics_printf(page, "# TYPE temper1_push_lines counter\n"
+			"# HELP temper1_push_lines Lines for PUSH by what became of them.\n"
+			"temper1_push_lines_total{state=\"sent\"} %lu\n"
+			"temper1_push_lines_total{state=\"dropped\"} %lu\n"
+			"# TYPE temper1_push_connects counter\n"
+			"# HELP temper1_push_connects Sockets opened for PUSH.\n"
+			"temper1_push_connects_total %lu\n",
+			push->sent, push->dropped, push->connects);
+	}
+	if (database) {
+		metrics_printf(page, "# TYPE temper1_sqlite_rows counter\n"
+			"# HELP temper1_sqlite_rows Readings for the OUTPUT database by what became of them.\n"
+			"temper1_sqlite_rows_total{state=\"committed\"} %lu\n"
+			"temper1_sqlite_rows_total{state=\"failed\"} %lu\n"
+			"# TYPE temper1_sqlite_transactions counter\n"
+			"# HELP temper1_sqlite_transactions Transactions committed to the OUTPUT database.\n"
+			"temper1_sqlite_transactions_total %lu\n",
+			database->rows, database->errors, database->transactions);
+	}
+	metrics = NULL;
+}
+
+// SIGUSR1 writes a summary of every device's histograms and errors to
+// stderr; times are bucket limits, so within a factor of two
+static int dump_device_stats(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	int stage, code;
+
+	if (!dev || !dev->stats)
+		return 0;
+	for (stage = 0; stage < STATS_STAGES; stage++) {
+		const stats_histogram *h = &dev->stats->stages[stage];
+		if (h->count == 0)
+			continue;
+		fprintf(stderr, "%s %-8s n=%llu mean=%lluus p50<%ldus p90<%ldus p99<%ldus max<%ldus\n",
+			dev->busport, stats_stage_names[stage], (unsigned long long)h->count,
+			(unsigned long long)(h->sum_usec / h->count), stats_percentile(h, 0.5), 
+			stats_percentile(h, 0.9), stats_percentile(h, 0.99), stats_percentile(h, 1.0));
+	}
+	fprintf(stderr, "%s errors timeouts=%llu zero_reads=%llu", dev->busport, 
+		(unsigned long long)dev->stats->timeouts, (unsigned long long)dev->stats->zero_reads);
+	for (code = 1; code < STATS_ERROR_CODES; code++) {
+		if (dev->stats->errors[code])
+			fprintf(stderr, " %d:%u", -code, dev->stats->errors[code]);
+	}
+	fprintf(stderr, "\n");
+	if (dev->written + dev->suppressed > 0)
+		fprintf(stderr, "%s records written=%lu suppressed=%lu (%.1f%%)\n", dev->busport, 
+			dev->written, dev->suppressed, 
+			100.0 * dev->suppressed / (dev->written + dev->suppressed));
+	if (dev->unstored > 0)
+		fprintf(stderr, "%s records unstored=%lu with the clock gone back\n", dev->busport, dev->unstored);
+	if (dev->lane && dev->lane->dropped > 0)
+		fprintf(stderr, "%s records dropped=%lu of %lu with the output behind\n", dev->busport, 
+			dev->lane->dropped, dev->lane->dropped + dev->lane->pushed);
+	return 0;
+}
+
+static void dump_stats()
+{
+	sweep_usb(dump_device_stats, 1);
+	if (push)
+		fprintf(stderr, "push %s sent=%lu dropped=%lu waiting=%lu bytes, %lu datagrams, %lu connects\n", 
+			opts.push.address, push->sent, push->dropped, (unsigned long)(push->used - push->head), 
+			push->datagrams, push->connects);
+	if (database)
+		fprintf(stderr, "sqlite %s rows=%lu failed=%lu pending=%lu in %lu transactions\n", 
+			opts.sql.path, database->rows, database->errors, database->pending, database->transactions);
+	fflush(stderr);
+}
+
+// Worker methods
+// use_temper1 runs on several threads during a concurrent sweep
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// An output file name containing OUTPUT_DEVICE_PATTERN gets one file per
+// device, e.g. public_html/temp.%d.csv
+void open_output()
+{
+	if (!(output_is_template(opts.output_file) && 
+			(shards = output_shards_create(opts.output_file, &opts.output_policy, opts.max_files)))) {
+		if (!(sink = output_open(opts.output_file, &opts.output_policy)))
+			sink = output_open(NULL, &opts.output_policy);
+	}
+
+	// FORMAT in temper1.conf, compiled once for every record to come
+	const char *format = (strlen(opts.format) > 0) ? opts.format : 
+		(shards ? SHARD_FORMAT : FORMAT_PRESET_CSV);
+	record_format = format_compile(format, opts.dt_format);
+
+	// PUSH in temper1.conf, readings sent to Graphite or StatsD as well
+	if (strlen(opts.push.address) > 0 && !(push = push_open(&opts.push)))
+		fprintf(stderr, "Unable to push to %s\n", opts.push.address);
+	// OUTPUT in temper1.conf, readings kept in SQLite as well
+	if (strlen(opts.sql.path) > 0)
+		database = sql_open(&opts.sql);
+}
+
+// Run on SIGHUP so that logrotate can move the output file
+static void reopen_output()
+{
+	pthread_mutex_lock(&output_lock);
+	if (shards)
+		output_shards_reopen(shards);
+	else if (output_reopen(sink) < 0)
+		fprintf(stderr, "Unable to reopen %s, still writing to the old file\n", opts.output_file);
+	pthread_mutex_unlock(&output_lock);
+}
+
+// Run after every sweep. With a PIPELINE the output thread flushes once it
+// has caught up with what the sweep read.
+void tick_output()
+{
+	if (output_pipe)
+		pipeline_kick(output_pipe);
+	else
+		flush_output(NULL);
+}
+
+// Readings asked for on the SOCKET may be being written meanwhile
+void flush_output(void *arg)
+{
+	time_t now = time(NULL);
+	pthread_mutex_lock(&output_lock);
+	if (shards)
+		output_shards_tick(shards, now);
+	else
+		output_tick(sink, now);
+	push_flush(push);
+	sql_flush(database, now, FALSE);
+	pthread_mutex_unlock(&output_lock);
+}
+
+void close_output()
+{
+	output_shards_close(shards);
+	output_close(sink);
+	format_free(record_format);
+	push_close(push, PUSH_LINGER_MS);
+	push = NULL;
+	sql_close(database);
+	database = NULL;
+}
+
+// The latest reading, for the SOCKET, /metrics and SHM
+static void publish_reading(temper1_device *dev, time_t tm, float c, int raw)
+{
+	publish_last(dev, c, (int64_t)tm);
+	if (latest && dev->shm_slot >= 0) {
+		shm_reading reading = { {0}, tm, c, raw, SHM_STATUS_OK };
+		strcpy(reading.busport, dev->busport);
+		shm_publish(latest, dev->shm_slot, &reading);
+	}
+}
+
+// value is the raw reading in the fixed point of filterhelper.h
+static void output_data(temper1_device *dev, int32_t value)
+{
+	time_t tm = time(NULL);
+	// Rounded half away from zero; division truncates towards it, which
+	// would take readings below freezing the wrong way
+	int raw = (value >= 0 ? value + FILTER_ONE / 2 : value - FILTER_ONE / 2) / FILTER_ONE;
+	float c = raw_to_c(dev, (float)value / FILTER_ONE);
+
+	// Readings that the store and the output don't need still go to the
+	// rollups and the latest readings
+	int write = TRUE;
+	if (dev->deadband >= 0 && dev->written > 0) {
+		float change = (c > dev->written_value) ? c - dev->written_value : dev->written_value - c;
+		write = change > dev->deadband ||
+			(dev->heartbeat > 0 && tm - dev->written_timestamp >= dev->heartbeat);
+	}
+	if (write) {
+		dev->written++;
+		dev->written_value = c;
+		dev->written_timestamp = tm;
+	}
+	else {
+		dev->suppressed++;
+	}
+
+	// Each device's store is only ever written from the one thread that
+	// is reading that device
+	if (dev->store && write) {
+		temper1_sample sample = { tm, c, raw, 0 };
+		if (ring_append(dev->store, &sample) < 0)
+			dev->unstored++;
+	}
+	if (dev->rollups)
+		rollup_add(dev->rollups, tm, c);
+	publish_reading(dev, tm, c, raw);
+
+	if (!write)
+		return;
+
+	// With a PIPELINE the output stage is only the hand over; a full lane
+	// drops the record, counted on the lane, rather than wait for a disk
+	temper1_sample sample = { tm, c, raw, 0 };
+	struct timespec started;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	if (dev->lane)
+		pipeline_push(output_pipe, dev->lane, &sample);
+	else
+		write_records(dev->busport, &sample, 1);
+	if (dev->stats)
+		stats_record(&dev->stats->stages[STATS_OUTPUT], elapsed_usec(&started));
+}
+
+// Formats and writes a device's records, on the output thread when there
+// is a PIPELINE
+static void write_records(const char *busport, const temper1_sample *samples, unsigned int count)
+{
+	char record[RECORD_MAX];
+	output_sink *out = sink;
+	unsigned int i;
+
+	pthread_mutex_lock(&output_lock);
+	if (record_format && shards)
+		out = output_shard_sink(shards, busport);
+	for (i = 0; i < count; i++) {
+		// The default of a timestamp in seconds is easier to use in 
+		// JQuery/Javascript and Oracle than DATETIME (%T)
+		format_record fr = { samples[i].timestamp, c_to_u(samples[i].value, opts.units), 
+			samples[i].raw, opts.units, busport };
+		if (record_format && out) {
+			int length = format_render(record_format, &fr, record, sizeof(record));
+			output_write(out, record, length);
 		}
-		else {
-			if (opts.verbose) fprintf(stderr, "use_temper1: read_temper1 returned (r = %i)\n", r);
+		// Queued to go with the rest of the sweep on the next flush
+		if (push)
+			push_record(push, busport, fr.value, fr.timestamp);
+		// In a transaction that the next flush commits
+		if (database)
+			sql_record(database, busport, samples[i].timestamp, samples[i].value, samples[i].raw);
+	}
+	pthread_mutex_unlock(&output_lock);
+}
+
+void deliver_records(const pipe_lane *lane, const void *records, unsigned int count, void *arg)
+{
+	write_records(lane->name, (const temper1_sample *)records, count);
+}
+
+// Binary history, one ring file per device (STORE in temper1.conf)
+static ring_store *open_store(char *busport, int readonly)
+{
+	ring_store *store;
+	char *path;
+
+	if (strlen(opts.store_file) == 0)
+		return NULL;
+	if (!(path = strreplace(opts.store_file, OUTPUT_DEVICE_PATTERN, busport)))
+		return NULL;
+	if (readonly)
+		store = ring_open_readonly(path, sizeof(temper1_sample));
+	else
+		store = ring_open(path, sizeof(temper1_sample), opts.store_capacity);
+	free(path);
+	return store;
+}
+
+static void free_temper1_device(void *data)
+{
+	temper1_device *dev = (temper1_device *)data;
+	publish_status(dev, SHM_STATUS_REMOVED);
+	ring_close(dev->store);
+	rollup_close(dev->rollups);
+	// Whatever is still in the lane is written before it goes
+	pipeline_retire(output_pipe, dev->lane);
+	free(dev);
+}
+
+// Each device's slot is only written by the thread reading the device
+static void publish_status(temper1_device *dev, int status)
+{
+	if (latest && dev->shm_slot >= 0)
+		shm_publish_status(latest, dev->shm_slot, status);
+}
+
+// Times are seconds since the epoch, or if negative relative to now
+static int64_t parse_time(const char *arg)
+{
+	int64_t t = strtoll(arg, NULL, 10);
+	return (t < 0) ? (int64_t)time(NULL) + t : t;
+}
+
+// temper1 query: prints a device's stored readings between two times,
+// read directly from its ring
+static int run_query(int argc, char *argv[])
+{
+	static struct option query_options[] =
+	 {
+	   {"device", required_argument, 0, 'd'},
+	   {"from",   required_argument, 0, 'f'},
+	   {"to",     required_argument, 0, 't'},
+	   {"config", required_argument, 0, 'C'},
+	   {"units",  required_argument, 0, 'u'},
+	   {0, 0, 0, 0}
+	 };
+	int64_t from = 0, to = INT64_MAX;
+	int options_index = 0, c;
+
+	while ((c = getopt_long(argc, argv, "d:f:t:C:u:", query_options, &options_index)) != -1) 
+	{
+		switch (c) {
+			case 'd':
+				snprintf(opts.only_device, sizeof(opts.only_device), "%s", optarg);
+				break;
+			case 'f':
+				from = parse_time(optarg);
+				break;
+			case 't':
+				to = parse_time(optarg);
+				break;
+			case 'C':
+				snprintf(opts.config_file, FILENAME_MAX, "%s", optarg);
+				break;
+			case 'u':
+				parse_units(optarg);
+				break;
+			default:
+				return 1;
 		}
 	}
-		
+	load_configuration();
+
+	if (strlen(opts.only_device) == 0 || strlen(opts.store_file) == 0) {
+		fprintf(stderr, "query needs --device and a STORE in %s\n", opts.config_file);
+		return 1;
+	}
+
+	ring_store *store = open_store(opts.only_device, TRUE);
+	if (!store)
+		return 1;
+
+	// One view of the ring for the whole query, whatever the daemon appends
+	uint64_t written = ring_written(store);
+	uint64_t i, count = ring_count(store, written);
+	for (i = ring_lower_bound(store, written, from); i < count; i++) {
+		const temper1_sample *sample = (const temper1_sample *)ring_record(store, written, i);
+		if (sample->timestamp > to)
+			break;
+		fprintf(stdout, "%lld,%f\n", (long long)sample->timestamp, c_to_u(sample->value, opts.units));
+	}
+	ring_close(store);
+	return 0;
+}
+
+// temper1 rollup: min, max and mean per period, from the ROLLUP archive
+// with the finest resolution that reaches back to --from, or the one
+// given with --resolution
+static int run_rollup(int argc, char *argv[])
+{
+	static struct option rollup_options[] =
+	 {
+	   {"device",     required_argument, 0, 'd'},
+	   {"from",       required_argument, 0, 'f'},
+	   {"to",         required_argument, 0, 't'},
+	   {"resolution", required_argument, 0, 'r'},
+	   {"config",     required_argument, 0, 'C'},
+	   {"units",      required_argument, 0, 'u'},
+	   {0, 0, 0, 0}
+	 };
+	int64_t from = 0, to = INT64_MAX;
+	uint32_t resolution = 0;
+	int options_index = 0, c;
+
+	while ((c = getopt_long(argc, argv, "d:f:t:r:C:u:", rollup_options, &options_index)) != -1) 
+	{
+		switch (c) {
+			case 'd':
+				snprintf(opts.only_device, sizeof(opts.only_device), "%s", optarg);
+				break;
+			case 'f':
+				from = parse_time(optarg);
+				break;
+			case 't':
+				to = parse_time(optarg);
+				break;
+			case 'r':
+				resolution = strtoul(optarg, NULL, 10);
+				break;
+			case 'C':
+				snprintf(opts.config_file, FILENAME_MAX, "%s", optarg);
+				break;
+			case 'u':
+				parse_units(optarg);
+				break;
+			default:
+				return 1;
+		}
+	}
+	load_configuration();
+
+	if (strlen(opts.only_device) == 0 || opts.rollups.count == 0) {
+		fprintf(stderr, "rollup needs --device and a ROLLUP in %s\n", opts.config_file);
+		return 1;
+	}
+
+	ring_store *archive;
+	if (resolution > 0) {
+		char *path = rollup_path(opts.rollup_file, opts.only_device, resolution);
+		archive = path ? ring_open_readonly(path, sizeof(rollup_record)) : NULL;
+		free(path);
+	}
+	else {
+		archive = rollup_open_best(opts.rollup_file, opts.only_device, &opts.rollups, from, &resolution);
+	}
+	if (!archive)
+		return 1;
+
+	// A period is listed if any of it falls within the window
+	uint64_t written = ring_written(archive);
+	uint64_t i, count = ring_count(archive, written);
+	for (i = ring_lower_bound(archive, written, from - (from % resolution)); i < count; i++) {
+		const rollup_record *record = (const rollup_record *)ring_record(archive, written, i);
+		if (record->timestamp > to)
+			break;
+		if (record->count == 0)
+			continue;
+		fprintf(stdout, "%lld,%u,%f,%f,%f,%u\n", (long long)record->timestamp, resolution,
+			c_to_u(record->min, opts.units), c_to_u(record->max, opts.units),
+			c_to_u(record->sum / record->count, opts.units), record->count);
+	}
+	ring_close(archive);
+	return 0;
+}
+
+// temper1 latest: prints the readings a running daemon last published
+// (SHM in temper1.conf) without touching the devices
+static int run_latest(int argc, char *argv[])
+{
+	static struct option latest_options[] =
+	 {
+	   {"device", required_argument, 0, 'd'},
+	   {"config", required_argument, 0, 'C'},
+	   {"units",  required_argument, 0, 'u'},
+	   {0, 0, 0, 0}
+	 };
+	const char *status[] = { "ok", "error", "removed" };
+	int options_index = 0, c, i, found = 0;
+
+	while ((c = getopt_long(argc, argv, "d:C:u:", latest_options, &options_index)) != -1) 
+	{
+		switch (c) {
+			case 'd':
+				snprintf(opts.only_device, sizeof(opts.only_device), "%s", optarg);
+				break;
+			case 'C':
+				snprintf(opts.config_file, FILENAME_MAX, "%s", optarg);
+				break;
+			case 'u':
+				parse_units(optarg);
+				break;
+			default:
+				return 1;
+		}
+	}
+	load_configuration();
+
+	shm_table *table = shm_attach(strlen(opts.shm_name) > 0 ? opts.shm_name : DEFAULT_SHM_NAME);
+	if (!table) {
+		fprintf(stderr, "No readings published, is the daemon running with SHM set?\n");
+		return 1;
+	}
+
+	shm_reading reading;
+	for (i = 0; shm_read_slot(table, i, &reading) == 0; i++) {
+		if (strlen(opts.only_device) > 0 && strcmp(reading.busport, opts.only_device) != 0)
+			continue;
+		fprintf(stdout, "%lld,%f,%s,%s\n", (long long)reading.timestamp, 
+			c_to_u(reading.value, opts.units), reading.busport, 
+			status[reading.status <= SHM_STATUS_REMOVED ? reading.status : SHM_STATUS_ERROR]);
+		found++;
+	}
+	shm_detach(table);
+	return (found == 0);
+}
+
+// Counts a read against the device, setting *raw from a good one. Returns
+// r, or -1 for a read of 0 (which the TEMPer1 returns when not ready).
+static int check_temper1(struct usb_dev_handle *handle, temper1_device *dev, char *data, int r, int *raw)
+{
+	dev->reads++;
+	dev->query_usec = get_handle_query_usec(handle);
+	if (r > 0 && capture && dev->capture_id >= 0)
+		capture_frame(capture, dev->capture_id, time(NULL), data);
+	if (r != 0) {
+		if ((*raw = decode_raw_data(data)) == 0) {
+			if (opts.verbose) fprintf(stderr, "Read returned 0 value (r = %i)\n", r);
+			dev->errors++;
+			if (r > 0 && dev->stats)
+				dev->stats->zero_reads++;
+			r = -1;
+		}
+	}
+	else {
+		if (opts.verbose) fprintf(stderr, "use_temper1: read_temper1 returned (r = %i)\n", r);
+		dev->errors++;
+	}
+	trip_breaker(handle, dev, r > 0);
+	return r;
+}
+
+// Called with the result of each device's temperature query
+int use_temper1(struct usb_dev_handle *handle, char *data, int r)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	int raw;
+	if (!dev)
+		return -1;
+
+	r = check_temper1(handle, dev, data, r, &raw);
+	if (r > 0)
+		output_data(dev, raw * FILTER_ONE);
+	else
+		publish_status(dev, SHM_STATUS_ERROR);
+	return r;
+}
+
+// Called with a read made for the SOCKET. The reading is only published:
+// the output and the history are left to the sweeps, so that with FILTER
+// set they still only see filtered values.
+static int refresh_temper1(struct usb_dev_handle *handle, char *data, int r)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	int raw;
+	if (!dev)
+		return -1;
+
+	r = check_temper1(handle, dev, data, r, &raw);
+	if (r > 0)
+		publish_reading(dev, time(NULL), raw_to_c(dev, raw), raw);
+	else
+		publish_status(dev, SHM_STATUS_ERROR);
+	return r;
+}
+
+// With FILTER set a sweep reads each device burst times, the last of them
+// through filter_temper1, which ends the interval
+static int burst_temper1(struct usb_dev_handle *handle, char *data, int r)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	int raw;
+	if (!dev)
+		return -1;
+
+	r = check_temper1(handle, dev, data, r, &raw);
+	if (r > 0)
+		filter_add(&opts.filter, &dev->filter, raw);
+	return r;
+}
+
+static int filter_temper1(struct usb_dev_handle *handle, char *data, int r)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	int32_t value;
+	if (!dev)
+		return -1;
+
+	r = burst_temper1(handle, data, r);
+	if (dev->filter.count == 0)
+		publish_status(dev, SHM_STATUS_ERROR);
+	if (filter_flush(&opts.filter, &dev->filter, &value))
+		output_data(dev, value);
 	return r;
 }
 
@@ -246,109 +1212,169 @@ static void load_configuration()
 {
 	FILE *fp = fopen(opts.config_file, "r");
 	if (fp) {
-		char line[100];
-		while (fgets(line, sizeof(line), fp) != NULL)
+		char *line = NULL;
+		size_t size = 0;
+		while (getline(&line, &size, fp) != -1)
 		{
 			if (strstr(line, "OUTPUT\t") == line) {
+				if (sql_parse(&opts.sql, line + strlen("OUTPUT\t")) < 0)
+					fprintf(stderr, "Ignoring bad OUTPUT: %s", line + strlen("OUTPUT\t"));
 			}
 			else if (strstr(line, "FORMAT\t") == line) {
+				// The rest of the line, spaces and all
+				line[strcspn(line, "\r\n")] = '\0';
+				snprintf(opts.format, FILENAME_MAX, "%s", line + strlen("FORMAT\t"));
 			}
 			else if (strstr(line, "DATETIME\t") == line) {
+				line[strcspn(line, "\r\n")] = '\0';
+				snprintf(opts.dt_format, sizeof(opts.dt_format), "%s", line + strlen("DATETIME\t"));
+			}
+			else if (strstr(line, "FLUSH\t") == line) {
+				unsigned long bytes;
+				int seconds;
+				if (sscanf(line, "FLUSH\t%lu\t%d", &bytes, &seconds) == 2) {
+					opts.output_policy.flush_bytes = bytes;
+					opts.output_policy.flush_seconds = seconds;
+				}
+			}
+			else if (strstr(line, "FSYNC\t") == line) {
+				sscanf(line, "FSYNC\t%d", &opts.output_policy.fsync_seconds);
+			}
+			else if (strstr(line, "MAXFILES\t") == line) {
+				sscanf(line, "MAXFILES\t%d", &opts.max_files);
+			}
+			else if (strstr(line, "STORE\t") == line) {
+				char store_file[size];
+				if (sscanf(line, "STORE\t%s\t%u", store_file, &opts.store_capacity) >= 1)
+					snprintf(opts.store_file, FILENAME_MAX, "%s", store_file);
+			}
+			else if (strstr(line, "ROLLUP\t") == line) {
+				char rollup_file[size];
+				int used = 0;
+				if (sscanf(line, "ROLLUP\t%s%n", rollup_file, &used) == 1 &&
+						strstr(rollup_file, ROLLUP_RESOLUTION_PATTERN) &&
+						rollup_parse(&opts.rollups, line + used) == 0)
+					snprintf(opts.rollup_file, FILENAME_MAX, "%s", rollup_file);
+				else
+					fprintf(stderr, "Ignoring bad ROLLUP: %s", line + strlen("ROLLUP\t"));
+			}
+			else if (strstr(line, "CAPTURE\t") == line) {
+				char capture_file[size];
+				if (sscanf(line, "CAPTURE\t%s", capture_file) == 1)
+					snprintf(opts.capture_file, FILENAME_MAX, "%s", capture_file);
+			}
+			else if (strstr(line, "METRICS\t") == line) {
+				char metrics_address[size];
+				if (sscanf(line, "METRICS\t%s", metrics_address) == 1)
+					snprintf(opts.metrics_address, FILENAME_MAX, "%s", metrics_address);
+			}
+			else if (strstr(line, "SOCKET\t") == line) {
+				char socket_path[size];
+				if (sscanf(line, "SOCKET\t%s", socket_path) == 1)
+					snprintf(opts.socket_path, FILENAME_MAX, "%s", socket_path);
+			}
+			else if (strstr(line, "FILTER\t") == line) {
+				if (filter_parse(&opts.filter, line + strlen("FILTER\t")) < 0)
+					fprintf(stderr, "Ignoring bad FILTER: %s", line + strlen("FILTER\t"));
+			}
+			else if (strstr(line, "PUSH\t") == line) {
+				if (push_parse(&opts.push, line + strlen("PUSH\t")) < 0)
+					fprintf(stderr, "Ignoring bad PUSH: %s", line + strlen("PUSH\t"));
+			}
+			else if (strstr(line, "PIPELINE\t") == line) {
+				sscanf(line, "PIPELINE\t%u\t%d", &opts.pipeline_records, &opts.pipeline_wait_ms);
+			}
+			else if (strstr(line, "SHM\t") == line) {
+				char shm_name[size];
+				if (sscanf(line, "SHM\t%s", shm_name) == 1)
+					snprintf(opts.shm_name, FILENAME_MAX, "%s", shm_name);
 			}
 		}
+		free(line);
 		fclose(fp);
 	}	
 }
 
-typedef struct temper1_calibration {
-	char *port_descriptor;
-	float scale;
-	float offset;
-} temper1_calibration;
-static temper1_calibration temper1_calibrations[127] = {};
+static calibration_table *calibrations = NULL;
 
 static void load_calibrations() 
 {
-	FILE *fp = fopen(opts.config_file, "r");
-	if (fp) {
-		char line[100];
-		while (fgets(line, sizeof(line), fp) != NULL)
-		{
-			if (strstr(line, "CALIBRATION\t") == line) {
-				char port[40] = {};
-				float scale, offset;
-				int s;
-				if ((s = sscanf(line, "CALIBRATION\t%s\t%f\t%f", port, &scale, &offset))) {
-					temper1_calibration cal;
-					
-					cal.port_descriptor = (char *)malloc(strlen(port));
-				
-					strncpy(cal.port_descriptor, port, strlen(port));
-					cal.scale = scale;
-					cal.offset = offset;	
-					
-					int i;
-					for (i = 0; temper1_calibrations[i].port_descriptor; i++);
-					temper1_calibrations[i] = cal;
-					
-					if (opts.verbose) fprintf(stderr, "Loaded calibration (%s): scale: %f; offset %f\n", port, cal.scale, cal.offset);
-					
-				}
-			}
-		}
-		fclose(fp);
-	}	
+	calibrations = calibration_load(opts.config_file, opts.verbose);
 }
 
-static temper1_calibration get_calibration(char *busport)
+// The calibration is looked up once and kept with the device, so the
+// per-sample path does no lookup at all
+static int bind_calibration(struct usb_dev_handle *handle)
 {
-	int i = 0;
-	for (i = 0; i < 128; i++) {
-		if (temper1_calibrations[i].port_descriptor != NULL && 
-			strcmp(temper1_calibrations[i].port_descriptor, busport) == 0) {
-			break;
-		}
-	} 
-		
-	return temper1_calibrations[i];
-} 
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (dev)
+		calibrate_device(dev);
+	return 0;
+}
+
+// On SIGHUP a SOCKET read may be calibrating a reading on a server thread,
+// so the device is rebound under the handle's query lock, which that read
+// holds throughout
+static int rebind_calibration(struct usb_dev_handle *handle)
+{
+	device_handle *dh = hold_usb_handle(handle);
+	if (!dh)
+		return 0;
+	pthread_mutex_lock(&dh->lock);
+	bind_calibration(handle);
+	pthread_mutex_unlock(&dh->lock);
+	release_usb_handle(dh);
+	return 0;
+}
+
+static void calibrate_device(temper1_device *dev)
+{
+	const calibration *cal = calibration_find(calibrations, dev->busport);
+	dev->scale = (cal && cal->scale != 0) ? cal->scale : 1.0;
+	dev->offset = cal ? cal->offset : 0.0;
+
+	// A DEADBAND for * covers every device without one of its own
+	if (!cal || cal->deadband < 0)
+		cal = calibration_find(calibrations, "*");
+	dev->deadband = cal ? cal->deadband : -1.0;
+	dev->heartbeat = cal ? cal->heartbeat : 0;
+}
 
-static int decode_raw_data(char *data)
+// Run on SIGHUP, between sweeps. The new table is only swapped in once it
+// has been read in full; if the file can't be read the old one is kept.
+static void reload_calibrations()
 {
-	unsigned int rawtemp = (data[3] & 0xFF) + (data[2] << 8);
+	calibration_table *table = calibration_load(opts.config_file, opts.verbose);
+	if (!table) {
+		fprintf(stderr, "Unable to reload calibrations from %s\n", opts.config_file);
+		return;
+	}
+
+	calibration_table *old = calibrations;
+	calibrations = table;
+	sweep_usb(rebind_calibration, 1);
+	calibration_free(old);
+	if (opts.verbose) fprintf(stderr, "Reloaded %u calibrations\n", table->count);
+}
+
+int decode_raw_data(char *data)
+{
+	int rawtemp = sensor_decode(data);
 	if (opts.verbose) fprintf(stderr, 
-		"Raw temp: %d (%04X) [%02X %02X (%02X >> %02X)+(%02X >> %02X) %02X %02X %02X %02X]\n", rawtemp, rawtemp,
+		"Raw temp: %d (%04X) [%02X %02X (%02X >> %02X)+(%02X >> %02X) %02X %02X %02X %02X]\n", rawtemp, rawtemp & 0xFFFF,
 		(unsigned)data[0] & 0xFF, (unsigned)data[1] & 0xFF, 
 		(unsigned)data[2] & 0xFF, (unsigned)(data[2] << 8) ,
 		(unsigned)data[3] & 0xFF, (unsigned)(data[3] & 0xFF), 
 		(unsigned)data[4] & 0xFF, (unsigned)data[5] & 0xFF, (unsigned)data[6] & 0xFF, (unsigned)data[7] & 0xFF);
-    
-	/* msb means the temperature is negative -- less than 0 Celsius -- and in 2'complement form.
- 	 * We can't be sure that the host uses 2's complement to store negative numbers
- 	 * so if the temperature is negative, we 'manually' get its magnitude
- 	 * by explicity getting it's 2's complement and then we return the negative of that.
- 	 */
-    
-	if ((data[2] & 0x80) != 0) {
-		/* return the negative of magnitude of the temperature */
-		rawtemp = -((rawtemp ^ 0xffff) + 1);
-	}
-    
 	return rawtemp;
 }
 
-/* Calibration adjustments */
-/* See http://www.pitt-pladdy.com/blog/_20110824-191017_0100_TEMPer_under_Linux_perl_with_Cacti/ */
-static float raw_to_c(char *busport, int rawtemp)
+float raw_to_c(temper1_device *dev, float rawtemp)
 {
-	float temp_c = rawtemp * (125.0 / 32000.0);
-	
-	temper1_calibration cal = get_calibration(busport);
-	temp_c = (temp_c * (cal.scale == 0 ? 1.0 : cal.scale)) + cal.offset;
-	return temp_c;
+	return sensor_celsius(rawtemp, dev->scale, dev->offset);
 }
 
-static float c_to_u(float deg_c, char unit)
+float c_to_u(float deg_c, char unit)
 {
 	if (unit == 'F')
 		return (deg_c * 1.8) + 32.0;
@@ -358,56 +1384,329 @@ static float c_to_u(float deg_c, char unit)
 		return deg_c;
 }
 
-#define CTRL_REQ_TYPE 0x21
-#define CTRL_REQ 0x09
-#define CTRL_VALUE 0x0200
-const static char cq_initialise[] = { 0x01, 0x01 };
+int initialise_temper1(struct usb_dev_handle *handle)
+{
+	// Devices other than the one selected with --device are never claimed
+	if (strlen(opts.only_device) > 0) {
+		char busport[100] = {};
+		handle_bus_port(handle, busport);
+		if (strcmp(busport, opts.only_device) != 0)
+			return -1;
+	}
 
-static int initialise_temper1(struct usb_dev_handle *handle)
+	int r = sensor_claim(handle);
+	if (r >= 0) {
+		temper1_device *dev = (temper1_device *)calloc(1, sizeof(temper1_device));
+		if (!dev) {
+			// Hand the interfaces back to the kernel rather than hold them
+			sensor_release(handle);
+			return -1;
+		}
+		handle_bus_port(handle, dev->busport);
+		dev->stats = get_handle_stats(handle);
+		dev->store = open_store(dev->busport, FALSE);
+		if (opts.rollups.count > 0)
+			dev->rollups = rollup_open(opts.rollup_file, dev->busport, &opts.rollups);
+		dev->shm_slot = latest ? shm_slot_for(latest, dev->busport) : -1;
+		if (latest && dev->shm_slot < 0)
+			fprintf(stderr, "No SHM slot free for %s, it won't be published\n", dev->busport);
+		dev->trips = recall_trips(dev->busport);
+		dev->capture_id = capture ? capture_device(capture, dev->busport) : -1;
+		dev->lane = output_pipe ? pipeline_lane(output_pipe, dev->busport) : NULL;
+		set_handle_data(handle, dev, free_temper1_device);
+		bind_calibration(handle);
+	}
+	return r;
+}
+
+// Queries every open device; the backend decides how the queries overlap
+int sweep_temper1()
 {
-	int r = detach_driver(handle, INTERFACE0);
-	if (r >= 0) r = 
-		detach_driver(handle, INTERFACE1);
-	if (r >= 0) r = 
-		set_configuration(handle, 0x01);
-	if (r >= 0) r = 
-		claim_interface(handle, INTERFACE0);
-	if (r >= 0) r = 
-		claim_interface(handle, INTERFACE1);
-/*
-	// In light of discovery that the HID implementation has a keyboard emulation
-	// and a vendor specific mode, don't touch anything else. No init needed?
-	if (r >= 0) r = 
-		control_message(handle, CTRL_REQ_TYPE, CTRL_REQ, CTRL_VALUE, 
-			0, cq_initialise, sizeof(cq_initialise));
-		
-*/
+	int r, i;
+	if (filter_active(&opts.filter)) {
+		for (i = 1; i < opts.filter.burst; i++)
+			query_usb(&sensor_query, burst_temper1, opts.concurrency);
+		r = query_usb(&sensor_query, filter_temper1, opts.concurrency);
+	}
+	else {
+		r = query_usb(&sensor_query, use_temper1, opts.concurrency);
+	}
+	tick_output();
+	if (capture)
+		capture_flush(capture);
 	return r;
 }
 
-#define READ_ENDPOINT 0x82
-const static char cq_temperature[] = { 0x01, 0x80, 0x33, 0x01, 0x00, 0x00, 0x00, 0x00 };
+// Requests on the SOCKET for a reading no more than max_age seconds old.
+// Anything older is read again on one of the server's threads, once
+// however many clients are waiting for it.
+int answer_request(const char *busport, int max_age, char *reply, void **target)
+{
+	struct usb_dev_handle *handle = find_usb_handle(busport);
+	temper1_device *dev = handle ? (temper1_device *)get_handle_data(handle) : NULL;
+	if (!dev) {
+		snprintf(reply, SERVER_REPLY_MAX, "ERROR no device %s\n", busport);
+		return -1;
+	}
+
+	float value;
+	int64_t timestamp = read_last(dev, &value);
+	if (timestamp > 0 && time(NULL) - timestamp <= max_age) {
+		snprintf(reply, SERVER_REPLY_MAX, "%lld,%f,%s\n", (long long)timestamp, 
+			c_to_u(value, opts.units), dev->busport);
+		return 1;
+	}
+	*target = hold_usb_handle(handle);
+	return 0;
+}
 
-static int read_temper1(struct usb_dev_handle *handle, char *data, int datalen)
+int refresh_device(void *target)
 {
-	int r = control_message(handle, CTRL_REQ_TYPE, CTRL_REQ, CTRL_VALUE, 
-			1, cq_temperature, sizeof(cq_temperature));
-	if (r >= 0) r = 
-		interrupt_read(handle, READ_ENDPOINT, data, datalen);
-	
-	return r;
+	return (query_usb_held(&sensor_query, (device_handle *)target, refresh_temper1) > 0) ? 0 : -1;
 }
 
-static int close_temper1(struct usb_dev_handle *handle)
+void release_device(void *target)
 {
-	int r = 
-		release_interface(handle, INTERFACE0);	
-	if (r >= 0) r = 
-		release_interface(handle, INTERFACE1);
-	if (r >= 0) r = 
-		restore_driver(handle, INTERFACE0);
-	if (r >= 0) r = 
-		restore_driver(handle, INTERFACE1);
-		
-	return r;
+	release_usb_handle((device_handle *)target);
+}
+
+int count_temper1(struct usb_dev_handle *handle)
+{
+	return get_handle_data(handle) ? 1 : 0;
+}
+
+static void trip_breaker(struct usb_dev_handle *handle, temper1_device *dev, int ok)
+{
+	if (ok) {
+		if (dev->trips && opts.verbose)
+			fprintf(stderr, "%s has recovered\n", dev->busport);
+		dev->failures = 0;
+		dev->trips = 0;
+		return;
+	}
+
+	// Once open, a single failed probe opens it again for longer
+	if (++dev->failures < BREAKER_FAILURES && dev->trips == 0)
+		return;
+	dev->trips++;
+	int skip = BREAKER_MAX_SKIP;
+	if (dev->trips <= 6)
+		skip = 1 << (dev->trips - 1);
+	quarantine_usb_handle(handle, skip);
+	if (opts.verbose)
+		fprintf(stderr, "%s failed %d reads, leaving it out of %d sweep(s)\n", 
+			dev->busport, dev->failures, skip);
+
+	if (dev->trips == 2)
+		sensor_reclaim(handle);
+	else if (dev->trips > 2)
+		dev->reset_pending = TRUE;
+}
+
+// Trips of the devices reset since, so that a device that comes back from
+// a reset still failing is left out for longer rather than starting over
+typedef struct sick_device {
+	char busport[BUS_PORT_MAX];
+	int trips;
+	struct sick_device *next;
+} sick_device;
+
+static sick_device *sick_devices = NULL;
+
+static void remember_trips(const char *busport, int trips)
+{
+	sick_device *sick = (sick_device *)calloc(1, sizeof(sick_device));
+	if (!sick)
+		return;
+	strcpy(sick->busport, busport);
+	sick->trips = trips;
+	sick->next = sick_devices;
+	sick_devices = sick;
+}
+
+static int recall_trips(const char *busport)
+{
+	sick_device **link, *sick;
+	for (link = &sick_devices; (sick = *link); link = &sick->next) {
+		if (strcmp(sick->busport, busport) == 0) {
+			int trips = sick->trips;
+			*link = sick->next;
+			free(sick);
+			return trips;
+		}
+	}
+	return 0;
+}
+
+static struct { u_int8_t bus, dev; } resets[RESETS_MAX];
+static int reset_count = 0;
+
+static int reset_temper1(struct usb_dev_handle *handle)
+{
+	temper1_device *dev = (temper1_device *)get_handle_data(handle);
+	if (!dev || !dev->reset_pending || reset_count >= RESETS_MAX)
+		return 0;
+
+	if (opts.verbose) fprintf(stderr, "Resetting %s\n", dev->busport);
+	handle_bus_address(handle, &resets[reset_count].bus, &resets[reset_count].dev);
+	remember_trips(dev->busport, dev->trips);
+	reset_usb_device(handle);
+	reset_count++;
+	return 1;
+}
+
+// Resets the ports of devices whose breaker has opened repeatedly. Their
+// handles are forgotten and the devices found again on the next ticks.
+static void reset_sick_temper1()
+{
+	int i;
+	reset_count = 0;
+	sweep_usb(reset_temper1, 1);
+	for (i = 0; i < reset_count; i++)
+		forget_usb_device(resets[i].bus, resets[i].dev, NULL);
+	if (reset_count > 0)
+		rescan_pending = RESCAN_ATTEMPTS;
+}
+
+// temper1 replay: decodes a CAPTURE log again with the calibrations and
+// units in temper1.conf as they are now, writing records in FORMAT
+temper1_device *replay_devices = NULL;
+static int replay_device_count = 0;
+
+int bind_replay_devices(const capture_reader *reader)
+{
+	temper1_device *devices = (temper1_device *)realloc(replay_devices, 
+		reader->name_count * sizeof(temper1_device));
+	int i;
+
+	if (!devices)
+		return -1;
+	replay_devices = devices;
+	replay_device_count = reader->name_count;
+	for (i = 0; i < replay_device_count; i++) {
+		memset(&devices[i], 0, sizeof(temper1_device));
+		snprintf(devices[i].busport, BUS_PORT_MAX, "%s", capture_device_name(reader, i));
+		calibrate_device(&devices[i]);
+	}
+	return 0;
+}
+
+// The sums of raw_to_c and c_to_u (decode_raw_data's being done as the
+// batch is read), a whole array at a time so that each loop vectorises
+void calibrate_batch(const capture_batch *batch, float *value)
+{
+	float scale[CAPTURE_BATCH], offset[CAPTURE_BATCH];
+	int i, n = batch->count;
+
+	for (i = 0; i < n; i++) {
+		scale[i] = replay_devices[batch->device[i]].scale;
+		offset[i] = replay_devices[batch->device[i]].offset;
+	}
+	for (i = 0; i < n; i++)
+		value[i] = (float)(batch->raw[i] * SENSOR_C_PER_RAW) * scale[i] + offset[i];
+}
+
+void convert_batch(float *value, int n, char unit)
+{
+	double scale = (unit == 'F') ? 1.8 : 1.0;
+	double offset = (unit == 'F') ? 32.0 : (unit == 'K') ? 273.15 : 0.0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		value[i] = (float)(value[i] * scale + offset);
+}
+
+static int run_replay(int argc, char *argv[])
+{
+	static struct option replay_options[] =
+	 {
+	   {"device", required_argument, 0, 'd'},
+	   {"from",   required_argument, 0, 'f'},
+	   {"to",     required_argument, 0, 't'},
+	   {"config", required_argument, 0, 'C'},
+	   {"units",  required_argument, 0, 'u'},
+	   {"bench",  no_argument,       0, 'b'},
+	   {0, 0, 0, 0}
+	 };
+	int64_t from = 0, to = INT64_MAX;
+	int options_index = 0, c, i, bench = FALSE;
+
+	while ((c = getopt_long(argc, argv, "d:f:t:C:u:b", replay_options, &options_index)) != -1) 
+	{
+		switch (c) {
+			case 'd':
+				snprintf(opts.only_device, sizeof(opts.only_device), "%s", optarg);
+				break;
+			case 'f':
+				from = parse_time(optarg);
+				break;
+			case 't':
+				to = parse_time(optarg);
+				break;
+			case 'C':
+				snprintf(opts.config_file, FILENAME_MAX, "%s", optarg);
+				break;
+			case 'u':
+				parse_units(optarg);
+				break;
+			case 'b':
+				bench = TRUE;
+				break;
+			default:
+				return 1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "replay needs a capture file\n");
+		return 1;
+	}
+	load_configuration();
+	load_calibrations();
+
+	capture_reader *reader = capture_open_readonly(argv[optind]);
+	if (!reader)
+		return 1;
+	if (bench) {
+#ifdef WITH_BENCH
+		int r = replay_bench(reader);
+#else
+		fprintf(stderr, "replay: built without the benchmarks, run 'make bench' for temper1-bench\n");
+		int r = 1;
+#endif
+		capture_close_readonly(reader);
+		return r;
+	}
+
+	const char *format = (strlen(opts.format) > 0) ? opts.format : FORMAT_PRESET_CSV;
+	if (!(record_format = format_compile(format, opts.dt_format))) {
+		capture_close_readonly(reader);
+		return 1;
+	}
+
+	static capture_batch batch;
+	float value[CAPTURE_BATCH];
+	char record[RECORD_MAX];
+	while (capture_read_batch(reader, &batch) > 0) {
+		if (reader->names_changed) {
+			bind_replay_devices(reader);
+			reader->names_changed = 0;
+		}
+		calibrate_batch(&batch, value);
+		convert_batch(value, batch.count, opts.units);
+
+		for (i = 0; i < batch.count; i++) {
+			temper1_device *dev = &replay_devices[batch.device[i]];
+			// Zero reads are dropped, as they are when read live
+			if (batch.raw[i] == 0 || batch.timestamp[i] < from || batch.timestamp[i] > to)
+				continue;
+			if (opts.only_device[0] && strcmp(dev->busport, opts.only_device) != 0)
+				continue;
+			format_record fr = { batch.timestamp[i], value[i], batch.raw[i], opts.units, dev->busport };
+			fwrite(record, 1, format_render(record_format, &fr, record, sizeof(record)), stdout);
+		}
+	}
+	format_free(record_format);
+	free(replay_devices);
+	capture_close_readonly(reader);
+	return 0;
 }
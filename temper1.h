@@ -0,0 +1,125 @@
+/*
+ * temper1.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// What temper1.c shares with the benchmarks in benchhelper.c. Include the
+// helpers' headers first.
+
+#define RESCAN_ATTEMPTS 3
+#define RECORD_MAX 512
+
+// Per-device state, attached to the handle when the device is initialised
+typedef struct temper1_device {
+	char busport[BUS_PORT_MAX];
+	float scale;
+	float offset;
+	float deadband;		// C, negative to write every reading
+	int heartbeat;
+	ring_store *store;
+	rollup_set *rollups;
+	int shm_slot;
+	int capture_id;		// the device's number in the CAPTURE log
+	pipe_lane *lane;	// to the output thread, NULL to write inline
+	// The last reading, for /metrics and the SOCKET. Written by whichever
+	// thread is reading the device, a sweep's or a SOCKET read's, and read
+	// from the event loop meanwhile, so behind a sequence lock as in
+	// shmhelper.h: see publish_last and read_last.
+	uint32_t last_seq;
+	float last_value;
+	int64_t last_timestamp;
+	unsigned long reads;
+	unsigned long errors;
+	// Records written and held back by the deadband
+	unsigned long written;
+	unsigned long suppressed;
+	unsigned long unstored;	// kept out of the STORE, the clock having gone back
+	float written_value;
+	int64_t written_timestamp;
+	long query_usec;
+	usb_stats *stats;	// the handle's, which outlives this
+	filter_state filter;	// only touched with the handle's lock held
+	// Circuit breaker, only touched with the handle's lock held
+	int failures;		// consecutive failed reads
+	int trips;		// consecutive times the breaker has opened
+	int reset_pending;	// for the main thread to reset the port
+} temper1_device;
+
+// A record in a device's STORE ring and on its way through the PIPELINE;
+// value is the calibrated reading in C
+typedef struct temper1_sample {
+	int64_t timestamp;
+	float value;
+	int16_t raw;
+	uint16_t reserved;
+} temper1_sample;
+
+typedef struct options {
+	int verbose;
+	int daemon;
+	int interval;
+	int concurrency;
+	char output_file[FILENAME_MAX];
+	output_policy output_policy;
+	int max_files;
+	char store_file[FILENAME_MAX];
+	unsigned int store_capacity;
+	char rollup_file[FILENAME_MAX];
+	rollup_spec rollups;
+	char capture_file[FILENAME_MAX];
+	char shm_name[FILENAME_MAX];
+	char metrics_address[FILENAME_MAX];
+	char socket_path[FILENAME_MAX];
+	char config_file[FILENAME_MAX];
+	unsigned int pipeline_records;
+	int pipeline_wait_ms;
+	push_config push;
+	sql_config sql;
+	char units;
+	char format[FILENAME_MAX];
+	char dt_format[100];
+	char only_device[40];
+	filter_config filter;
+} options;
+
+extern options opts;
+extern capture_log *capture;
+extern pipeline *output_pipe;
+extern push_sink *push;
+extern sql_sink *database;
+extern int rescan_pending;
+extern temper1_device *replay_devices;
+
+void open_output();
+void tick_output();
+void flush_output(void *arg);
+void deliver_records(const pipe_lane *lane, const void *records, unsigned int count, void *arg);
+void close_output();
+void apply_uevent(const uevent *event);
+int initialise_temper1(struct usb_dev_handle *handle);
+int use_temper1(struct usb_dev_handle *handle, char *data, int r);
+int sweep_temper1();
+int count_temper1(struct usb_dev_handle *handle);
+int answer_request(const char *busport, int max_age, char *reply, void **target);
+int refresh_device(void *target);
+void release_device(void *target);
+
+int decode_raw_data(char *data);
+float raw_to_c(temper1_device *dev, float rawtemp);
+float c_to_u(float deg_c, char unit);
+int bind_replay_devices(const capture_reader *reader);
+void calibrate_batch(const capture_batch *batch, float *value);
+void convert_batch(float *value, int n, char unit);
@@ -0,0 +1,115 @@
+/*
+ * ueventhelper.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "ueventhelper.h"
+
+#define UEVENT_BUFFER_SIZE 4096
+#define UEVENT_KERNEL_GROUP 1
+
+int uevent_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		perror("uevent_open: socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;
+	addr.nl_groups = UEVENT_KERNEL_GROUP;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("uevent_open: bind");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Reads one message. Returns 1 if it described a USB device being added
+// or removed, 0 for anything else and -1 once the socket is drained.
+int uevent_receive(int fd, uevent *event)
+{
+	char buf[UEVENT_BUFFER_SIZE];
+	struct sockaddr_nl addr;
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr msg;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if ((len = recvmsg(fd, &msg, 0)) <= 0)
+		return -1;
+	// Only trust messages from the kernel itself
+	if (addr.nl_pid != 0)
+		return 0;
+
+	buf[len] = '\0';
+	return uevent_parse(buf, (int)len, event);
+}
+
+// A message is "action@devpath" followed by NUL separated KEY=value
+// pairs. Kept apart from uevent_receive so that it can be fed synthetic
+// messages.
+int uevent_parse(const char *buf, int len, uevent *event)
+{
+	const char *p = buf, *end = buf + len;
+	int is_usb = 0, is_device = 0;
+
+	memset(event, 0, sizeof(uevent));
+	event->busnum = event->devnum = -1;
+
+	if (!memchr(buf, '@', strnlen(buf, len)))
+		return 0;
+
+	for (p += strnlen(p, end - p) + 1; p < end; p += strnlen(p, end - p) + 1) {
+		if (strncmp(p, "ACTION=", 7) == 0) {
+			if (strcmp(p + 7, "add") == 0)
+				event->action = UEVENT_ADD;
+			else if (strcmp(p + 7, "remove") == 0)
+				event->action = UEVENT_REMOVE;
+		}
+		else if (strcmp(p, "SUBSYSTEM=usb") == 0)
+			is_usb = 1;
+		else if (strcmp(p, "DEVTYPE=usb_device") == 0)
+			is_device = 1;
+		else if (strncmp(p, "BUSNUM=", 7) == 0)
+			event->busnum = atoi(p + 7);
+		else if (strncmp(p, "DEVNUM=", 7) == 0)
+			event->devnum = atoi(p + 7);
+		else if (strncmp(p, "PRODUCT=", 8) == 0)
+			sscanf(p + 8, "%x/%x", &event->vendor, &event->product);
+		else if (strncmp(p, "DEVPATH=", 8) == 0)
+			snprintf(event->devpath, sizeof(event->devpath), "%s", p + 8);
+	}
+
+	return (is_usb && is_device && event->action != 0 && 
+		event->busnum > 0 && event->devnum > 0);
+}
@@ -0,0 +1,36 @@
+/*
+ * ueventhelper.h by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Kernel uevents for USB devices, as broadcast on the NETLINK_KOBJECT_UEVENT
+// socket. Only whole devices are reported, not their interfaces.
+
+#define UEVENT_ADD 1
+#define UEVENT_REMOVE 2
+
+typedef struct uevent {
+	int action;
+	int busnum;
+	int devnum;
+	int vendor;
+	int product;
+	char devpath[256];
+} uevent;
+
+int uevent_open(void);
+int uevent_receive(int fd, uevent *event);
+int uevent_parse(const char *buf, int len, uevent *event);
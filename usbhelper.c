@@ -17,11 +17,15 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "usbhelper.h"
 #include "sysfshelper.h"
+#include "devicehelper.h"
 
 #define CONTROL_TIMEOUT 5000
 #define READ_TIMEOUT 5000
@@ -59,6 +63,36 @@ void initialise_usb(int verbose)
 	}
 }
 
+static int device_is_present(struct usb_device *device)
+{
+	struct usb_bus *bus;
+	struct usb_device *dev;
+ 
+	for (bus = usb_busses; bus; bus = bus->next) {
+		for (dev = bus->devices; dev; dev = dev->next) {
+			if (dev == device)
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// usb_find_devices frees the usb_device of anything unplugged since the
+// last enumeration, so handles left pointing at one are dropped.
+static void forget_vanished_devices()
+{
+	device_handle *dh = device_handles, *next;
+	while (dh) {
+		next = (device_handle *)dh->next;
+		if (!device_is_present(dh->device)) {
+			retire_device_handle(dh);
+			usb_close(dh->handle);
+			remove_device_handle(dh);
+		}
+		dh = next;
+	}
+}
+
 int iterate_usb(int (is_interesting)(struct usb_device *), 
 	int (do_open)(struct usb_dev_handle *),
 	int (do_process)(struct usb_dev_handle *),
@@ -67,6 +101,9 @@ int iterate_usb(int (is_interesting)(struct usb_device *),
 {
 	usb_find_busses();
 	usb_find_devices();
+	forget_vanished_devices();
+	// Device numbers may have been reused since sysfs was last indexed
+	sysfs_invalidate_index();
 
 	int result = 0;
 	struct usb_bus *bus;
@@ -92,40 +129,11 @@ int iterate_usb(int (is_interesting)(struct usb_device *),
 	return result;
 }
 
-device_handle *device_handles = NULL;
-
-static device_handle *add_device_handle(struct usb_device *dev, struct usb_dev_handle *handle)
-{
-	device_handle *dh = device_handles;
-	device_handle *dc = NULL;
-
-	if (dh) {
-		while (dh->next)
-			dh = (device_handle *)dh->next;
-	}
-	
-	dc = (device_handle *)malloc(sizeof(device_handle));
-	dc->device = dev;
-	dc->handle = handle;
-	dc->next = NULL;
-
-	if (dh == NULL) device_handles = dh = dc;
-	else dh->next = (device_handle *)dc;
-	return dc;
-}
-
-static device_handle *get_device_handle_by_device(struct usb_device *dev)
+// libusb-0.1 only has blocking transfers, so concurrency comes from threads
+int query_usb(const usb_query *query, 
+	int (do_result)(struct usb_dev_handle *, char *, int), int concurrency)
 {
-	device_handle *dh = device_handles;
-	while(dh != NULL) {
-		if (dh->device == dev) {
-			break;
-		}
-		dh = (device_handle *)dh->next;
-	}
-
-//fprintf(stderr, "Returning handle struct %p by device %p\n", dh, dev); fflush(stderr);
-	return dh;
+	return sweep_query(query, do_result, concurrency);
 }
 
 static struct usb_dev_handle *open_handle_for_device(struct usb_device *dev, 
@@ -133,15 +141,31 @@ static struct usb_dev_handle *open_handle_for_device(struct usb_device *dev,
 {
 	struct device_handle *dh = get_device_handle_by_device(dev);
 	struct usb_dev_handle *handle;
-	int r;
+	int r = 0;
 
 	if (!dh) {
-		handle = usb_open(dev);
-		if (do_open) 
-			r = do_open(handle);
-		// and stash new handle
-		if (r >= 0)
-			dh = add_device_handle(dev, handle);
+		// Only open devices we have been asked to initialise
+		if (!do_open)
+			return NULL;
+		if (!(handle = usb_open(dev)))
+			return NULL;
+
+		// Stash the new handle before do_open so that it can attach its
+		// own data, and resolve the port name while still single threaded
+		// so that sweeps only ever read the cached copy
+		if (!(dh = add_device_handle(dev, handle))) {
+			usb_close(handle);
+			return NULL;
+		}
+		char bus_port[BUS_PORT_MAX] = {};
+		handle_bus_port(handle, bus_port);
+
+		r = do_open(handle);
+		if (r < 0) {
+			usb_close(handle);
+			remove_device_handle(dh);
+			return NULL;
+		}
 	}
 	return dh->handle;
 }
@@ -158,6 +182,32 @@ static int close_handle(struct usb_dev_handle *handle,
 	return r;
 }
 
+// Drops the open handle for the device at (busnum, devnum), typically
+// after it has been unplugged. do_close may be NULL when the device is
+// already gone and there is nothing left to release.
+int forget_usb_device(int busnum, int devnum, int (do_close)(struct usb_dev_handle *))
+{
+	device_handle *dh;
+	u_int8_t bus_id, device_id;
+	int r = 0;
+
+	for (dh = device_handles; dh; dh = (device_handle *)dh->next) {
+		handle_bus_address(dh->handle, &bus_id, &device_id);
+		if (bus_id == busnum && device_id == devnum)
+			break;
+	}
+	if (!dh)
+		return -1;
+
+	retire_device_handle(dh);
+	if (do_close)
+		r = do_close(dh->handle);
+	usb_close(dh->handle);
+	usb_return(1, "usb_close (fake void)");
+	remove_device_handle(dh);
+	return r;
+}
+
 int device_vendor_product_is(struct usb_device *device, u_int16_t vendor, u_int16_t product)
 {
 	int r = (device->descriptor.idVendor == vendor && device->descriptor.idProduct == product);
@@ -201,6 +251,12 @@ int restore_driver(struct usb_dev_handle *handle, int interface_number)
 
 int control_message(struct usb_dev_handle *handle, int requesttype, int request, int value, 
 	int index, const char *pquestion, int qlength) 
+{
+	return control_message_within(handle, requesttype, request, value, index, pquestion, qlength, 0);
+}
+
+int control_message_within(struct usb_dev_handle *handle, int requesttype, int request, int value, 
+	int index, const char *pquestion, int qlength, int timeout) 
 {
 	int r;
 	unsigned char question[qlength];
@@ -208,21 +264,31 @@ int control_message(struct usb_dev_handle *handle, int requesttype, int request,
 	memcpy(question, pquestion, qlength);
 
 	r = usb_return(usb_control_msg(handle, requesttype, request, value, index, 
-			(char *) question, qlength, CONTROL_TIMEOUT),
+			(char *) question, qlength, (timeout > 0) ? timeout : CONTROL_TIMEOUT),
 			"usb_control_msg");
 	return r;
 }
 
 int interrupt_read(struct usb_dev_handle *handle, int ep, char *data, int datalength)
+{
+	return interrupt_read_within(handle, ep, data, datalength, 0);
+}
+
+int interrupt_read_within(struct usb_dev_handle *handle, int ep, char *data, int datalength, int timeout)
 {
 	int r;
 
-	r = usb_return(usb_interrupt_read(handle, ep, data, datalength, READ_TIMEOUT),
+	r = usb_return(usb_interrupt_read(handle, ep, data, datalength, (timeout > 0) ? timeout : READ_TIMEOUT),
 			"usb_interrupt_read");
 	
 	return r;
 }
 
+int reset_usb_device(struct usb_dev_handle *handle)
+{
+	return usb_return(usb_reset(handle), "usb_reset");
+}
+
 int handle_bus_address(struct usb_dev_handle *handle, u_int8_t *bus_id, u_int8_t *device_id)
 {
 	struct usb_device *device = usb_device(handle);
@@ -232,14 +298,31 @@ int handle_bus_address(struct usb_dev_handle *handle, u_int8_t *bus_id, u_int8_t
 	return (bus_id > 0 && device_id > 0);
 }
 
+static pthread_mutex_t sysfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int handle_bus_port(struct usb_dev_handle *handle, char *bus_port)
 {
+	// A handle's port never changes, so once known it is served from the
+	// registry without touching sysfs
+	device_handle *dh = get_device_handle_by_handle(handle);
+	if (dh && dh->bus_port[0]) {
+		strcpy(bus_port, dh->bus_port);
+		return (1);
+	}
+
 	// Use sysfs (but beware of older versions) to get port number
 	
 	u_int8_t bus_id, device_id;
+	struct timespec started;
 	handle_bus_address(handle, &bus_id, &device_id);
 	
-	sysfs_find_usb_device_name(bus_id, device_id, bus_port);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	pthread_mutex_lock(&sysfs_lock);
+	if (sysfs_find_usb_device_name(bus_id, device_id, bus_port) >= 0 && dh)
+		name_device_handle(dh, bus_port);
+	pthread_mutex_unlock(&sysfs_lock);
+	if (dh)
+		stats_record(&dh->stats.stages[STATS_BUS_PORT], elapsed_usec(&started));
 	
 	if (debug) fprintf(stderr, "device_bus_port: (%d, %d) => (%s) %p\n", bus_id, device_id, bus_port, bus_port);
 	return (1);
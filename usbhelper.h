@@ -16,7 +16,30 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <pthread.h>
+#include <errno.h>
+
+#include "statshelper.h"
+
+#ifdef USB_BACKEND_LIBUSB1
+// The libusb-1.0 backend (usbhelper1.c) keeps the libusb-0.1 names used
+// throughout this interface so callers build unchanged against either.
+#include <sys/types.h>
+#include <libusb.h>
+#define usb_device libusb_device
+#define usb_dev_handle libusb_device_handle
+#define USB_TIMEOUT LIBUSB_ERROR_TIMEOUT
+#elif defined(USB_BACKEND_SIM)
+// Simulated devices (usbhelpersim.c), for benchmarks and for trying the
+// daemon out without a TEMPer1 to hand
+#include <sys/types.h>
+struct usb_device;
+typedef struct usb_dev_handle usb_dev_handle;
+#define USB_TIMEOUT (-ETIMEDOUT)
+#else
 #include <usb.h>
+#define USB_TIMEOUT (-ETIMEDOUT)
+#endif
 
 #ifndef FALSE
 #define FALSE (0)
@@ -29,6 +52,31 @@ int iterate_usb(int (is_interesting)(struct usb_device *),
 	int (do_process)(struct usb_dev_handle *),
 	int (do_close)(struct usb_dev_handle *)
 	);
+int sweep_usb(int (do_process)(struct usb_dev_handle *), int concurrency);
+void set_handle_data(struct usb_dev_handle *handle, void *data, void (*free_data)(void *));
+void *get_handle_data(struct usb_dev_handle *handle);
+struct usb_dev_handle *find_usb_handle(const char *bus_port);
+int forget_usb_device(int busnum, int devnum, int (do_close)(struct usb_dev_handle *));
+
+// A request/response exchange: a control message carrying question, then
+// an interrupt read of datalength bytes from endpoint.
+typedef struct usb_query {
+	int requesttype;
+	int request;
+	int value;
+	int index;
+	const char *question;
+	int qlength;
+	int endpoint;
+	int datalength;
+} usb_query;
+
+int query_usb(const usb_query *query, 
+	int (do_result)(struct usb_dev_handle *handle, char *data, int r), int concurrency);
+// Microseconds the handle's last query took, already set when do_result runs
+long get_handle_query_usec(struct usb_dev_handle *handle);
+// Latencies and errors of the handle's queries, kept by the backend
+usb_stats *get_handle_stats(struct usb_dev_handle *handle);
 
 int device_vendor_product_is(struct usb_device *device, u_int16_t vendor, u_int16_t product);
 int handle_bus_address(struct usb_dev_handle *handle, u_int8_t *bus_id, u_int8_t *device_id);
@@ -40,12 +88,50 @@ int claim_interface(usb_dev_handle *handle, int interface_number);
 int control_message(struct usb_dev_handle *handle, int requesttype, int request, int value, 
 	int index, const char *pquestion, int qlength);
 int interrupt_read(usb_dev_handle *handle, int ep, char *data, int datalength);
+// As above with a timeout in ms, 0 for the backend's default
+int control_message_within(struct usb_dev_handle *handle, int requesttype, int request, int value, 
+	int index, const char *pquestion, int qlength, int timeout);
+int interrupt_read_within(usb_dev_handle *handle, int ep, char *data, int datalength, int timeout);
+// Resets the device's port. The handle is no use afterwards: forget it
+// and let the next iterate_usb find the device again.
+int reset_usb_device(usb_dev_handle *handle);
 int release_interface(usb_dev_handle *handle, int interface_number);
 int restore_driver(usb_dev_handle *handle, int interface_number);
 
+#define BUS_PORT_MAX 40
+
 typedef struct device_handle {
 	struct usb_device *device;
 	struct usb_dev_handle *handle;
-	struct device_handle *next;
+	char bus_port[BUS_PORT_MAX];	// resolved on first use, "" until then
+	void *data;			// caller's, freed along with the entry
+	void (*free_data)(void *);
+	long query_usec;		// how long the last query_usb took
+	usb_stats stats;
+	int timeout_ms;			// adapted to the device's latency, 0 for the default
+	int skip_sweeps;		// query sweeps to leave the device out of
+	pthread_mutex_t lock;		// held for the whole of a query
+	int closed;			// set under lock once the handle is closed
+	int refs;			// the registry's plus one per hold_usb_handle
+	struct device_handle *next;	// open handles in the order they were added
+	struct device_handle *prev;
+	struct device_handle *next_by_device;	// the registry's hash chains
+	struct device_handle *next_by_handle;
+	struct device_handle *next_by_port;
 } device_handle;
 
+// Queries one device outside of a sweep, from any thread. Hold the handle
+// first so that it outlives the query; one closed in the meantime fails
+// with -1 rather than being touched. A sweep leaves out any device that
+// is mid query.
+device_handle *hold_usb_handle(struct usb_dev_handle *handle);
+int query_usb_held(const usb_query *query, device_handle *dh, 
+	int (do_result)(struct usb_dev_handle *handle, char *data, int r));
+void release_usb_handle(device_handle *dh);
+
+// Open handles, and the registry slots allocated for them over the
+// process's life, which removed handles' successors reuse
+void registry_usage(int *open, int *slots);
+
+// Leaves the device out of the next sweeps query sweeps
+void quarantine_usb_handle(struct usb_dev_handle *handle, int sweeps);
@@ -0,0 +1,534 @@
+/*
+ * usbhelper1.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// libusb-1.0 backend for usbhelper.h. Temperature sweeps use asynchronous
+// transfers driven from a single event loop rather than one blocking call
+// per step per device. Select it with 'make USB_BACKEND=libusb1'.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "usbhelper.h"
+#include "devicehelper.h"
+
+#define CONTROL_TIMEOUT 5000
+#define READ_TIMEOUT 5000
+#define MAX_PORT_DEPTH 7
+
+static struct usb_dev_handle *open_handle_for_device(struct usb_device *, 
+	int (do_open)(struct usb_dev_handle *));
+static int close_handle(struct usb_dev_handle *handle, int (do_open)(struct usb_dev_handle *));
+static int debug = FALSE;
+static libusb_context *context = NULL;
+
+static void error(char *info, int retcode)
+{
+	if (debug) fprintf(stderr, "usbhelper: %s %d (%s)\n", info, retcode, libusb_error_name(retcode));
+	fflush(stderr);
+}
+
+static int usb_return(int retcode, char *info)
+{
+	if (retcode < 0) {
+		error(info, retcode);
+	}
+	else {
+		if (debug) fprintf(stderr, "Clean return from %s\n", info);
+	}
+	return retcode;
+}
+
+void initialise_usb(int verbose)
+{
+	usb_return(libusb_init(&context), "libusb_init");
+	
+	if (verbose) {
+		fprintf(stderr, "Verbose mode enabled\n");
+		libusb_set_option(context, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+		debug = verbose;
+	}
+}
+
+int iterate_usb(int (is_interesting)(struct usb_device *), 
+	int (do_open)(struct usb_dev_handle *),
+	int (do_process)(struct usb_dev_handle *),
+	int (do_close)(struct usb_dev_handle *)
+	)
+{
+	libusb_device **devices;
+	ssize_t count, i;
+	int result = 0;
+
+	count = libusb_get_device_list(context, &devices);
+	if (count < 0)
+		return usb_return(count, "libusb_get_device_list");
+ 
+	for (i = 0; i < count; i++) {
+		struct usb_device *dev = devices[i];
+		if (is_interesting(dev)) {
+			struct usb_dev_handle *handle = open_handle_for_device(dev, do_open);
+			if (handle) {
+				if (do_process) 
+					result += do_process(handle);
+				
+				if (do_close)
+					result += close_handle(handle, do_close);
+			}
+			else {
+				result += 1;
+			}
+		}
+	}
+
+	libusb_free_device_list(devices, 1);
+	return result;
+}
+
+// One device's part in an asynchronous sweep. The interrupt read is
+// submitted ahead of the control message so it is already pending when
+// the device answers; if that submission fails it is chained from the
+// control callback instead.
+typedef struct async_query {
+	struct async_sweep *sweep;
+	device_handle *dh;
+	struct usb_dev_handle *handle;
+	struct timespec started;
+	long control_usec;	// or 0 until the control transfer is done
+	struct libusb_transfer *control;
+	struct libusb_transfer *interrupt;
+	unsigned char *setup;
+	unsigned char *data;
+	int interrupt_submitted;
+	int pending;
+	int failed;
+	int result;
+} async_query;
+
+typedef struct async_sweep {
+	const usb_query *query;
+	int (*do_result)(struct usb_dev_handle *, char *, int);
+	async_query *queries;
+	int count;
+	int next;
+	int done;
+	int result;
+	int aborted;
+} async_sweep;
+
+static int transfer_status_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+		case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+		default: return LIBUSB_ERROR_IO;
+	}
+}
+
+static void start_next_query(async_sweep *sweep);
+
+static void query_failed(async_query *aq, int r, char *info)
+{
+	if (!aq->failed) {
+		aq->failed = TRUE;
+		aq->result = usb_return(r, info);
+		count_usb_error(aq->dh, r);
+	}
+	if (aq->interrupt_submitted && aq->pending > 0)
+		libusb_cancel_transfer(aq->interrupt);
+}
+
+// Gives up on the rest of the sweep: nothing more is started and whatever
+// is in flight is cancelled. The queries are only done with once libusb
+// has handed back each of their transfers.
+static void abort_sweep(async_sweep *sweep, int r)
+{
+	int i;
+
+	sweep->result += r;
+	sweep->aborted = TRUE;
+	sweep->done += sweep->count - sweep->next;
+	sweep->next = sweep->count;
+	for (i = 0; i < sweep->count; i++) {
+		async_query *aq = &sweep->queries[i];
+		if (aq->pending > 0) {
+			query_failed(aq, r, "query_usb: sweep aborted");
+			libusb_cancel_transfer(aq->control);
+		}
+	}
+}
+
+// Runs once libusb has handed back every transfer of the query
+static void query_finished(async_query *aq)
+{
+	async_sweep *sweep = aq->sweep;
+
+	if (aq->pending > 0)
+		return;
+
+	aq->dh->query_usec = elapsed_usec(&aq->started);
+	if (!aq->failed)
+		adapt_timeout(aq->dh);
+	sweep->result += sweep->do_result(aq->handle, (char *)aq->data, aq->result);
+	pthread_mutex_unlock(&aq->dh->lock);
+	sweep->done++;
+	start_next_query(sweep);
+}
+
+static int submit_interrupt(async_query *aq)
+{
+	int r = libusb_submit_transfer(aq->interrupt);
+	if (r == 0) {
+		aq->interrupt_submitted = TRUE;
+		aq->pending++;
+	}
+	return r;
+}
+
+static void interrupt_callback(struct libusb_transfer *transfer)
+{
+	async_query *aq = (async_query *)transfer->user_data;
+
+	aq->pending--;
+	if (aq->control_usec > 0 && transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		stats_record(&aq->dh->stats.stages[STATS_READ], elapsed_usec(&aq->started) - aq->control_usec);
+	if (!aq->failed) {
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+			aq->result = usb_return(transfer->actual_length, "libusb interrupt transfer");
+		else
+			query_failed(aq, transfer_status_error(transfer->status), "libusb interrupt transfer");
+	}
+	query_finished(aq);
+}
+
+static void control_callback(struct libusb_transfer *transfer)
+{
+	async_query *aq = (async_query *)transfer->user_data;
+	int r;
+
+	aq->pending--;
+	aq->control_usec = elapsed_usec(&aq->started);
+	stats_record(&aq->dh->stats.stages[STATS_CONTROL], aq->control_usec);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		query_failed(aq, transfer_status_error(transfer->status), "libusb control transfer");
+	}
+	else {
+		usb_return(transfer->actual_length, "libusb control transfer");
+		if (!aq->interrupt_submitted && (r = submit_interrupt(aq)) < 0)
+			query_failed(aq, r, "libusb_submit_transfer (interrupt)");
+	}
+	query_finished(aq);
+}
+
+static void start_query(async_sweep *sweep, async_query *aq)
+{
+	const usb_query *q = sweep->query;
+	int r;
+
+	aq->sweep = sweep;
+
+	// Quarantined, or being queried by query_usb_held on another thread,
+	// which may well need this one to run libusb's events, so don't wait
+	if (skip_device_handle(aq->dh) || pthread_mutex_trylock(&aq->dh->lock) != 0) {
+		sweep->done++;
+		start_next_query(sweep);
+		return;
+	}
+	memset(aq->data, 0, q->datalength);
+	aq->control_usec = 0;
+	clock_gettime(CLOCK_MONOTONIC, &aq->started);
+
+	libusb_fill_interrupt_transfer(aq->interrupt, aq->handle, q->endpoint, 
+		aq->data, q->datalength, interrupt_callback, aq, 
+		aq->dh->timeout_ms ? aq->dh->timeout_ms : READ_TIMEOUT);
+	submit_interrupt(aq);
+
+	libusb_fill_control_setup(aq->setup, q->requesttype, q->request, q->value, 
+		q->index, q->qlength);
+	memcpy(aq->setup + LIBUSB_CONTROL_SETUP_SIZE, q->question, q->qlength);
+	libusb_fill_control_transfer(aq->control, aq->handle, aq->setup, 
+		control_callback, aq, aq->dh->timeout_ms ? aq->dh->timeout_ms : CONTROL_TIMEOUT);
+
+	if ((r = libusb_submit_transfer(aq->control)) < 0)
+		query_failed(aq, r, "libusb_submit_transfer (control)");
+	else
+		aq->pending++;
+
+	// Nothing was submitted, so no callback will ever finish this query
+	if (aq->pending == 0)
+		query_finished(aq);
+}
+
+static void start_next_query(async_sweep *sweep)
+{
+	if (sweep->next < sweep->count)
+		start_query(sweep, &sweep->queries[sweep->next++]);
+}
+
+// Issues the query to every open device and drives all the transfers from
+// this thread. Up to concurrency devices have transfers in flight at once.
+int query_usb(const usb_query *query, 
+	int (do_result)(struct usb_dev_handle *, char *, int), int concurrency)
+{
+	async_sweep sweep;
+	device_handle *dh;
+	int i, r;
+
+	memset(&sweep, 0, sizeof(sweep));
+	sweep.query = query;
+	sweep.do_result = do_result;
+	for (dh = device_handles; dh; dh = (device_handle *)dh->next)
+		sweep.count++;
+	if (sweep.count == 0)
+		return 0;
+
+	sweep.queries = (async_query *)calloc(sweep.count, sizeof(async_query));
+	if (!sweep.queries)
+		return -1;
+	for (i = 0, dh = device_handles; dh; dh = (device_handle *)dh->next, i++) {
+		async_query *aq = &sweep.queries[i];
+		aq->dh = dh;
+		aq->handle = dh->handle;
+		aq->control = libusb_alloc_transfer(0);
+		aq->interrupt = libusb_alloc_transfer(0);
+		aq->setup = (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + query->qlength);
+		aq->data = (unsigned char *)malloc(query->datalength);
+		if (!aq->control || !aq->interrupt || !aq->setup || !aq->data) {
+			libusb_free_transfer(aq->control);
+			libusb_free_transfer(aq->interrupt);
+			free(aq->setup);
+			free(aq->data);
+			// The rest of the devices go without this sweep
+			sweep.result += usb_return(LIBUSB_ERROR_NO_MEM, "query_usb: allocating transfers");
+			sweep.count = i;
+			break;
+		}
+	}
+
+	if (concurrency < 1)
+		concurrency = 1;
+	for (i = 0; i < concurrency; i++)
+		start_next_query(&sweep);
+
+	// Callbacks still to come point into sweep.queries and each started
+	// query holds its device's lock until it finishes, so even after an
+	// error the events are handled until every query has finished
+	while (sweep.done < sweep.count) {
+		struct timeval tv = { 1, 0 };
+		r = libusb_handle_events_timeout_completed(context, &tv, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usb_return(r, "libusb_handle_events_timeout_completed");
+			if (!sweep.aborted)
+				abort_sweep(&sweep, r);
+		}
+	}
+
+	for (i = 0; i < sweep.count; i++) {
+		libusb_free_transfer(sweep.queries[i].control);
+		libusb_free_transfer(sweep.queries[i].interrupt);
+		free(sweep.queries[i].setup);
+		free(sweep.queries[i].data);
+	}
+	free(sweep.queries);
+	return sweep.result;
+}
+
+static struct usb_dev_handle *open_handle_for_device(struct usb_device *dev, 
+	int (do_open)(struct usb_dev_handle *))
+{
+	struct device_handle *dh = get_device_handle_by_device(dev);
+	struct usb_dev_handle *handle;
+	int r = 0;
+
+	if (!dh) {
+		// Only open devices we have been asked to initialise
+		if (!do_open)
+			return NULL;
+		if (usb_return(libusb_open(dev, &handle), "libusb_open") < 0)
+			return NULL;
+		// Stash the new handle before do_open so that it can attach its
+		// own data. The registry compares device pointers, so hold on to
+		// this one.
+		if (!(dh = add_device_handle(libusb_ref_device(dev), handle))) {
+			libusb_close(handle);
+			libusb_unref_device(dev);
+			return NULL;
+		}
+		char bus_port[BUS_PORT_MAX] = {};
+		struct timespec started;
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		handle_bus_port(handle, bus_port);
+		name_device_handle(dh, bus_port);
+		stats_record(&dh->stats.stages[STATS_BUS_PORT], elapsed_usec(&started));
+
+		r = do_open(handle);
+		if (r < 0) {
+			libusb_close(handle);
+			libusb_unref_device(dev);
+			remove_device_handle(dh);
+			return NULL;
+		}
+	}
+	return dh->handle;
+}
+
+static int close_handle(struct usb_dev_handle *handle, 
+	int (do_close)(struct usb_dev_handle *))
+{
+	int r = 0;
+	if (do_close) {
+		r = do_close(handle);
+		libusb_close(handle);
+		usb_return(1, "libusb_close (void)");
+	}
+	return r;
+}
+
+// Drops the open handle for the device at (busnum, devnum), typically
+// after it has been unplugged. do_close may be NULL when the device is
+// already gone and there is nothing left to release.
+int forget_usb_device(int busnum, int devnum, int (do_close)(struct usb_dev_handle *))
+{
+	device_handle *dh;
+	u_int8_t bus_id, device_id;
+	int r = 0;
+
+	for (dh = device_handles; dh; dh = (device_handle *)dh->next) {
+		handle_bus_address(dh->handle, &bus_id, &device_id);
+		if (bus_id == busnum && device_id == devnum)
+			break;
+	}
+	if (!dh)
+		return -1;
+
+	retire_device_handle(dh);
+	if (do_close)
+		r = do_close(dh->handle);
+	libusb_close(dh->handle);
+	libusb_unref_device(dh->device);
+	usb_return(1, "libusb_close (void)");
+	remove_device_handle(dh);
+	return r;
+}
+
+int device_vendor_product_is(struct usb_device *device, u_int16_t vendor, u_int16_t product)
+{
+	struct libusb_device_descriptor descriptor;
+	if (libusb_get_device_descriptor(device, &descriptor) < 0)
+		return FALSE;
+	return (descriptor.idVendor == vendor && descriptor.idProduct == product);
+}
+
+int detach_driver(struct usb_dev_handle *handle, int interface_number)
+{
+	int r;
+	r = libusb_detach_kernel_driver(handle, interface_number);
+	r = usb_return(((r == LIBUSB_ERROR_NOT_FOUND)? 0 : r), "detach_driver: libusb_detach_kernel_driver");
+	
+	return r;
+}
+
+int set_configuration(struct usb_dev_handle *handle, int configuration)
+{
+	return usb_return(libusb_set_configuration(handle, configuration), "libusb_set_configuration");
+}
+
+int claim_interface(struct usb_dev_handle *handle, int interface_number)
+{
+	return usb_return(libusb_claim_interface(handle, interface_number), "libusb_claim_interface");
+}
+
+int release_interface(struct usb_dev_handle *handle, int interface_number)
+{
+	usb_return(libusb_release_interface(handle, interface_number), "libusb_release_interface");
+	return 1;
+}
+
+int restore_driver(struct usb_dev_handle *handle, int interface_number)
+{
+	return 0;
+}
+
+int control_message(struct usb_dev_handle *handle, int requesttype, int request, int value, 
+	int index, const char *pquestion, int qlength) 
+{
+	return control_message_within(handle, requesttype, request, value, index, pquestion, qlength, 0);
+}
+
+int control_message_within(struct usb_dev_handle *handle, int requesttype, int request, int value, 
+	int index, const char *pquestion, int qlength, int timeout) 
+{
+	unsigned char question[qlength];
+    
+	memcpy(question, pquestion, qlength);
+
+	return usb_return(libusb_control_transfer(handle, requesttype, request, value, index, 
+			question, qlength, (timeout > 0) ? timeout : CONTROL_TIMEOUT),
+			"libusb_control_transfer");
+}
+
+int interrupt_read(struct usb_dev_handle *handle, int ep, char *data, int datalength)
+{
+	return interrupt_read_within(handle, ep, data, datalength, 0);
+}
+
+int interrupt_read_within(struct usb_dev_handle *handle, int ep, char *data, int datalength, int timeout)
+{
+	int transferred = 0;
+	int r = usb_return(libusb_interrupt_transfer(handle, ep, (unsigned char *)data, 
+			datalength, &transferred, (timeout > 0) ? timeout : READ_TIMEOUT),
+			"libusb_interrupt_transfer");
+	
+	return (r < 0) ? r : transferred;
+}
+
+int reset_usb_device(struct usb_dev_handle *handle)
+{
+	return usb_return(libusb_reset_device(handle), "libusb_reset_device");
+}
+
+int handle_bus_address(struct usb_dev_handle *handle, u_int8_t *bus_id, u_int8_t *device_id)
+{
+	struct usb_device *device = libusb_get_device(handle);
+	*bus_id = libusb_get_bus_number(device);
+	*device_id = libusb_get_device_address(device);
+	
+	return (*bus_id > 0 && *device_id > 0);
+}
+
+// libusb-1.0 reports the port chain itself, so unlike the libusb-0.1
+// backend this needs no sysfs lookup. The name matches the sysfs one.
+int handle_bus_port(struct usb_dev_handle *handle, char *bus_port)
+{
+	struct usb_device *device = libusb_get_device(handle);
+	u_int8_t ports[MAX_PORT_DEPTH];
+	int i, n, len;
+
+	len = sprintf(bus_port, "%d", libusb_get_bus_number(device));
+	n = libusb_get_port_numbers(device, ports, MAX_PORT_DEPTH);
+	for (i = 0; i < n; i++)
+		len += sprintf(bus_port + len, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+	
+	if (debug) fprintf(stderr, "device_bus_port: (%s) %p\n", bus_port, bus_port);
+	return (1);
+}
@@ -0,0 +1,341 @@
+/*
+ * usbhelpersim.c by Andrew Mannering (c) 2012 (andrewm@sledgehammersolutions.co.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Simulated TEMPer1s behind usbhelper.h, so that the sweeps, the daemon
+// and everything downstream can be run and measured without the hardware.
+// Select it with 'make USB_BACKEND=sim' and describe the devices in
+// TEMPER1_SIM as comma separated key=value pairs:
+//   devices=N       number of TEMPer1s (1)
+//   latency=MS      time each read takes (20)
+//   jitter=MS       up to this much more, at random (0)
+//   timeouts=PCT    reads that time out (0), after
+//   timeout=MS      this long (100), or the caller's timeout if shorter
+//   stuck=N         the first N devices time out every read until reset
+//   zeros=PCT       reads that come back as all zeros (0)
+//   wave=NAME       constant, sine, ramp or noise (sine)
+//   base=C          mean temperature (20)
+//   amplitude=C     swing either side of it (2)
+//   period=S        of sine and ramp (3600)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "usbhelper.h"
+#include "devicehelper.h"
+
+#define SIM_VENDOR_ID 0x0c45
+#define SIM_PRODUCT_ID 0x7401
+#define SIM_DEVICES_PER_BUS 100
+#define WAVE_CONSTANT 0
+#define WAVE_SINE 1
+#define WAVE_RAMP 2
+#define WAVE_NOISE 3
+
+struct usb_device {
+	int busnum;
+	int devnum;
+	int index;
+	int stuck;
+};
+
+struct usb_dev_handle {
+	struct usb_device *device;
+	unsigned int seed;	// only used by whoever holds the handle's lock
+	int timed_out;
+};
+
+static struct sim_settings {
+	int devices;
+	int latency_ms;
+	int jitter_ms;
+	int timeout_percent;
+	int timeout_ms;
+	int stuck;
+	int zero_percent;
+	int wave;
+	double base;
+	double amplitude;
+	double period;
+} sim = { 1, 20, 0, 0, 100, 0, 0, WAVE_SINE, 20.0, 2.0, 3600.0 };
+
+static struct usb_device *sim_devices = NULL;
+static int debug = FALSE;
+
+static void parse_settings(const char *settings)
+{
+	char *copy = strdup(settings), *item, *save = NULL;
+	char name[32], value[32];
+
+	for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (sscanf(item, "%31[^=]=%31s", name, value) != 2)
+			continue;
+		if (strcmp(name, "devices") == 0) sim.devices = atoi(value);
+		else if (strcmp(name, "latency") == 0) sim.latency_ms = atoi(value);
+		else if (strcmp(name, "jitter") == 0) sim.jitter_ms = atoi(value);
+		else if (strcmp(name, "timeouts") == 0) sim.timeout_percent = atoi(value);
+		else if (strcmp(name, "timeout") == 0) sim.timeout_ms = atoi(value);
+		else if (strcmp(name, "stuck") == 0) sim.stuck = atoi(value);
+		else if (strcmp(name, "zeros") == 0) sim.zero_percent = atoi(value);
+		else if (strcmp(name, "base") == 0) sim.base = atof(value);
+		else if (strcmp(name, "amplitude") == 0) sim.amplitude = atof(value);
+		else if (strcmp(name, "period") == 0) sim.period = atof(value);
+		else if (strcmp(name, "wave") == 0) {
+			if (strcmp(value, "constant") == 0) sim.wave = WAVE_CONSTANT;
+			else if (strcmp(value, "ramp") == 0) sim.wave = WAVE_RAMP;
+			else if (strcmp(value, "noise") == 0) sim.wave = WAVE_NOISE;
+			else sim.wave = WAVE_SINE;
+		}
+		else fprintf(stderr, "usbhelpersim: unknown setting %s\n", name);
+	}
+	free(copy);
+	if (sim.devices < 0)
+		sim.devices = 0;
+	if (sim.period <= 0)
+		sim.period = 3600.0;
+}
+
+void initialise_usb(int verbose)
+{
+	const char *settings = getenv("TEMPER1_SIM");
+	int i;
+
+	debug = verbose;
+	if (settings)
+		parse_settings(settings);
+
+	sim_devices = (struct usb_device *)calloc(sim.devices ? sim.devices : 1, sizeof(struct usb_device));
+	for (i = 0; i < sim.devices; i++) {
+		sim_devices[i].busnum = 1 + i / SIM_DEVICES_PER_BUS;
+		sim_devices[i].devnum = 2 + i % SIM_DEVICES_PER_BUS;
+		sim_devices[i].index = i;
+		sim_devices[i].stuck = (i < sim.stuck);
+	}
+	if (verbose) 
+		fprintf(stderr, "Simulating %d TEMPer1(s), %d+%dms per read\n", sim.devices, sim.latency_ms, sim.jitter_ms);
+}
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	while (ms > 0 && nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static int chance(usb_dev_handle *handle, int percent)
+{
+	return percent > 0 && (int)(rand_r(&handle->seed) % 100) < percent;
+}
+
+// Each device is offset a little so that they can be told apart
+static double temperature(usb_dev_handle *handle)
+{
+	struct timespec now;
+	double t, phase;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	t = now.tv_sec + now.tv_nsec / 1e9;
+	phase = fmod(t, sim.period) / sim.period;
+	t = sim.base + handle->device->index * 0.01;
+
+	switch (sim.wave) {
+		case WAVE_SINE:
+			return t + sim.amplitude * sin(2 * M_PI * phase);
+		case WAVE_RAMP:
+			return t - sim.amplitude + 2 * sim.amplitude * phase;
+		case WAVE_NOISE:
+			return t + sim.amplitude * (2.0 * rand_r(&handle->seed) / RAND_MAX - 1.0);
+		default:
+			return t;
+	}
+}
+
+int iterate_usb(int (is_interesting)(struct usb_device *), 
+	int (do_open)(struct usb_dev_handle *),
+	int (do_process)(struct usb_dev_handle *),
+	int (do_close)(struct usb_dev_handle *)
+	)
+{
+	int i, r, result = 0;
+
+	for (i = 0; i < sim.devices; i++) {
+		struct usb_device *dev = &sim_devices[i];
+		if (!is_interesting(dev))
+			continue;
+
+		device_handle *dh = get_device_handle_by_device(dev);
+		if (!dh) {
+			if (!do_open)
+				continue;
+			usb_dev_handle *handle = (usb_dev_handle *)calloc(1, sizeof(usb_dev_handle));
+			handle->device = dev;
+			handle->seed = i + 1;
+			if (!(dh = add_device_handle(dev, handle))) {
+				free(handle);
+				result += 1;
+				continue;
+			}
+			char bus_port[BUS_PORT_MAX] = {};
+			struct timespec started;
+			clock_gettime(CLOCK_MONOTONIC, &started);
+			handle_bus_port(handle, bus_port);
+			name_device_handle(dh, bus_port);
+			stats_record(&dh->stats.stages[STATS_BUS_PORT], elapsed_usec(&started));
+			if ((r = do_open(handle)) < 0) {
+				remove_device_handle(dh);
+				free(handle);
+				result += 1;
+				continue;
+			}
+		}
+		if (do_process)
+			result += do_process(dh->handle);
+		if (do_close)
+			result += do_close(dh->handle);
+	}
+	return result;
+}
+
+int query_usb(const usb_query *query, 
+	int (do_result)(struct usb_dev_handle *, char *, int), int concurrency)
+{
+	return sweep_query(query, do_result, concurrency);
+}
+
+int forget_usb_device(int busnum, int devnum, int (do_close)(struct usb_dev_handle *))
+{
+	device_handle *dh;
+	usb_dev_handle *handle;
+	int r = 0;
+
+	for (dh = device_handles; dh; dh = (device_handle *)dh->next) {
+		if (dh->handle->device->busnum == busnum && dh->handle->device->devnum == devnum)
+			break;
+	}
+	if (!dh)
+		return -1;
+
+	retire_device_handle(dh);
+	if (do_close)
+		r = do_close(dh->handle);
+	handle = dh->handle;
+	remove_device_handle(dh);
+	free(handle);
+	return r;
+}
+
+int device_vendor_product_is(struct usb_device *device, u_int16_t vendor, u_int16_t product)
+{
+	return (vendor == SIM_VENDOR_ID && product == SIM_PRODUCT_ID);
+}
+
+int detach_driver(struct usb_dev_handle *handle, int interface_number)
+{
+	return 0;
+}
+
+int set_configuration(struct usb_dev_handle *handle, int configuration)
+{
+	return 0;
+}
+
+int claim_interface(struct usb_dev_handle *handle, int interface_number)
+{
+	return 0;
+}
+
+int release_interface(struct usb_dev_handle *handle, int interface_number)
+{
+	return 1;
+}
+
+int restore_driver(struct usb_dev_handle *handle, int interface_number)
+{
+	return 0;
+}
+
+int control_message(struct usb_dev_handle *handle, int requesttype, int request, int value, 
+	int index, const char *pquestion, int qlength) 
+{
+	return control_message_within(handle, requesttype, request, value, index, pquestion, qlength, 0);
+}
+
+// A timeout is decided here and served by the read that follows
+int control_message_within(struct usb_dev_handle *handle, int requesttype, int request, int value, 
+	int index, const char *pquestion, int qlength, int timeout) 
+{
+	handle->timed_out = handle->device->stuck || chance(handle, sim.timeout_percent);
+	return qlength;
+}
+
+int interrupt_read(struct usb_dev_handle *handle, int ep, char *data, int datalength)
+{
+	return interrupt_read_within(handle, ep, data, datalength, 0);
+}
+
+int interrupt_read_within(struct usb_dev_handle *handle, int ep, char *data, int datalength, int timeout)
+{
+	int raw, latency;
+
+	latency = sim.latency_ms + (sim.jitter_ms > 0 ? (int)(rand_r(&handle->seed) % (sim.jitter_ms + 1)) : 0);
+	if (handle->timed_out)
+		latency = sim.timeout_ms;
+	if (timeout > 0 && latency > timeout) {
+		sleep_ms(timeout);
+		handle->timed_out = TRUE;
+	}
+	else {
+		sleep_ms(latency);
+	}
+	if (handle->timed_out) {
+		if (debug) fprintf(stderr, "usbhelpersim: read timed out\n");
+		return -ETIMEDOUT;
+	}
+
+	memset(data, 0, datalength);
+	if (chance(handle, sim.zero_percent) || datalength < 4)
+		return datalength;
+
+	// Big endian 1/256ths of a degree, as a TEMPer1 sends it
+	raw = (int)lround(temperature(handle) * 256.0);
+	data[2] = (raw >> 8) & 0xff;
+	data[3] = raw & 0xff;
+	return datalength;
+}
+
+int reset_usb_device(struct usb_dev_handle *handle)
+{
+	handle->device->stuck = FALSE;
+	return 0;
+}
+
+int handle_bus_address(struct usb_dev_handle *handle, u_int8_t *bus_id, u_int8_t *device_id)
+{
+	*bus_id = handle->device->busnum;
+	*device_id = handle->device->devnum;
+	return (1);
+}
+
+int handle_bus_port(struct usb_dev_handle *handle, char *bus_port)
+{
+	sprintf(bus_port, "%d-%d", handle->device->busnum, handle->device->devnum - 1);
+	return (1);
+}